@@ -0,0 +1,591 @@
+// benchmark on synthetic bayer frames with a known poisson-gaussian noise
+// model. times the stages separately and checks that noiseprofile() finds
+// the noise model again, so speedups can't silently break the estimation.
+#include "wtf.h"
+#include "tasks.h"
+#include "noiseprofile.h"
+
+#include <time.h>
+
+static double now()
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// xorshift64*, one stream per row so the frame doesn't depend on the threads
+static inline uint64_t rng_next(uint64_t *s)
+{
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 2685821657736338717ull;
+}
+
+static inline double rng_uniform(uint64_t *s)
+{
+  return ((rng_next(s) >> 11) + 0.5) * (1.0/9007199254740992.0);
+}
+
+static inline double rng_gauss(uint64_t *s)
+{
+  const double u = rng_uniform(s), v = rng_uniform(s);
+  return sqrt(-2.0*log(u))*cos(2.0*3.14159265358979323846*v);
+}
+
+static inline double rng_poisson(uint64_t *s, const double lambda)
+{
+  if(lambda > 64.0) // normal approximation is good enough here
+    return fmax(0.0, floor(lambda + sqrt(lambda)*rng_gauss(s) + 0.5));
+  const double l = exp(-lambda);
+  double k = 0.0, p = rng_uniform(s);
+  while(p > l)
+  {
+    p *= rng_uniform(s);
+    k += 1.0;
+  }
+  return k;
+}
+
+// synthetic rggb frame: a horizontal ramp from black to white, optionally with
+// step edges and texture on top, and noise with variance a*x + b.
+static buffer_t *generate(
+    const int wd,
+    const int ht,
+    const double a,
+    const double b,
+    const int black,
+    const int white,
+    const int edges,
+    const int texture)
+{
+  buffer_t *buf = (buffer_t *)malloc(sizeof(buffer_t));
+  memset(buf, 0, sizeof(buffer_t));
+  buf->type = s_buf_raw;
+  buf->width = wd;
+  buf->height = ht;
+  buf->white = 65535.0f;
+  buf->cfa = cfa_rggb;
+  buf->data = numa_alloc(sizeof(uint16_t)*wd*ht); // first touched by the rows below
+#pragma omp parallel for default(shared)
+  for(int j=0;j<ht;j++)
+  {
+    uint64_t s = 0x9e3779b97f4a7c15ull * (j+1);
+    uint16_t *out = buffer_row_raw(buf, j);
+    for(int i=0;i<wd;i++)
+    {
+      double x = black + (white - black)*(i + 0.5)/wd;
+      if(edges && ((i/64 + j/64) & 1)) x = black + 0.5*(x - black);
+      if(texture) x *= 1.0 + 0.05*sin(0.7*i)*sin(0.9*j);
+      const double signal = rng_poisson(&s, (x - black)/a)*a; // shot noise
+      const double v = black + signal + sqrt(b + a*black)*rng_gauss(&s); // read noise
+      out[i] = CLAMP(v + 0.5, 0, 65535);
+    }
+  }
+  return buf;
+}
+
+// report one stage: bytes is the compulsory memory traffic per pixel
+static void report(
+    const char *stage,
+    const int scale,
+    const int wd,
+    const int ht,
+    const double bytes,
+    const double seconds)
+{
+  const double mp = wd*(double)ht*1e-6;
+  printf("%-24s ", stage);
+  if(scale >= 0) printf("%5d ", scale);
+  else printf("%5s ", "-");
+  printf("%10.1f %10.2f %10.3f\n", mp/seconds, mp*bytes*1e-3/seconds, 1e3*seconds);
+}
+
+// expected variance of the HH band relative to the pixel noise, per channel
+// (the scale 0 filter keeps a fraction of the noise in the coarse band, green
+// includes the corr factor in noiseprofile()). measured with the reference
+// implementation on a plain ramp.
+static const double hh_gain[3] = {0.292, 0.2535, 0.292};
+
+// lowest acceptable psnr of the fast mode against the full kernel. the
+// separable passes lose some edge preservation: around 70 dB with -e or -t,
+// far above that on the plain ramp.
+static const double fast_psnr_min = 60.0;
+
+// check the fitted model against the generated one, the slope to 5% and the
+// variance at a few brightness levels in between black and white to 10% (the
+// fit runs a few percent high in the shadows). returns 0 if it's good.
+static int check_profile(
+    const noise_profile_t *prof,
+    const double a,
+    const double b,
+    const int black,
+    const int white)
+{
+  int err = 0;
+  for(int c=0;c<3;c++)
+  {
+    const double ra = prof->a[c]/(hh_gain[c]*a);
+    double worst = 1.0;
+    for(int i=1;i<10;i++)
+    {
+      const double x = black + (white - black)*i/10.0;
+      const double r = (prof->a[c]*x + prof->b[c])/(hh_gain[c]*(a*x + b));
+      if(fabs(r - 1.0) > fabs(worst - 1.0)) worst = r;
+    }
+    const int bad = fabs(ra - 1.0) > 0.05 || fabs(worst - 1.0) > 0.1;
+    printf("noise model channel %d: a %g b %g, slope %.3f variance %.3f of expected %s\n",
+        c, prof->a[c], prof->b[c], ra, worst, bad ? "FAILED" : "ok");
+    err |= bad;
+  }
+  return err;
+}
+
+// one row of samples as a bit stream the way unpack_sample() reads it, one
+// bit at a time to stay independent of the unpacking code.
+static void pack_row(
+    const uint16_t *in,
+    uint8_t *out,
+    const int n,
+    const int bits,
+    const int msb)
+{
+  memset(out, 0, ((size_t)n*bits + 7)/8);
+  for(int i=0;i<n;i++)
+  {
+    const int v = MIN(in[i], (1 << bits) - 1);
+    for(int k=0;k<bits;k++)
+    { // k-th bit of the sample in stream order
+      const size_t bit = (size_t)i*bits + k;
+      const int b = msb ? (v >> (bits-1-k)) & 1 : (v >> k) & 1;
+      out[bit >> 3] |= b << (msb ? 7 - (bit & 7) : bit & 7);
+    }
+  }
+}
+
+static void put32(FILE *f, const uint32_t v)
+{
+  const uint8_t b[4] = {v, v >> 8, v >> 16, v >> 24};
+  fwrite(b, 1, 4, f);
+}
+
+static void put_entry(FILE *f, const int tag, const int type, const uint32_t count, const uint32_t value)
+{
+  const uint8_t b[4] = {tag, tag >> 8, type, type >> 8};
+  fwrite(b, 1, 4, f);
+  put32(f, count);
+  put32(f, value); // inline values are left justified, which little endian is
+}
+
+// small little endian dng as rawfile.h reads it: strips of 16 rows of packed
+// samples, the 2x2 cfa pattern and the levels. the frame is the active area
+// of an image with one more row and column on top and to the left, so the
+// pattern has to be taken relative to the active area, and the samples go
+// through a linearisation table that flips their lowest bit. the camera and
+// iso name the noise profile.
+static void write_dng(
+    const char *filename,
+    const buffer_t *raw,
+    const int bits,
+    const int black,
+    const int white)
+{
+  FILE *f = fopen(filename, "wb");
+  if(!f) return;
+  const int wd = raw->width + 1, ht = raw->height + 1, rows = 16, strips = (ht + rows - 1)/rows;
+  const size_t stride = ((size_t)wd*bits + 7)/8;
+  const uint32_t entries = 20, tables = 8 + 2 + 12*entries + 4, area = tables + 8*strips;
+  const uint32_t make = area + 16, model = make + 8, exif = model + 24, curve = exif + 20, data = curve + 2*(1 << bits);
+  fwrite("II*\0", 1, 4, f);
+  put32(f, 8);
+  const uint8_t num[2] = {entries, 0};
+  fwrite(num, 1, 2, f);
+  const cfa_t *c = &raw->cfa;
+  put_entry(f, 254, 4, 1, 0);                 // NewSubFileType, main image
+  put_entry(f, 256, 4, 1, wd);
+  put_entry(f, 257, 4, 1, ht);
+  put_entry(f, 258, 3, 1, bits);
+  put_entry(f, 259, 3, 1, 1);                 // uncompressed
+  put_entry(f, 262, 3, 1, 32803);             // cfa
+  put_entry(f, 271, 2, 6, make);
+  put_entry(f, 272, 2, 21, model);
+  put_entry(f, 273, 4, strips, strips > 1 ? tables : data);
+  put_entry(f, 277, 3, 1, 1);
+  put_entry(f, 278, 4, 1, rows);
+  put_entry(f, 279, 4, strips, strips > 1 ? tables + 4*strips : stride*ht);
+  put_entry(f, 33421, 3, 2, 2 | 2 << 16);     // CFARepeatPatternDim
+  put_entry(f, 33422, 1, 4, c->c[0][0] | c->c[0][1] << 8 | c->c[1][0] << 16 | c->c[1][1] << 24);
+  put_entry(f, 34665, 4, 1, exif);            // ExifIFD
+  put_entry(f, 50706, 1, 4, 1 | 4 << 8);      // DNGVersion 1.4
+  put_entry(f, 50712, 3, 1 << bits, curve);   // LinearizationTable
+  put_entry(f, 50714, 4, 1, black);
+  put_entry(f, 50717, 4, 1, white);
+  put_entry(f, 50829, 4, 4, area);            // ActiveArea
+  put32(f, 0); // no next ifd
+  if(strips > 1)
+  {
+    for(int s=0;s<strips;s++) put32(f, data + s*rows*stride);
+    for(int s=0;s<strips;s++) put32(f, MIN(rows, ht - s*rows)*stride);
+  }
+  put32(f, 1); put32(f, 1); put32(f, ht); put32(f, wd);
+  fwrite("Canon\0\0\0" "Canon EOS 5D Mark II\0\0\0", 1, 32, f);
+  fwrite("\1\0", 1, 2, f);
+  put_entry(f, 34855, 3, 1, 1600);            // ISOSpeedRatings
+  put32(f, 0);
+  fwrite("\0\0", 1, 2, f);
+  for(int v=0;v<(1 << bits);v++)
+  {
+    const uint8_t b[2] = {v ^ 1, (v ^ 1) >> 8};
+    fwrite(b, 1, 2, f);
+  }
+  uint8_t *row = (uint8_t *)malloc(stride);
+  uint16_t *in = (uint16_t *)calloc(wd, sizeof(uint16_t));
+  pack_row(in, row, wd, bits, 1);
+  fwrite(row, 1, stride, f);
+  for(int j=1;j<ht;j++)
+  {
+    for(int i=1;i<wd;i++) in[i] = MIN(buffer_row_raw(raw, j-1)[i-1], (1 << bits) - 1) ^ 1;
+    pack_row(in, row, wd, bits, 1);
+    fwrite(row, 1, stride, f);
+  }
+  free(in);
+  free(row);
+  fclose(f);
+}
+
+// number of samples of b that differ from the ones of raw clipped to bits
+static size_t compare_raw(
+    const buffer_t *b,
+    const buffer_t *raw,
+    const int bits)
+{
+  if(!b || b->width != raw->width || b->height != raw->height) return (size_t)raw->width*raw->height;
+  size_t differ = 0;
+  for(int j=0;j<raw->height;j++)
+    for(int i=0;i<raw->width;i++)
+      differ += buffer_row_raw(b, j)[i] != MIN(buffer_row_raw(raw, j)[i], (1 << bits) - 1);
+  return differ;
+}
+
+// comma separated list of integers
+static int parse_list(
+    const char *str,
+    int *list,
+    const int max)
+{
+  int num = 0;
+  while(num < max && *str)
+  {
+    list[num++] = atol(str);
+    while(*str && *str != ',') str++;
+    if(*str) str++;
+  }
+  return num;
+}
+
+int main(int argc, char *argv[])
+{
+  const int black = 1023, white = 15600;
+  double a = 2.0, b = 100.0;
+  int sizes[16] = {1, 4, 12}, num_sizes = 3;
+  int edges = 0, texture = 0;
+  for(int k=1;k<argc;k++)
+  {
+    if(!strcmp(argv[k], "-s") && k+1 < argc) num_sizes = parse_list(argv[++k], sizes, 16);
+    else if(!strcmp(argv[k], "-a") && k+1 < argc) a = atof(argv[++k]);
+    else if(!strcmp(argv[k], "-b") && k+1 < argc) b = atof(argv[++k]);
+    else if(!strcmp(argv[k], "-e")) edges = 1;
+    else if(!strcmp(argv[k], "-t")) texture = 1;
+    else
+    {
+      fprintf(stderr, "usage: %s [-s megapixels,..] [-a noise_a] [-b noise_b] [-e] [-t]\n", argv[0]);
+      fprintf(stderr, "  -s list  frame sizes in megapixels, defaults to 1,4,12\n");
+      fprintf(stderr, "  -a, -b   noise model of the synthetic frames, variance = a*x + b\n");
+      fprintf(stderr, "  -e, -t   add step edges and texture (skips the noise model check)\n");
+      exit(1);
+    }
+  }
+  if(b + a*black < 0.0)
+  {
+    fprintf(stderr, "b + a*black has to be positive\n");
+    exit(1);
+  }
+  numa_bind_threads(); // same placement as main(), see numa.h
+
+  int err = 0;
+  for(int k=0;k<num_sizes;k++)
+  {
+    // 3:2 frames with even dimensions, so the cfa pattern is complete:
+    const int wd = 2*(int)(sqrt(sizes[k]*1e6*1.5)/2), ht = 2*(int)(wd/1.5/2);
+    printf("\n%dx%d (%.1f MP), noise a %g b %g%s%s, %d threads\n", wd, ht, wd*(double)ht*1e-6, a, b,
+        edges ? ", edges" : "", texture ? ", texture" : "", numa_threads());
+    printf("%-24s %5s %10s %10s %10s\n", "stage", "scale", "MP/s", "GB/s", "ms");
+    double t;
+    buffer_t *raw = generate(wd, ht, a, b, black, white, edges, texture);
+
+    // i/o through a 16-bit pgm and a pfm file:
+    const char *pgm = "bench.pgm", *pfm = "bench.pfm";
+    FILE *f = fopen(pgm, "wb");
+    if(!f) exit(1);
+    fprintf(f, "P5\n%d %d\n65535\n", wd, ht);
+    uint8_t *row = (uint8_t *)malloc(2*wd);
+    for(int j=0;j<ht;j++)
+    {
+      const uint16_t *in = buffer_row_raw(raw, j);
+      for(int i=0;i<wd;i++) { row[2*i] = in[i] >> 8; row[2*i+1] = in[i] & 0xff; }
+      fwrite(row, 2, wd, f);
+    }
+    free(row);
+    fclose(f);
+    t = now();
+    buffer_t *read = buffer_read_raw(pgm, 0);
+    report("read_pgm16", -1, wd, ht, 2+2, now()-t);
+    if(!read || memcmp(read->data, raw->data, sizeof(uint16_t)*wd*ht))
+    {
+      printf("read_pgm16 doesn't give back the frame FAILED\n");
+      err = 1;
+    }
+    if(read) buffer_destroy(read);
+
+    // packed samples: a 14-bit dng with its metadata, and a 12-bit dump with
+    // the other bit order:
+    const char *dng = "bench.dng", *dump = "bench.raw";
+    write_dng(dng, raw, 14, black, white);
+    t = now();
+    read = buffer_read_raw(dng, 0);
+    report("read_dng14", -1, wd, ht, 14/8.0+2, now()-t);
+    size_t bad = compare_raw(read, raw, 14);
+    if(bad || read->black != black || read->white != white || memcmp(&read->cfa, &raw->cfa, sizeof(cfa_t)))
+    {
+      printf("read_dng14 doesn't give back the frame (%zu samples bad) or its metadata FAILED\n", bad);
+      err = 1;
+    }
+    if(read) buffer_destroy(read);
+    rawfile_t info;
+    if(rawfile_open(dng, 0, &info) || strcmp(info.camera, "Canon_EOS_5D_Mark_II") || info.iso != 1600)
+    {
+      printf("read_dng14 doesn't give back the camera and iso FAILED\n");
+      err = 1;
+    }
+    rawfile_close(&info);
+    remove(dng);
+    f = fopen(dump, "wb");
+    if(!f) exit(1);
+    const size_t stride = ((size_t)wd*12 + 7)/8;
+    uint8_t *packed = (uint8_t *)malloc(stride);
+    for(int j=0;j<ht;j++)
+    {
+      pack_row(buffer_row_raw(raw, j), packed, wd, 12, 0);
+      fwrite(packed, 1, stride, f);
+    }
+    free(packed);
+    fclose(f);
+    const rawfile_dump_t layout = {wd, ht, 12, 0, 0, 0};
+    t = now();
+    read = buffer_read_raw(dump, &layout);
+    report("read_dump12", -1, wd, ht, 12/8.0+2, now()-t);
+    bad = compare_raw(read, raw, 12);
+    if(bad)
+    {
+      printf("read_dump12 doesn't give back the frame, %zu samples bad FAILED\n", bad);
+      err = 1;
+    }
+    if(read) buffer_destroy(read);
+    remove(dump);
+
+    noise_profile_t prof;
+    t = now();
+    noiseprofile(raw, 0, black, white, &prof);
+    report("noiseprofile", 0, wd, ht, 3*(2+4+4) + 2+4, now()-t);
+    if(!edges && !texture) err |= check_profile(&prof, a, b, black, white);
+
+    // denoise with the measured model, the same way main() does:
+    raw->noise_a = (prof.a[0] + prof.a[1] + prof.a[2])/3.0f;
+    raw->noise_b = (prof.b[0] + prof.b[1] + prof.b[2])/3.0f;
+    t = now();
+    buffer_t *input = buffer_read_raw_stabilise(pgm, 0, raw->noise_a, raw->noise_b, 0, 0, 1);
+    report("read_raw_stabilise", -1, wd, ht, 2+4, now()-t);
+    remove(pgm);
+
+    buffer_t *coarse[3], *detail[3], *output[2];
+    for(int s=0;s<3;s++)
+    {
+      coarse[s] = buffer_create_float(wd, ht);
+      detail[s] = buffer_create_float(wd, ht);
+      coarse[s]->noise_a = raw->noise_a;
+      coarse[s]->noise_b = raw->noise_b;
+    }
+    for(int s=0;s<2;s++)
+    {
+      output[s] = buffer_create_float(wd, ht);
+      output[s]->noise_a = raw->noise_a;
+      output[s]->noise_b = raw->noise_b;
+    }
+
+    // what the memory gives at all, to compare the GB/s of the stages with:
+    t = now();
+#pragma omp parallel for default(shared)
+    for(int y=0;y<ht;y++)
+      for(int c=0;c<3;c++) memcpy(buffer_row(coarse[1], c, y), buffer_row(coarse[0], c, y), sizeof(float)*wd);
+    report("copy", -1, wd, ht, 12+12, now()-t);
+
+    t = now();
+    for(int c=0;c<3;c++) decompose_raw(raw, coarse[0], detail[0], c, 0);
+    report("decompose_raw", 0, wd, ht, 3*(2+4+4), now()-t);
+    // the integer kernel of the noise profiling against it:
+    t = now();
+    decompose_raw16(raw, coarse[1], detail[1]);
+    report("decompose_int", 0, wd, ht, 2+3*(4+4), now()-t);
+    size_t mismatch = 0;
+    for(int k=0;k<3;k++)
+      for(size_t i=0;i<(size_t)wd*ht;i++)
+        mismatch += buffer_row(coarse[0], k, 0)[i] != buffer_row(coarse[1], k, 0)[i]
+                 || buffer_row(detail[0], k, 0)[i] != buffer_row(detail[1], k, 0)[i];
+    if(mismatch)
+    {
+      printf("decompose_int differs from decompose_raw in %zu samples FAILED\n", mismatch);
+      err = 1;
+    }
+
+    for(int s=0;s<3;s++)
+    {
+      const buffer_t *in = s ? coarse[s-1] : input;
+      const double in_bytes = s ? 12 : 4;
+      t = now();
+      for(int c=0;c<3;c++) decompose(in, coarse[s], detail[s], c, s);
+      report("decompose", s, wd, ht, 3*(in_bytes+4+4), now()-t);
+      t = now();
+      decompose_fused(in, coarse[s], detail[s], s);
+      report("decompose_fused", s, wd, ht, in_bytes+12+12, now()-t);
+    }
+
+    for(int s=2;s>=0;s--)
+    {
+      buffer_t *out = output[s&1];
+      const buffer_t *co = s == 2 ? coarse[2] : output[(s+1)&1];
+      t = now();
+      for(int c=0;c<3;c++) synthesize(out, co, detail[s], c, s);
+      report("synthesize", s, wd, ht, 12+12+12, now()-t);
+    }
+
+    output[0]->type = s_buf_float_backtransform;
+    output[0]->black = black;
+    output[0]->white = white;
+    t = now();
+    buffer_write_pfm(output[0], pfm);
+    report("write_pfm", -1, wd, ht, 12+12, now()-t);
+    remove(pfm);
+
+    // output[1] is scratch from here on:
+    t = now();
+    buffer_backtransform(output[1], black, white);
+    report("backtransform", -1, wd, ht, 12+12, now()-t);
+    printf("backtransform max error %g of white\n",
+        backtransform_error(raw->noise_a, (raw->noise_b/raw->noise_a)*(raw->noise_b/raw->noise_a), black, white));
+
+    // decimated pyramid on top of the same scale 0, output[1] is scratch:
+    buffer_t *dco[3] = {coarse[0]}, *dde[3] = {detail[0]}, *even[3] = {0};
+    for(int s=1;s<3;s++)
+    {
+      const int dwd = decimated_size(wd, s-1), dht = decimated_size(ht, s-1);
+      dco[s] = buffer_create_float(decimated_size(wd, s), decimated_size(ht, s));
+      dde[s] = buffer_create_float(dwd, dht);
+      even[s] = buffer_create_float(decimated_size(wd, s), decimated_size(ht, s));
+      t = now();
+      decompose_decimated(dco[s-1], dco[s], dde[s], even[s], s);
+      report("decompose_decimated", s, dwd, dht, 12+12+3+12, now()-t);
+    }
+    buffer_t *dec = buffer_create_float(wd, ht);
+    dec->noise_a = raw->noise_a;
+    dec->noise_b = raw->noise_b;
+    buffer_t dout[2] = {*dec, *output[1]}; // used at the size of each level
+    for(int s=2;s>=0;s--)
+    {
+      buffer_t *out = dout + (s&1);
+      out->width = dde[s]->width;
+      out->height = dde[s]->height;
+      const buffer_t *co = s == 2 ? dco[2] : dout + ((s+1)&1);
+      t = now();
+      for(int c=0;c<3;c++) synthesize(out, co, dde[s], c, s);
+      report("synthesize_decimated", s, out->width, out->height, 12+3+12+12, now()-t);
+    }
+    dec->type = s_buf_float_backtransform;
+    dec->black = black;
+    dec->white = white;
+    printf("decimated psnr %.1f dB against the full pyramid\n", buffer_psnr(dec, output[0]));
+    for(int s=1;s<3;s++)
+    {
+      buffer_destroy(dco[s]);
+      buffer_destroy(dde[s]);
+      buffer_destroy(even[s]);
+    }
+    buffer_destroy(dec);
+
+    // fast mode on the same input, output[1] is scratch:
+    buffer_t *fast = buffer_create_float(wd, ht);
+    fast->noise_a = raw->noise_a;
+    fast->noise_b = raw->noise_b;
+    for(int s=0;s<3;s++)
+    {
+      const buffer_t *in = s ? coarse[s-1] : input;
+      t = now();
+      decompose_fast(in, coarse[s], detail[s], s);
+      report("decompose_fast", s, wd, ht, (s ? 12 : 4)+12+12, now()-t);
+    }
+    for(int s=2;s>=0;s--)
+    {
+      buffer_t *out = s&1 ? output[1] : fast;
+      const buffer_t *co = s == 2 ? coarse[2] : (s&1 ? fast : output[1]);
+      for(int c=0;c<3;c++) synthesize(out, co, detail[s], c, s);
+    }
+    fast->type = s_buf_float_backtransform;
+    fast->black = black;
+    fast->white = white;
+    const double psnr = buffer_psnr(fast, output[0]);
+    printf("fast mode psnr %.1f dB against the full kernel, at least %.0f dB %s\n", psnr, fast_psnr_min,
+        psnr >= fast_psnr_min ? "ok" : "FAILED");
+    if(psnr < fast_psnr_min) err = 1;
+    buffer_destroy(fast);
+
+    // the whole pyramid with a barrier after every pass against the task
+    // graph (see tasks.h), which has to give the same result. utilisation is
+    // the time the threads spend in the kernels over wall time. only the task
+    // graph measures that time, the barrier schedule runs the same kernels,
+    // so its figure is an estimate: the kernel time of the tasks over the
+    // barrier wall time.
+    const wavelet_scale_t full[3] = {{0}};
+    wavelet_pyramid_t *pyr = wavelet_pyramid_create(wd, ht, 3, full, s_buf_float, 0.0f, raw->noise_a, raw->noise_b, 0);
+    t = now();
+    wavelet_decompose(pyr, input);
+    wavelet_synthesize(pyr, output[1]);
+    const double barrier = now() - t;
+    report("pyramid_barriers", -1, wd, ht, 28+2*36+3*36, barrier);
+    wavelet_tasks_stats_t ts;
+    wavelet_denoise_tasks(pyr, input, output[0], &ts);
+    report("pyramid_tasks", -1, wd, ht, 28+2*36+3*36, ts.wall);
+    printf("utilisation %.0f%% with %d tasks on %d threads, with barriers an estimated %.0f%%\n",
+        100.0*wavelet_tasks_utilisation(&ts), ts.tasks, ts.threads, 100.0*ts.busy/(barrier*ts.threads));
+    size_t differ = 0;
+    for(int k=0;k<3;k++)
+      for(size_t i=0;i<(size_t)wd*ht;i++)
+        differ += buffer_row(output[0], k, 0)[i] != buffer_row(output[1], k, 0)[i];
+    if(differ)
+    {
+      printf("task graph differs from the barrier schedule in %zu samples FAILED\n", differ);
+      err = 1;
+    }
+    wavelet_pyramid_destroy(pyr);
+
+    for(int s=0;s<3;s++)
+    {
+      buffer_destroy(coarse[s]);
+      buffer_destroy(detail[s]);
+    }
+    for(int s=0;s<2;s++) buffer_destroy(output[s]);
+    buffer_destroy(input);
+    buffer_destroy(raw);
+  }
+  if(err) printf("\nbench FAILED\n");
+  exit(err);
+}
@@ -0,0 +1,247 @@
+#pragma once
+// optional instrumentation of the parallel loops: wall time per stage, scale
+// and channel, and per thread busy time, rows and pixels. all of it compiles
+// to nothing unless WTF_INSTRUMENT is defined (make instrument). the report is
+// written at exit to the file named by the environment variable
+// WTF_INSTRUMENT, instrument.json by default, csv if the name ends in .csv.
+//
+// usage, with one stage/scale/channel triple per loop:
+//   INST_BEGIN();                         // outside the parallel region
+//   #pragma omp parallel for
+//   for(..) { INST_ROW_BEGIN(); ..; INST_ROW_END(stage, scale, channel, pixels); }
+//   INST_END(stage, scale, channel);
+// stages that overlap, like the bands of the task graph, count rows the same
+// way and hand their wall time to INST_WALL() instead.
+// threads outside of a parallel region (the main thread, the background
+// reader and writers) get counters of their own after those of the team.
+#ifdef WTF_INSTRUMENT
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+typedef enum inst_stage_t
+{
+  s_inst_read,                // pgm reading and variance stabilisation
+  s_inst_decompose_raw,       // plain a-trous step on raw data (noise profiling)
+  s_inst_decompose,           // one channel edge-aware step
+  s_inst_decompose_fused,     // all three channels in one pass
+  s_inst_decompose_fast,      // separable approximation, see decompose_fast()
+  s_inst_decompose_decimated, // coarse levels at half resolution
+  s_inst_decompose_int,       // exact integer scale 0 of the noise profiling
+  s_inst_synthesize,          // shrinkage and summation of one scale
+  s_inst_noiseprofile,        // histograms of the noise profile
+  s_inst_backtransform,       // inverse variance stabilisation of the output
+  s_inst_write,               // pfm output
+  s_inst_num,
+}
+inst_stage_t;
+
+static const char *inst_stage_name[s_inst_num] = {
+  "read", "decompose_raw", "decompose", "decompose_fused", "decompose_fast", "decompose_decimated",
+  "decompose_int", "synthesize", "noiseprofile", "backtransform", "write" };
+
+#define INST_MAX_THREADS 64
+#define INST_MAX_OTHERS 8    // threads outside of openmp, see inst_thread()
+#define INST_MAX_SCALES 8
+#define INST_ALL 3           // channel slot of stages working on all channels
+
+// one per thread and slot. a cache line each, so threads never share one.
+typedef struct inst_counter_t
+{
+  double busy;               // seconds spent inside the rows
+  uint64_t rows;             // rows (or column strips) done
+  uint64_t pixels;           // pixels written
+}
+__attribute__((aligned(64))) inst_counter_t;
+
+typedef struct inst_slot_t
+{
+  double wall;               // wall time summed over all calls
+  int calls;
+  inst_counter_t thread[INST_MAX_THREADS + INST_MAX_OTHERS];
+}
+inst_slot_t;
+
+static inst_slot_t inst_slot[s_inst_num][INST_MAX_SCALES][4];
+static double inst_start = -1.0;
+static int inst_others = 0;  // threads outside of openmp seen so far
+
+// monotonic seconds
+static inline double inst_now()
+{
+#ifdef _OPENMP
+  return omp_get_wtime();
+#else
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+#endif
+}
+
+static inline int inst_threads()
+{
+#ifdef _OPENMP
+  return MIN(omp_get_max_threads(), INST_MAX_THREADS);
+#else
+  return 1;
+#endif
+}
+
+// counter index of the calling thread. omp_get_thread_num() is 0 outside of
+// an active parallel region, for the background threads (which run theirs
+// with if(0)) as much as for the main one, so those get an index of their
+// own the first time they come by.
+static inline int inst_thread()
+{
+#ifdef _OPENMP
+  if(omp_get_active_level()) return omp_get_thread_num() % INST_MAX_THREADS;
+#endif
+  static _Thread_local int other = -1;
+  if(other < 0) other = INST_MAX_THREADS + __atomic_fetch_add(&inst_others, 1, __ATOMIC_RELAXED) % INST_MAX_OTHERS;
+  return other;
+}
+
+// v += d for the totals several threads finish into at the same time
+static inline void inst_add(
+    double *v,
+    const double d)
+{
+  double old, sum;
+  __atomic_load(v, &old, __ATOMIC_RELAXED);
+  do sum = old + d;
+  while(!__atomic_compare_exchange(v, &old, &sum, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline inst_slot_t *inst_get(
+    const inst_stage_t stage,
+    const int scale,
+    const int channel)
+{
+  return &inst_slot[stage][CLAMP(scale, 0, INST_MAX_SCALES-1)][CLAMP(channel, 0, INST_ALL)];
+}
+
+static inline void inst_row(
+    const inst_stage_t stage,
+    const int scale,
+    const int channel,
+    const double begin,
+    const uint64_t pixels)
+{
+  inst_counter_t *c = inst_get(stage, scale, channel)->thread + inst_thread();
+  c->busy += inst_now() - begin;
+  c->rows++;
+  c->pixels += pixels;
+}
+
+static inline void inst_report()
+{
+  const char *filename = getenv("WTF_INSTRUMENT");
+  if(!filename || !filename[0]) filename = "instrument.json";
+  const size_t len = strlen(filename);
+  const int csv = len > 4 && !strcmp(filename + len - 4, ".csv");
+  FILE *f = fopen(filename, "wb");
+  if(!f)
+  {
+    fprintf(stderr, "[instrument] can't write report `%s'\n", filename);
+    return;
+  }
+  const int threads = inst_threads();
+  const int others = MIN(inst_others, INST_MAX_OTHERS);
+  const char *channel_name[4] = {"0", "1", "2", "all"};
+  if(csv) fprintf(f, "stage,scale,channel,calls,wall,rows,pixels,mpix_per_s,busy_mean,busy_max,imbalance\n");
+  else fprintf(f, "{\n  \"wall\": %.6f,\n  \"threads\": %d,\n  \"stages\": [", inst_now() - inst_start, threads);
+  int first = 1;
+  for(int s=0;s<s_inst_num;s++) for(int l=0;l<INST_MAX_SCALES;l++) for(int c=0;c<4;c++)
+  {
+    const inst_slot_t *slot = &inst_slot[s][l][c];
+    if(!slot->calls) continue;
+    double busy = 0.0, busy_max = 0.0;
+    uint64_t rows = 0, pixels = 0;
+    for(int t=0;t<INST_MAX_THREADS + INST_MAX_OTHERS;t++)
+    {
+      if(t < INST_MAX_THREADS)
+      { // balance is a matter of the team only
+        busy += slot->thread[t].busy;
+        busy_max = MAX(busy_max, slot->thread[t].busy);
+      }
+      rows += slot->thread[t].rows;
+      pixels += slot->thread[t].pixels;
+    }
+    // imbalance is the slowest thread of the team over the mean, 1 is perfect:
+    const double busy_mean = busy/threads;
+    const double imbalance = busy_mean > 0.0 ? busy_max/busy_mean : 1.0;
+    const double mpix = slot->wall > 0.0 ? pixels/slot->wall*1e-6 : 0.0;
+    if(csv)
+    {
+      fprintf(f, "%s,%d,%s,%d,%.6f,%llu,%llu,%.2f,%.6f,%.6f,%.3f\n",
+          inst_stage_name[s], l, channel_name[c], slot->calls, slot->wall,
+          (unsigned long long)rows, (unsigned long long)pixels, mpix, busy_mean, busy_max, imbalance);
+      continue;
+    }
+    fprintf(f, "%s\n    { \"stage\": \"%s\", \"scale\": %d, \"channel\": \"%s\", \"calls\": %d, \"wall\": %.6f,"
+        " \"rows\": %llu, \"pixels\": %llu, \"mpix_per_s\": %.2f, \"imbalance\": %.3f,\n      \"busy\": [",
+        first ? "" : ",", inst_stage_name[s], l, channel_name[c], slot->calls, slot->wall,
+        (unsigned long long)rows, (unsigned long long)pixels, mpix, imbalance);
+    for(int t=0;t<threads;t++) fprintf(f, "%s%.6f", t ? ", " : "", slot->thread[t].busy);
+    fprintf(f, "],\n      \"busy_other\": [");
+    for(int t=0;t<others;t++) fprintf(f, "%s%.6f", t ? ", " : "", slot->thread[INST_MAX_THREADS + t].busy);
+    fprintf(f, "] }");
+    first = 0;
+  }
+  if(!csv) fprintf(f, "\n  ]\n}\n");
+  fclose(f);
+}
+
+// called at the start of every instrumented loop, registers the report once.
+static inline double inst_begin()
+{
+  if(inst_start < 0.0)
+  {
+    inst_start = inst_now();
+    atexit(inst_report);
+  }
+  return inst_now();
+}
+
+static inline void inst_end(
+    const inst_stage_t stage,
+    const int scale,
+    const int channel,
+    const double begin)
+{
+  inst_slot_t *slot = inst_get(stage, scale, channel);
+  inst_add(&slot->wall, inst_now() - begin);
+  __atomic_fetch_add(&slot->calls, 1, __ATOMIC_RELAXED);
+}
+
+// wall time the caller measured itself, for stages that overlap others and
+// have no loop of their own to time (see tasks.h).
+static inline void inst_wall(
+    const inst_stage_t stage,
+    const int scale,
+    const int channel,
+    const double seconds)
+{
+  if(inst_start < 0.0) inst_begin(); // registers the report
+  inst_slot_t *slot = inst_get(stage, scale, channel);
+  inst_add(&slot->wall, seconds);
+  __atomic_fetch_add(&slot->calls, 1, __ATOMIC_RELAXED);
+}
+
+#define INST_BEGIN() const double inst_t0 = inst_begin()
+#define INST_END(stage, scale, channel) inst_end(stage, scale, channel, inst_t0)
+#define INST_ROW_BEGIN() const double inst_r0 = inst_now()
+#define INST_ROW_END(stage, scale, channel, pixels) inst_row(stage, scale, channel, inst_r0, pixels)
+#define INST_WALL(stage, scale, channel, seconds) inst_wall(stage, scale, channel, seconds)
+#else
+#define INST_BEGIN()
+#define INST_END(stage, scale, channel)
+#define INST_ROW_BEGIN()
+#define INST_ROW_END(stage, scale, channel, pixels)
+#define INST_WALL(stage, scale, channel, seconds)
+#endif
@@ -1,97 +1,631 @@
 #include "wtf.h"
+#include "pyramid.h"
+#include "tasks.h"
+#include "stream.h"
 #include "noiseprofile.h"
 
+#include <dirent.h>
+#include <time.h>
+
+// buffers that can be written to disk, see -o
+typedef enum output_t
+{
+  o_coarse0, o_coarse1, o_coarse2,
+  o_detail0, o_detail1, o_detail2,
+  o_output0, o_output1,
+  o_num
+}
+output_t;
+
+static const char *output_name[o_num] = {
+  "coarse0", "coarse1", "coarse2",
+  "detail0", "detail1", "detail2",
+  "output0", "output1",
+};
+
+// comma separated list of output names, or "all". returns a bit mask, or -1.
+static int parse_outputs(
+    const char *list)
+{
+  if(!strcmp(list, "all")) return (1<<o_num)-1;
+  int mask = 0;
+  for(const char *c=list;*c;)
+  {
+    const char *end = strchr(c, ',');
+    if(!end) end = c + strlen(c);
+    int o = 0;
+    while(o < o_num && (strlen(output_name[o]) != (size_t)(end-c) || strncmp(output_name[o], c, end-c))) o++;
+    if(o == o_num) return -1;
+    mask |= 1<<o;
+    c = *end ? end + 1 : end;
+  }
+  return mask;
+}
+
+// write b as <name>.pfm, backtransformed if requested. async writes run in
+// the background and return the job to wait for.
+static pfm_job_t *write_output(
+    const buffer_t *b,
+    const output_t o,
+    const int backtransform,
+    const float black,
+    const float white,
+    const int async)
+{
+  char filename[256];
+  snprintf(filename, sizeof(filename), "%s.pfm", output_name[o]);
+  buffer_t view = *b;
+  if(backtransform)
+  {
+    view.type = s_buf_float_backtransform;
+    view.black = black;
+    view.white = white;
+  }
+  if(async) return buffer_write_pfm_async(&view, filename);
+  buffer_write_pfm(&view, filename);
+  return 0;
+}
+
+static double now()
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// bytes moved by decompose and synthesize (see wavelet_traffic()) and the
+// time they took, for the effective memory bandwidth. the task graph moves
+// less than that in its fused synthesis, but counts the same bytes so the
+// figures of both schedules compare.
+typedef struct bandwidth_t
+{
+  double bytes[2];           // decompose, synthesize
+  double time[2];
+}
+bandwidth_t;
+
+static void bandwidth_report(
+    const bandwidth_t *bw)
+{
+  if(bw->time[0] <= 0.0 || bw->time[1] <= 0.0) return;
+  fprintf(stderr, "[bandwidth] decompose %.2f GB/s, synthesize %.2f GB/s effective with %d threads\n",
+      bw->bytes[0]/bw->time[0]*1e-9, bw->bytes[1]/bw->time[1]*1e-9, numa_threads());
+}
+
+// list of input frames, grows as needed
+typedef struct frames_t
+{
+  char **name;
+  int num, size;
+}
+frames_t;
+
+static void frames_add(
+    frames_t *f,
+    const char *name)
+{
+  if(f->num == f->size)
+  {
+    f->size = MAX(16, 2*f->size);
+    f->name = (char **)realloc(f->name, sizeof(char *)*f->size);
+  }
+  f->name[f->num] = (char *)malloc(strlen(name)+1);
+  strcpy(f->name[f->num++], name);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// a batch can mix dumps with files that have a header: the layout given with
+// -R is for the .raw ones only.
+static const rawfile_dump_t *frame_dump(
+    const char *name,
+    const rawfile_dump_t *dump)
+{
+  const size_t len = strlen(name);
+  return len >= 4 && !strcmp(name + len - 4, ".raw") ? dump : 0;
+}
+
+// add all .pgm, .dng and .raw (dumps, see -R) files in a directory, in
+// alphabetical order.
+// returns 0 if path is a directory.
+static int frames_add_directory(
+    frames_t *f,
+    const char *path)
+{
+  DIR *dir = opendir(path);
+  if(!dir) return 1;
+  const int begin = f->num;
+  struct dirent *e;
+  while((e = readdir(dir)))
+  {
+    const size_t len = strlen(e->d_name);
+    if(len < 5 || (strcmp(e->d_name + len - 4, ".pgm") && strcmp(e->d_name + len - 4, ".dng") &&
+                   strcmp(e->d_name + len - 4, ".raw"))) continue;
+    char name[4096];
+    snprintf(name, sizeof(name), "%s/%s", path, e->d_name);
+    frames_add(f, name);
+  }
+  closedir(dir);
+  qsort(f->name + begin, f->num - begin, sizeof(char *), compare_names);
+  return 0;
+}
+
+// add the frames listed in a manifest, one per line, "-" reads stdin.
+static int frames_add_manifest(
+    frames_t *f,
+    const char *manifest)
+{
+  FILE *m = strcmp(manifest, "-") ? fopen(manifest, "rb") : stdin;
+  if(!m) return 1;
+  char line[4096];
+  while(fgets(line, sizeof(line), m))
+  {
+    line[strcspn(line, "\r\n")] = 0;
+    if(line[0] && line[0] != '#') frames_add(f, line);
+  }
+  if(m != stdin) fclose(m);
+  return 0;
+}
+
+// batch mode: while frame n is being denoised, frame n+1 is read and the
+// result of frame n-1 is written in the background. the pyramid buffers are
+// allocated once and reused for all frames of the same size. barriers picks
+// the schedule with one parallel pass per scale over the task graph.
+static int batch(
+    const frames_t *frames,
+    const rawfile_dump_t *dump,
+    const float noise_a,
+    const float noise_b,
+    const buffer_type_t detail_type,
+    const cfa_t *cfa,
+    const int num_scales,
+    const wavelet_scale_t *opt,
+    const int black,
+    const int white,
+    const int barriers)
+{
+  // detail coefficients are differences of stabilised values in [0, white]:
+  const float sigma2 = (noise_b/noise_a)*(noise_b/noise_a);
+  const float range = stabilise(white, noise_a, sigma2) - stabilise(0, noise_a, sigma2);
+  // output[0] and output[1] take turns, so one can be written while the next
+  // frame is synthesized into the other.
+  wavelet_pyramid_t *pyramid = 0;
+  buffer_t *output[2] = {0};
+  pfm_job_t *write[2] = {0};
+  buffer_t *spare = 0; // input buffer of the previous frame, to read into
+  // nothing to overlap the first frame with, read it with the whole pool:
+  buffer_t *first = buffer_read_raw_stabilise(frames->name[0], frame_dump(frames->name[0], dump), noise_a, noise_b, 0, 0, 1);
+  raw_job_t *read = 0;
+  bandwidth_t bw = {{0}};
+  wavelet_tasks_stats_t total = {0};
+  int err = 0;
+  for(int n=0;n<frames->num;n++)
+  {
+    buffer_t *input = n ? buffer_read_wait(read) : first;
+    // the background reader touches its buffer from one thread, so give it
+    // one placed by the pool (see numa.h):
+    if(!spare && input && n+1 < frames->num) spare = buffer_create_cfa(input->width, input->height);
+    read = n+1 < frames->num ? buffer_read_raw_stabilise_async(frames->name[n+1], frame_dump(frames->name[n+1], dump), noise_a, noise_b, spare) : 0;
+    spare = 0;
+    if(!input)
+    {
+      err = 1;
+      continue;
+    }
+    input->cfa = *cfa;
+    fprintf(stderr, "[batch] frame %d/%d `%s'\n", n+1, frames->num, frames->name[n]);
+
+    if(!output[0] || output[0]->width != input->width || output[0]->height != input->height)
+    { // first frame or size changed: wait for pending writes and reallocate
+      for(int k=0;k<2;k++) if(write[k]) err |= buffer_write_pfm_wait(write[k]);
+      write[0] = write[1] = 0;
+      for(int k=0;k<2;k++)
+      {
+        if(output[k]) buffer_destroy(output[k]);
+        output[k] = buffer_create_float(input->width, input->height);
+        output[k]->noise_a = noise_a;
+        output[k]->noise_b = noise_b;
+      }
+      if(pyramid) wavelet_pyramid_destroy(pyramid);
+      pyramid = wavelet_pyramid_create(input->width, input->height, num_scales, opt,
+          detail_type, range, noise_a, noise_b, 0);
+    }
+
+    const int cur = n&1;
+    if(!barriers && wavelet_tasks_supported(pyramid, input))
+    { // scales and bands overlap, see tasks.h
+      if(write[cur]) err |= buffer_write_pfm_wait(write[cur]);
+      write[cur] = 0;
+      wavelet_tasks_stats_t ts;
+      wavelet_denoise_tasks(pyramid, input, output[cur], &ts);
+      total.wall += ts.wall;
+      total.decompose += ts.decompose;
+      total.busy += ts.busy;
+      total.threads = ts.threads;
+      total.tasks += ts.tasks;
+      bw.time[0] += ts.decompose;
+      bw.time[1] += ts.wall - ts.decompose;
+    }
+    else
+    {
+      double t = now();
+      wavelet_decompose(pyramid, input);
+      bw.time[0] += now() - t;
+
+      if(write[cur]) err |= buffer_write_pfm_wait(write[cur]);
+      write[cur] = 0;
+      t = now();
+      wavelet_synthesize(pyramid, output[cur]);
+      bw.time[1] += now() - t;
+    }
+    for(int s=0;s<num_scales;s++)
+      for(int k=0;k<2;k++) bw.bytes[k] += wavelet_traffic(pyramid, input, s, k);
+    spare = input; // not needed any more, the frame after next goes here
+
+    // <input without extension>.output0.pfm
+    char filename[4096];
+    const char *slash = strrchr(frames->name[n], '/');
+    const char *dot = strrchr(frames->name[n], '.');
+    const int len = (dot && (!slash || dot > slash)) ? dot - frames->name[n] : (int)strlen(frames->name[n]);
+    snprintf(filename, sizeof(filename), "%.*s.output0.pfm", len, frames->name[n]);
+    buffer_t view = *output[cur];
+    view.type = s_buf_float_backtransform;
+    view.black = black;
+    view.white = white;
+    write[cur] = buffer_write_pfm_async(&view, filename);
+  }
+
+  for(int k=0;k<2;k++) if(write[k]) err |= buffer_write_pfm_wait(write[k]);
+  if(total.tasks) wavelet_tasks_report(&total);
+  if(bw.time[0] > 0.0) bandwidth_report(&bw);
+  if(spare) buffer_destroy(spare);
+  if(pyramid) wavelet_pyramid_destroy(pyramid);
+  for(int k=0;k<2;k++) if(output[k]) buffer_destroy(output[k]);
+  return err;
+}
+
 int main(int argc, char *argv[])
 {
-  if(argc < 2)
+  int profile = 0, band = 0, compare = 0, fast = 0, decimated = 0, num_scales = 3, outputs = 1<<o_output0;
+  buffer_type_t detail_type = s_buf_float;
+  cfa_t cfa = cfa_rggb;
+  rawfile_dump_t dump_layout;
+  const rawfile_dump_t *dump = 0; // set for headerless input
+  int cfa_given = 0, black = -1, white = -1;
+  roi_t crop = {0, 0, 0, 0};
+  const char *filename = 0, *key = 0, *database = "noiseprofiles.txt";
+  frames_t frames = {0};
+  int batch_mode = 0, usage = 0, barriers = 0;
+  for(int k=1;k<argc;k++)
+  {
+    if(!strcmp(argv[k], "-p")) profile = 1;
+    else if(!strcmp(argv[k], "-s") && k+1 < argc) band = atol(argv[++k]);
+    else if(!strcmp(argv[k], "-d") && k+1 < argc)
+    {
+      k++;
+      if(!strcmp(argv[k], "half")) detail_type = s_buf_half;
+      else if(!strcmp(argv[k], "q16")) detail_type = s_buf_q16;
+      else usage = 1;
+    }
+    else if(!strcmp(argv[k], "-c")) compare = 1;
+    else if(!strcmp(argv[k], "-f")) fast = 1;
+    else if(!strcmp(argv[k], "-D")) decimated = 1;
+    else if(!strcmp(argv[k], "-B")) barriers = 1;
+    else if(!strcmp(argv[k], "-n") && k+1 < argc)
+    {
+      num_scales = atol(argv[++k]);
+      if(num_scales < 1 || num_scales > WAVELET_MAX_SCALES) usage = 1;
+    }
+    else if(!strcmp(argv[k], "-C") && k+1 < argc)
+    {
+      if(cfa_parse(argv[++k], &cfa)) usage = 1;
+      cfa_given = 1;
+    }
+    else if(!strcmp(argv[k], "-R") && k+1 < argc)
+    {
+      if(rawfile_parse_dump(argv[++k], &dump_layout)) usage = 1;
+      dump = &dump_layout;
+    }
+    else if(!strcmp(argv[k], "-L") && k+1 < argc)
+    {
+      if(sscanf(argv[++k], "%d,%d", &black, &white) != 2 || black < 0 || white <= black) usage = 1;
+    }
+    else if(!strcmp(argv[k], "-r") && k+1 < argc)
+    {
+      if(sscanf(argv[++k], "%d,%d,%d,%d", &crop.x, &crop.y, &crop.width, &crop.height) != 4 ||
+         crop.width <= 0 || crop.height <= 0) usage = 1;
+    }
+    else if(!strcmp(argv[k], "-k") && k+1 < argc) key = argv[++k];
+    else if(!strcmp(argv[k], "-P") && k+1 < argc) database = argv[++k];
+    else if(!strcmp(argv[k], "-o") && k+1 < argc)
+    {
+      outputs = parse_outputs(argv[++k]);
+      if(outputs < 0) usage = 1;
+    }
+    else if(!strcmp(argv[k], "-l") && k+1 < argc)
+    {
+      batch_mode = 1;
+      if(frames_add_manifest(&frames, argv[++k]))
+      {
+        fprintf(stderr, "can't read manifest `%s'\n", argv[k]);
+        exit(1);
+      }
+    }
+    else if(!frames_add_directory(&frames, argv[k])) batch_mode = 1;
+    else frames_add(&frames, argv[k]);
+  }
+  if(frames.num > 1) batch_mode = 1;
+  if(frames.num > 0) filename = frames.name[0];
+  const rawfile_dump_t *first_dump = batch_mode && filename ? frame_dump(filename, dump) : dump;
+  if(!filename || usage)
   {
-    fprintf(stderr, "usage: %s input.pgm\n", argv[0]);
-    fprintf(stderr, "input should be non-demosaiced raw raw data (no wb, no black/white scaling, etc)\n");
+    fprintf(stderr, "usage: %s [-p] [-k key] [-P profiles] [-s band] [-d half|q16] [-C cfa] [-n scales] [-f] [-D] [-B] [-r x,y,w,h] [-c] [-o outputs] [-l manifest] [-R dump] [-L black,white] input..\n", argv[0]);
+    fprintf(stderr, "input should be non-demosaiced raw raw data (no wb, no black/white scaling, etc):\n");
+    fprintf(stderr, "uncompressed dng (8-16 bits, packed or not, strips or tiles), 16-bit pgm or a\n");
+    fprintf(stderr, "headerless dump of packed samples (see -R). other raws through a dng converter\n");
+    fprintf(stderr, "with compression off, or dcraw:\n");
     fprintf(stderr, "create pgm with dcraw -D -W -6 input.cr2\n");
     fprintf(stderr, "create pgm with dcraw -4 -E -c -t 0 -o 0 -M -r 1 1 1 1 input.cr2 > input.pgm\n");
+    fprintf(stderr, "  -p       print noise profile to stdout instead of denoising (see fit.gp)\n");
+    fprintf(stderr, "  -k key   look up the noise profile under this key, profile the image and\n");
+    fprintf(stderr, "           store it there if it isn't known yet. defaults to camera/iso from\n");
+    fprintf(stderr, "           the dng metadata (Canon_EOS_5D_Mark_II/1600, say)\n");
+    fprintf(stderr, "  -P file  noise profile database, defaults to noiseprofiles.txt\n");
+    fprintf(stderr, "  -s band  stream through the image in bands of this many rows with bounded\n");
+    fprintf(stderr, "           memory, only writes output0.pfm\n");
+    fprintf(stderr, "  -d type  store detail bands as half floats or 16-bit quantised integers\n");
+    fprintf(stderr, "  -C cfa   colour filter array, row by row: rggb (default), bggr, grbg, gbrg\n");
+    fprintf(stderr, "           (5dm2 with uncropped black borders, samsung nx300), any 6x6 pattern\n");
+    fprintf(stderr, "           as 36 letters, or xtrans. dngs have theirs in the metadata\n");
+    fprintf(stderr, "  -n num   number of wavelet scales, 1-%d, defaults to 3\n", WAVELET_MAX_SCALES);
+    fprintf(stderr, "  -f       fast mode: separable approximation of the edge-aware filter, about\n");
+    fprintf(stderr, "           2x faster at a small loss of quality, for previews and batches\n");
+    fprintf(stderr, "  -D       decimated pyramid: scale 0 stays at full resolution, the coarser\n");
+    fprintf(stderr, "           levels halve it, so scales 1 and 2 only cost a quarter as much\n");
+    fprintf(stderr, "  -B       one parallel pass per scale with a barrier after each, instead of\n");
+    fprintf(stderr, "           the task graph that overlaps the scales (see tasks.h). the task\n");
+    fprintf(stderr, "           graph is used without -D, -f only on scale 0, and only if no\n");
+    fprintf(stderr, "           coarse0-2 or output1 is written\n");
+    fprintf(stderr, "  -r roi   only denoise and write the crop x,y,w,h (top left corner and size),\n");
+    fprintf(stderr, "           for previews. the shrinkage thresholds come from the crop, too\n");
+    fprintf(stderr, "  -c       also run with float detail bands (and the full filter with -f) and\n");
+    fprintf(stderr, "           report the psnr of output0\n");
+    fprintf(stderr, "  -o list  comma separated buffers to write as <name>.pfm, default output0,\n");
+    fprintf(stderr, "           any of coarse0-2, detail0-2, output0-1, or all\n");
+    fprintf(stderr, "  -l file  read the list of input frames from this file, - for stdin\n");
+    fprintf(stderr, "  -R dump  inputs are headerless dumps width,height,bits,msb|lsb[,offset[,stride]]:\n");
+    fprintf(stderr, "           8-16 bit samples packed without padding, most or least significant\n");
+    fprintf(stderr, "           bit first, offset bytes of header and rows stride bytes apart. in a\n");
+    fprintf(stderr, "           batch only the .raw files are read as dumps\n");
+    fprintf(stderr, "  -L b,w   black and white level, overrides the levels from the dng metadata.\n");
+    fprintf(stderr, "           without metadata the defaults are a 5dm2's, 1023,15600\n");
+    fprintf(stderr, "batch mode: with more than one input, a directory of .pgm, .dng and .raw files\n");
+    fprintf(stderr, "or a manifest, every frame is written to <input>.output0.pfm with the levels and\n");
+    fprintf(stderr, "cfa of the first one. -s, -r, -c and -o are ignored.\n");
+    fprintf(stderr, "streaming with -s always runs the full filter on the full frame.\n");
+    fprintf(stderr, "the openmp threads are bound to cpus unless OMP_PROC_BIND is set or WTF_BIND=0,\n");
+    fprintf(stderr, "WTF_HUGEPAGES=1 uses transparent huge pages for the buffers (see numa.h).\n");
     exit(1);
   }
+  numa_bind_threads(); // before any buffer is first touched
 
-  // from dcraw -v:
-  const int black = 1023; // used in fit.gp
-  const int white = 15600;
-  buffer_t *raw = buffer_read_pgm16(argv[1], white);
+  // levels and cfa pattern from the metadata of the first frame (dng), -L
+  // and -C override them. pgms and dumps don't say, the defaults are a 5dm2's
+  // from dcraw -v (used in fit.gp).
+  rawfile_t info;
+  if(rawfile_open(filename, first_dump, &info)) exit(1);
+  if(black < 0)
+  {
+    black = info.white > 0.0f ? (int)(info.black + 0.5f) : 1023;
+    white = info.white > 0.0f ? (int)(info.white + 0.5f) : 15600;
+  }
+  if(!cfa_given && info.cfa[0]) cfa_parse(info.cfa, &cfa);
+  // the noise profile of the camera at this iso, unless -k names one:
+  char camera_key[80];
+  if(!key && info.camera[0] && info.iso > 0)
+  {
+    snprintf(camera_key, sizeof(camera_key), "%s/%d", info.camera, info.iso);
+    key = camera_key;
+    fprintf(stderr, "[noiseprofile] key %s from the metadata\n", key);
+  }
+  const int frame_width = info.width, frame_height = info.height;
+  fprintf(stderr, "[input] %dx%d, %d bits, black %d white %d, %s cfa\n", frame_width, frame_height, info.bits,
+      black, white, cfa.size == 6 ? "6x6" : "2x2");
+  rawfile_close(&info);
+  buffer_t *raw = 0; // only read as uint16_t if we need to profile or stream it
 
-  noiseprofile(raw);
-  return 0;
+  noise_profile_t prof;
+  if(profile || (key && noise_profile_load(database, key, &prof)))
+  { // no cached profile, run the estimation and the fit
+    raw = buffer_read_raw(filename, first_dump);
+    if(!raw) exit(1);
+    raw->cfa = cfa;
+    noiseprofile(raw, profile ? stdout : 0, black, white, &prof);
+    for(int c=0;c<3;c++)
+      fprintf(stderr, "[noiseprofile] channel %d: a = %g b = %g\n", c, prof.a[c], prof.b[c]);
+    if(key) noise_profile_store(database, key, &prof);
+    if(profile) exit(0);
+  }
+
+  float noise_a, noise_b;
+  if(key)
+  { // the pipeline uses one noise model for all channels:
+    noise_a = (prof.a[0] + prof.a[1] + prof.a[2])/3.0f;
+    noise_b = (prof.b[0] + prof.b[1] + prof.b[2])/3.0f;
+  }
+  else
+  {
+    // noiseprofiled with the above procedure:
+    // 5dm2 iso1600, wavelet scale2:
+    // noise_a = 0.000234565466234752;
+    // noise_b = -1.41864661910691e-05;
+
+    // 5dm2 iso1600, wavelet scale0:
+    noise_a = 7.44e-05;
+    noise_b = -4.82e-06;
+  }
+
+  // the same options for all scales:
+  wavelet_scale_t opt[WAVELET_MAX_SCALES];
+  for(int s=0;s<WAVELET_MAX_SCALES;s++) opt[s] = (wavelet_scale_t){fast, decimated};
 
-  // noiseprofiled with the above procedure:
-  // 5dm2 iso1600, wavelet scale2:
-  // raw->noise_a = 0.000234565466234752;
-  // raw->noise_b = -1.41864661910691e-05;
+  if(batch_mode)
+  {
+    if(raw) buffer_destroy(raw);
+    exit(batch(&frames, dump, noise_a, noise_b, detail_type, &cfa, num_scales, opt, black, white, barriers));
+  }
 
-  // 5dm2 iso1600, wavelet scale0:
-  raw->noise_a = 7.44e-05;
-  raw->noise_b = -4.82e-06;
+  if(band > 0)
+  { // stabilise raw rows on the fly, keep only rolling windows of the pyramid
+    if(!raw) raw = buffer_read_raw(filename, dump);
+    if(!raw) exit(1);
+    raw->cfa = cfa;
+    raw->type = s_buf_raw_stabilise;
+    raw->noise_a = noise_a;
+    raw->noise_b = noise_b;
+    FILE *f = fopen("output0.pfm", "wb");
+    if(!f) exit(1);
+    write_pfm_header(f, raw->width, raw->height);
+    stream_pfm_t pfm = {f, raw->width, raw->noise_a, raw->noise_b, black, white, (float *)malloc(sizeof(float)*4*raw->width)};
+    const int err = denoise_stream(raw, num_scales, band, 0, stream_emit_pfm, &pfm);
+    fclose(f);
+    free(pfm.row);
+    exit(err);
+  }
 
+  // with a crop, only the region its pyramid reads is processed, and all
+  // buffers are that size:
+  roi_t region = {0, 0, 0, 0};
+  if(crop.width > 0)
+  {
+    const int empty = roi_pad(&crop, &region, roi_halo(num_scales, decimated),
+        decimated ? 1<<(num_scales-1) : 1, frame_width, frame_height);
+    if(empty)
+    {
+      fprintf(stderr, "[roi] the crop is outside of the frame\n");
+      exit(1);
+    }
+    if(raw) buffer_destroy(raw);
+    raw = 0; // read the region straight from the file instead
+  }
+
+#if 1
+  // variance stabilise once into a float plane, straight from the file if
+  // the raw data hasn't been read for profiling already:
+  buffer_t *input = 0;
+  if(raw)
+  {
+    raw->noise_a = noise_a;
+    raw->noise_b = noise_b;
+    input = buffer_stabilise(raw);
+    buffer_destroy(raw);
+  }
+  else input = buffer_read_raw_stabilise(filename, dump, noise_a, noise_b, crop.width > 0 ? &region : 0, 0, 1);
+  if(!input) exit(1);
+  cfa_shift(&cfa, region.x, region.y, &input->cfa);
+#else
+  // saves the float plane for memory constrained runs, but transforms every tap:
+  if(!raw) raw = buffer_read_raw(filename, dump);
+  if(!raw) exit(1);
+  raw->cfa = cfa;
   raw->type = s_buf_raw_stabilise; // instruct that this should be read out transformed
-  buffer_t *coarse0 = buffer_create_float(raw->width, raw->height);
-  buffer_t *coarse1 = buffer_create_float(raw->width, raw->height);
-  buffer_t *coarse2 = buffer_create_float(raw->width, raw->height);
-  buffer_t *detail0 = buffer_create_float(raw->width, raw->height);
-  buffer_t *detail1 = buffer_create_float(raw->width, raw->height);
-  buffer_t *detail2 = buffer_create_float(raw->width, raw->height);
-  buffer_t *output0 = buffer_create_float(raw->width, raw->height);
-  buffer_t *output1 = buffer_create_float(raw->width, raw->height);
-  coarse0->noise_a = raw->noise_a;
-  coarse0->noise_b = raw->noise_b;
-  coarse1->noise_a = raw->noise_a;
-  coarse1->noise_b = raw->noise_b;
-  coarse2->noise_a = raw->noise_a;
-  coarse2->noise_b = raw->noise_b;
-  output0->noise_a = raw->noise_a;
-  output0->noise_b = raw->noise_b;
-  output1->noise_a = raw->noise_a;
-  output1->noise_b = raw->noise_b;
-
-  for(int channel=0;channel<3;channel++)
-    decompose(raw, coarse0, detail0, channel, 0);
-
-  for(int channel=0;channel<3;channel++)
-    decompose(coarse0, coarse1, detail1, channel, 1);
-
-  for(int channel=0;channel<3;channel++)
-    decompose(coarse1, coarse2, detail2, channel, 2);
-
-  for(int channel=0;channel<3;channel++)
-    synthesize(output0, coarse2, detail2, channel, 2);
-
-  for(int channel=0;channel<3;channel++)
-    synthesize(output1, output0, detail1, channel, 1);
-
-  for(int channel=0;channel<3;channel++)
-    synthesize(output0, output1, detail0, channel, 0);
-
-  // now switch type before writing out:
-  coarse0->type = s_buf_float_backtransform;
-  coarse0->black = black;
-  coarse0->white = white;
-  coarse1->type = s_buf_float_backtransform;
-  coarse1->black = black;
-  coarse1->white = white;
-  coarse2->type = s_buf_float_backtransform;
-  coarse2->black = black;
-  coarse2->white = white;
-  output0->type = s_buf_float_backtransform;
-  output0->black = black;
-  output0->white = white;
-  output1->type = s_buf_float_backtransform;
-  output1->black = black;
-  output1->white = white;
-  buffer_write_pfm(coarse0, "coarse0.pfm");
-  buffer_write_pfm(coarse1, "coarse1.pfm");
-  buffer_write_pfm(coarse2, "coarse2.pfm");
-  buffer_write_pfm(detail0, "detail0.pfm");
-  buffer_write_pfm(detail1, "detail1.pfm");
-  buffer_write_pfm(detail2, "detail2.pfm");
-  buffer_write_pfm(output0, "output0.pfm");
-  buffer_write_pfm(output1, "output1.pfm");
-
-  exit(0);
-}
+  raw->noise_a = noise_a;
+  raw->noise_b = noise_b;
+  buffer_t *input = raw;
+#endif
+  // detail coefficients are differences of stabilised values in [0, white]:
+  const float sigma2 = (input->noise_b/input->noise_a)*(input->noise_b/input->noise_a);
+  const float range = stabilise(white, input->noise_a, sigma2) - stabilise(0, input->noise_a, sigma2);
+  wavelet_pyramid_t *pyramid = wavelet_pyramid_create(input->width, input->height, num_scales, opt,
+      detail_type, range, input->noise_a, input->noise_b, &crop);
+  wavelet_pyramid_t *reference = 0;
+  const buffer_t *ref = 0;
+  if(compare && (detail_type != s_buf_float || fast))
+  { // reference run with float detail bands and the full kernel
+    wavelet_scale_t full[WAVELET_MAX_SCALES];
+    for(int s=0;s<num_scales;s++)
+    {
+      full[s] = opt[s];
+      full[s].fast = 0;
+    }
+    reference = wavelet_pyramid_create(input->width, input->height, num_scales, full,
+        s_buf_float, range, input->noise_a, input->noise_b, &crop);
+    wavelet_decompose(reference, input);
+    ref = wavelet_synthesize(reference, 0);
+  }
+
+  // the intermediate levels only exist with the barrier per pass schedule:
+  const int tasks = !barriers && wavelet_tasks_supported(pyramid, input) &&
+      !(outputs & ((7<<o_coarse0) | (1<<o_output1)));
+  buffer_t *output = 0;
+  pfm_job_t *job[o_num] = {0};
+  if(tasks)
+  { // scales and bands overlap, see tasks.h
+    wavelet_tasks_stats_t ts;
+    output = wavelet_denoise_tasks(pyramid, input, 0, &ts);
+    wavelet_tasks_report(&ts);
+    bandwidth_t bw = {{0}, {ts.decompose, ts.wall - ts.decompose}};
+    for(int s=0;s<num_scales;s++)
+      for(int k=0;k<2;k++) bw.bytes[k] += wavelet_traffic(pyramid, input, s, k);
+    bandwidth_report(&bw);
+    buffer_destroy(input);
+    for(int s=0;s<MIN(3, num_scales);s++)
+      if(outputs & (1<<(o_detail0+s))) job[o_detail0+s] = write_output(pyramid->detail[s], o_detail0+s, 0, black, white, 1);
+  }
+  else
+  {
+    // coarse levels are overwritten two scales later, write them right away:
+    bandwidth_t bw = {{0}};
+    for(int s=0;s<num_scales;s++)
+    {
+      const double t = now();
+      wavelet_decompose_scale(pyramid, input, s);
+      bw.time[0] += now() - t;
+      for(int k=0;k<2;k++) bw.bytes[k] += wavelet_traffic(pyramid, input, s, k);
+      if(s < 3 && (outputs & (1<<(o_coarse0+s)))) write_output(pyramid->coarse + s, o_coarse0+s, 1, black, white, 0);
+    }
+    buffer_destroy(input);
 
+    // detail bands don't change any more, write them while synthesizing:
+    for(int s=0;s<MIN(3, num_scales);s++)
+      if(outputs & (1<<(o_detail0+s))) job[o_detail0+s] = write_output(pyramid->detail[s], o_detail0+s, 0, black, white, 1);
+
+    // the reconstruction of scale 1 is overwritten by scale 0 in place:
+    for(int s=num_scales-1;s>=0;s--)
+    {
+      const double t = now();
+      output = wavelet_synthesize_scale(pyramid, s, 0);
+      bw.time[1] += now() - t;
+      if(s == 1 && (outputs & (1<<o_output1))) write_output(output, o_output1, 1, black, white, 0);
+    }
+
+    bandwidth_report(&bw);
+  }
+
+  if(ref)
+  {
+    buffer_t a = *output, b = *ref;
+    a.type = b.type = s_buf_float_backtransform;
+    a.black = b.black = black;
+    a.white = b.white = white;
+    fprintf(stderr, "[compare] output0 psnr %g dB against float detail bands and the full kernel\n", buffer_psnr(&a, &b));
+    wavelet_pyramid_destroy(reference);
+  }
+
+  // nothing left to overlap with, convert in parallel:
+  if(outputs & (1<<o_output0))
+  {
+    buffer_backtransform(output, black, white);
+    write_output(output, o_output0, 0, black, white, 0);
+  }
+
+  int err = 0;
+  for(int o=0;o<o_num;o++)
+    if(job[o]) err |= buffer_write_pfm_wait(job[o]);
+  wavelet_pyramid_destroy(pyramid);
+
+  exit(err);
+}
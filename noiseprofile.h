@@ -6,68 +6,150 @@
 #include <assert.h>
 #include <string.h>
 
-typedef float elem_type;
-#define ELEM_SWAP(a,b) { elem_type t=(a);(a)=(b);(b)=t; }
+#define N 200
 
-/*---------------------------------------------------------------------------
-Function :   kth_smallest()
-In       :   array of elements, # of elements in the array, rank k
-Out      :   one element
-Job      :   find the kth smallest element in the array
-Notice   :   use the median() macro defined below to get the median. 
+static inline float
+clamp(float f, float m, float M)
+{
+  return MAX(MIN(f, M), m);
+}
 
-Reference:
+// fine histograms of |HH| per brightness bin: the bin is the exponent and the
+// top mantissa bits of the float, i.e. 32 linear steps per octave, starting at
+// 2^NOISE_HIST_MIN. bin 0 collects everything below.
+#define NOISE_HIST_BITS 5
+#define NOISE_HIST_MIN (-4)
+#define NOISE_HIST_BINS (20<<NOISE_HIST_BITS)
 
-Author: Wirth, Niklaus 
-Title: Algorithms + data structures = programs 
-Publisher: Englewood Cliffs: Prentice-Hall, 1976 
-Physical description: 366 p. 
-Series: Prentice-Hall Series in Automatic Computation 
+static inline int
+noise_hist_bin(const float v)
+{
+  union { float f; uint32_t u; } b = { .f = v };
+  const int bin = (int)(b.u >> (23-NOISE_HIST_BITS)) - ((127+NOISE_HIST_MIN)<<NOISE_HIST_BITS);
+  return CLAMP(bin, 0, NOISE_HIST_BINS-1);
+}
 
----------------------------------------------------------------------------*/
+// lower end of the given bin
+static inline float
+noise_hist_value(const int bin)
+{
+  if(bin <= 0) return 0.0f;
+  union { uint32_t u; float f; } b = { .u = (uint32_t)(bin + ((127+NOISE_HIST_MIN)<<NOISE_HIST_BITS)) << (23-NOISE_HIST_BITS) };
+  return b.f;
+}
 
-static elem_type
-kth_smallest(elem_type a[], int n, int k)
+// k-th smallest value (0-based) of the histogram, interpolated within its bin
+static inline float
+noise_hist_kth(const uint32_t *hist, const uint32_t k)
 {
-  int i,j,l,m ;
-  elem_type x ;
-
-  l=0 ; m=n-1 ;
-  while (l<m) {
-    x=a[2*k+1] ;
-    i=l ;
-    j=m ;
-    do {
-      while (a[2*i+1]<x) i++ ;
-      while (x<a[2*j+1]) j-- ;
-      if (i<=j) {
-        ELEM_SWAP(a[2*i+1],a[2*j+1]) ;
-        i++ ; j-- ;
-      }
-    } while (i<=j) ;
-    if (j<k) l=i ;
-    if (k<i) m=j ;
+  uint32_t acc = 0;
+  for(int i=0;i<NOISE_HIST_BINS;i++)
+  {
+    if(acc + hist[i] > k)
+    {
+      const float t = (k - acc + 0.5f)/hist[i];
+      return noise_hist_value(i) + t*(noise_hist_value(i+1) - noise_hist_value(i));
+    }
+    acc += hist[i];
   }
-  return a[2*k+1] ;
+  return noise_hist_value(NOISE_HIST_BINS);
 }
 
-#define median(a,n) kth_smallest(a,n,(((n)&1)?((n)/2):(((n)/2)-1)))
+// noise model per color channel, variance = a * raw value + b.
+typedef struct noise_profile_t
+{
+  float a[3], b[3];
+}
+noise_profile_t;
 
-#define N 200
+// weighted least squares fit of the model to the binned estimates, the same
+// as fit.gp does: x in [black, white], weights cnt^2 (gnuplot's 1/err^2 with
+// err = 1/cnt).
+static inline void
+noise_profile_fit(
+    const float x[N],
+    const float var[N][3],
+    const float cnt[N][3],
+    const float black,
+    const float white,
+    noise_profile_t *prof)
+{
+  for(int c=0;c<3;c++)
+  {
+    double sw = 0.0, sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+    for(int i=0;i<N;i++)
+    {
+      if(x[i] < black || x[i] > white) continue;
+      const double w = MAX(0.001, cnt[i][c]) * MAX(0.001, cnt[i][c]);
+      sw  += w;
+      sx  += w*x[i];
+      sy  += w*var[i][c];
+      sxx += w*x[i]*x[i];
+      sxy += w*x[i]*var[i][c];
+    }
+    const double det = sw*sxx - sx*sx;
+    prof->a[c] = det != 0.0 ? (sw*sxy - sx*sy)/det : 0.0;
+    prof->b[c] = det != 0.0 ? (sxx*sy - sx*sxy)/det : 0.0;
+  }
+}
 
-static inline float
-clamp(float f, float m, float M)
+// profile database: a text file with one line per key, "key a0 b0 a1 b1 a2 b2".
+// later lines override earlier ones. returns 0 if the key was found.
+static inline int
+noise_profile_load(
+    const char *filename,
+    const char *key,
+    noise_profile_t *prof)
 {
-  return MAX(MIN(f, M), m);
+  FILE *f = fopen(filename, "rb");
+  if(!f) return 1;
+  int found = 0;
+  char line[1024], k[512];
+  noise_profile_t p;
+  while(fgets(line, sizeof(line), f))
+  {
+    if(line[0] == '#') continue;
+    if(sscanf(line, "%511s %g %g %g %g %g %g", k, p.a, p.b, p.a+1, p.b+1, p.a+2, p.b+2) != 7) continue;
+    if(strcmp(k, key)) continue;
+    *prof = p;
+    found = 1;
+  }
+  fclose(f);
+  return !found;
 }
 
-// compare helper for coarse/detail sort
-int compare_llhh(const void *a, const void *b)
+// append the profile to the database. keys can't contain white space.
+static inline int
+noise_profile_store(
+    const char *filename,
+    const char *key,
+    const noise_profile_t *prof)
 {
-  return (int)clamp(((float *)a)[0]*N, 0, N-1) - (int)clamp(((float *)b)[0]*N, 0, N-1);
+  for(const char *c=key;*c;c++) if(*c == ' ' || *c == '\t' || *c == '\n')
+  {
+    fprintf(stderr, "[noiseprofile] key `%s' contains white space, not storing it\n", key);
+    return 1;
+  }
+  FILE *f = fopen(filename, "ab");
+  if(!f)
+  {
+    fprintf(stderr, "[noiseprofile] can't write profile database `%s'\n", filename);
+    return 1;
+  }
+  fprintf(f, "%s %.9g %.9g %.9g %.9g %.9g %.9g\n", key, prof->a[0], prof->b[0], prof->a[1], prof->b[1], prof->a[2], prof->b[2]);
+  fclose(f);
+  return 0;
 }
 
-void noiseprofile(buffer_t *raw)
+// measure the noise of a raw frame per brightness bin and fit the model to it,
+// over [black, white]. if dat is given, the bins are written there in the
+// format fit.gp expects.
+void noiseprofile(
+    buffer_t *raw,
+    FILE *dat,
+    const float black,
+    const float white,
+    noise_profile_t *prof)
 {
   raw->type = s_buf_raw; // read plain raw data
   buffer_t *coarse0 = buffer_create_float(raw->width, raw->height);
@@ -76,11 +158,11 @@ void noiseprofile(buffer_t *raw)
   buffer_t *detail0 = buffer_create_float(raw->width, raw->height);
 
 #if 1
+  // scale 0 of all channels straight from the uint16 samples, the same as
+  // decompose_raw() per channel:
+  const int incomplete = decompose_raw16(raw, coarse2, detail0);
   for(int channel=0;channel<3;channel++)
-  {
-    int incomplete = decompose_raw(raw, coarse2, detail0, channel, 0);
-    if(incomplete) fprintf(stderr, "[noiseprofile] arrgh, this filter pattern is not filled after first iteration (channel %d)!\n", channel);
-  }
+    if(incomplete & (1<<channel)) fprintf(stderr, "[noiseprofile] arrgh, this filter pattern is not filled after first iteration (channel %d)!\n", channel);
 #else
   for(int channel=0;channel<3;channel++)
   {
@@ -99,87 +181,97 @@ void noiseprofile(buffer_t *raw)
   }
 #endif
 
-  for(int j=0;j<raw->height;j++)
-  {
-    for(int i=0;i<raw->width;i++)
-    {
-      for(int c=0;c<3;c++)
-      {
-        float val = buffer_get(raw, i, j, c);
-        if(val == -1.0f)
-          buffer_set(detail0, i, j, c, 0.0f);
-        else
-          buffer_set(detail0, i, j, c, buffer_get(raw, i, j, c) - buffer_get(coarse2, i, j, c));
-      }
-    }
-  }
-
-
-
   const int wd = raw->width, ht = raw->height;
   float std[N][3] = {{0.0f}};
   float cnt[N][3] = {{0.0f}};
 
-  // sort pairs (LL,HH) for each color channel:
-  float *llhh = (float *)malloc(sizeof(float)*wd*ht*2);
-  for(int c=0;c<3;c++)
+  // bin (LL,HH) pairs for each color channel, HH = raw - coarse2 (detail0
+  // only holds the last level in the #else branch above). every thread fills
+  // its own histograms, no sort and no per pixel pair array:
+  uint32_t *hist = (uint32_t *)calloc((size_t)N*3*NOISE_HIST_BINS, sizeof(uint32_t));
+  INST_BEGIN();
+#pragma omp parallel default(shared)
   {
-    int k = 0;
+    uint32_t *part = (uint32_t *)calloc((size_t)N*3*NOISE_HIST_BINS, sizeof(uint32_t));
+#pragma omp for
     for(int j=0;j<ht;j++)
     {
-      for(int i=0;i<wd;i++)
+      INST_ROW_BEGIN();
+      const uint16_t *in = buffer_row_raw(raw, j);
+      // go through the phases of the pattern row, the channel is fixed in each:
+      for(int p=0;p<raw->cfa.size;p++)
       {
-        if(buffer_get(raw, i, j, c) != -1.0f)
-        { // only if there is this color channel in the input:
-          llhh[2*k]   = buffer_get(coarse2, i, j, c)/raw->white;
-          assert(llhh[2*k] != -1.0f); // or else complained above.
-          llhh[2*k+1] = fabsf(buffer_get(detail0, i, j, c));
-          k++;
+        const int c = raw->cfa.c[j % CFA_MAX][p];
+        const float *coarse = buffer_row(coarse2, c, j);
+        uint32_t *h = part + (size_t)c*NOISE_HIST_BINS;
+        for(int i=p;i<wd;i+=raw->cfa.size)
+        { // only the color channel that is there in the input:
+          const float co = coarse[i];
+          assert(co != -1.0f); // or else complained above.
+          // coarse is used to estimate brightness:
+          const int bin = (int)clamp(co/raw->white*N, 0, N-1);
+          h[bin*3*NOISE_HIST_BINS + noise_hist_bin(fabsf(in[i] - co))]++;
         }
       }
+      INST_ROW_END(s_inst_noiseprofile, 0, INST_ALL, wd);
     }
-    qsort(llhh, k, 2*sizeof(float), compare_llhh);
-    // estimate std deviation for every bin we've got:
-    for(int begin=0;begin<k;)
-    {
-      // coarse is used to estimate brightness:
-      const int bin = (int)clamp(llhh[2*begin]*N, 0, N-1);
-      int end = begin+1;
-      while((end < k) && ((int)clamp(llhh[2*end]*N, 0, N-1) == bin))
-        end++;
-      assert(end >= k || bin <= (int)clamp(llhh[2*end]*N, 0, N-1));
-      // fprintf(stderr, "from %d (%d) -- %d (%d)\n", begin, bin, end, (int)clamp(llhh[2*end]*N, 0, N-1));
+#pragma omp critical
+    for(size_t k=0;k<(size_t)N*3*NOISE_HIST_BINS;k++) hist[k] += part[k];
+    free(part);
+  }
+  INST_END(s_inst_noiseprofile, 0, INST_ALL);
 
+  // estimate std deviation for every bin we've got:
+#pragma omp parallel for collapse(2) default(shared)
+  for(int bin=0;bin<N;bin++)
+  {
+    for(int c=0;c<3;c++)
+    {
+      const uint32_t *h = hist + (bin*3 + c)*NOISE_HIST_BINS;
+      uint32_t n = 0;
+      for(int i=0;i<NOISE_HIST_BINS;i++) n += h[i];
+      if(!n) continue;
       // estimate noise by robust statistic (assumes zero mean of HH band):
       // MAD: median(|Y - med(Y)|) = 0.6745 sigma
-      // if(end - begin > 10)
-        // fprintf(stdout, "%d %f %d\n", bin, median(llhh+2*begin, end-begin)/0.6745, end - begin);
-      std[bin][c] += median(llhh+2*begin, end-begin)/0.6745;
-      cnt[bin][c] = end - begin;
-
-      begin = end;
+      std[bin][c] = noise_hist_kth(h, (n&1) ? n/2 : n/2-1)/0.6745;
+      cnt[bin][c] = n;
     }
   }
-  free(llhh);
+  free(hist);
 
   // correction factor accounting for relative frequency of color channels
-  // in mosaic pattern. this is for a std bayer pattern, i.e. there are
-  // twice as many green pixels as red and blue.
-  float corr[3] = {1.0, 1.0/sqrtf(2.0), 1.0};
+  // in mosaic pattern, relative to the sparsest one. for a std bayer pattern
+  // there are twice as many green pixels as red and blue, i.e. 1/sqrt(2).
+  int num[3];
+  cfa_count(&raw->cfa, num);
+  const int sparsest = MIN(MIN(num[0], num[1]), num[2]);
+  float corr[3];
+  for(int k=0;k<3;k++) corr[k] = sqrtf(sparsest/(float)num[k]);
   // when using input - coarse1, this results about in even noise levels:
   // float corr[3] = {1.0, 1.0, 1.0};
 
-  float sum[3] = {0.0f};
-  for(int i=0;i<N;i++)
-    for(int k=0;k<3;k++) sum[k] += std[i][k];
-  float cdf[3] = {0.0f};
+  float x[N], var[N][3];
   for(int i=0;i<N;i++)
   {
-    fprintf(stdout, "%f %f %f %f %f %f %f %f %f %f\n", raw->white * i/(float)N, std[i][0]*corr[0], std[i][1]*corr[1], std[i][2]*corr[2],
-        cnt[i][0], cnt[i][1], cnt[i][2],
-        cdf[0]/sum[0], cdf[1]/sum[1], cdf[2]/sum[2]);
-        // cdf[0], cdf[1], cdf[2]);
-    for(int k=0;k<3;k++) cdf[k] += std[i][k]*corr[k];
+    x[i] = raw->white * i/(float)N;
+    for(int k=0;k<3;k++) var[i][k] = std[i][k]*corr[k] * std[i][k]*corr[k];
+  }
+  noise_profile_fit(x, var, cnt, black, white, prof);
+
+  if(dat)
+  {
+    float sum[3] = {0.0f};
+    for(int i=0;i<N;i++)
+      for(int k=0;k<3;k++) sum[k] += std[i][k];
+    float cdf[3] = {0.0f};
+    for(int i=0;i<N;i++)
+    {
+      fprintf(dat, "%f %f %f %f %f %f %f %f %f %f\n", x[i], std[i][0]*corr[0], std[i][1]*corr[1], std[i][2]*corr[2],
+          cnt[i][0], cnt[i][1], cnt[i][2],
+          cdf[0]/sum[0], cdf[1]/sum[1], cdf[2]/sum[2]);
+          // cdf[0], cdf[1], cdf[2]);
+      for(int k=0;k<3;k++) cdf[k] += std[i][k]*corr[k];
+    }
   }
 
   // buffer_write_pfm(detail0, "detail.pfm");
@@ -0,0 +1,109 @@
+#pragma once
+// placement of threads and memory for machines with more than one numa node.
+// a page lands on the node of the thread that touches it first, so the large
+// buffers are zeroed (or filled) in parallel with the same static row
+// partition the kernels use: a parallel loop without schedule clause is
+// static with gcc's libgomp, and OMP_SCHEDULE only changes schedule(runtime).
+// that only helps if the threads stay where they are:
+//
+// - if OMP_PROC_BIND is set, the openmp runtime places the threads. say
+//   OMP_PROC_BIND=spread OMP_PLACES=cores to use both sockets with fewer
+//   threads than cores.
+// - otherwise numa_bind_threads() binds thread t of n to cpu t*cpus/n of the
+//   affinity mask the process was started with (taskset, numactl --cpunodebind),
+//   WTF_BIND=0 leaves the threads alone.
+// - WTF_HUGEPAGES=1 asks for transparent huge pages for the buffers: fewer tlb
+//   misses, but the first touch places 2MB at a time then.
+//
+// needs _GNU_SOURCE for sched_setaffinity() and madvise(), see the Makefile.
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define NUMA_HUGE_PAGE ((size_t)2<<20)
+
+static cpu_set_t numa_process_cpus; // affinity of the process at startup
+static int numa_bound = 0;          // set if the threads have been bound
+
+static inline int numa_hugepages()
+{
+  static int huge = -1;
+  if(huge >= 0) return huge;
+  const char *env = getenv("WTF_HUGEPAGES");
+  huge = env && atoi(env) > 0;
+  return huge;
+}
+
+static inline int numa_threads()
+{
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+// bytes of uninitialised memory, aligned to cache lines or huge pages. the
+// caller touches it first, release with free().
+static inline void *numa_alloc(
+    const size_t bytes)
+{
+  const size_t align = numa_hugepages() ? NUMA_HUGE_PAGE : 64;
+  const size_t size = MAX(1, (bytes + align - 1)/align)*align; // aligned_alloc() wants a multiple
+  void *p = aligned_alloc(align, size);
+  if(p && numa_hugepages()) madvise(p, size, MADV_HUGEPAGE);
+  return p;
+}
+
+// planes*rows zeroed rows of row_bytes each. row y of every plane (the
+// channels of a planar buffer) is first touched by the thread that owns row y
+// in the kernels.
+static inline void *numa_calloc(
+    const size_t row_bytes,
+    const int rows,
+    const int planes)
+{
+  uint8_t *p = (uint8_t *)numa_alloc(row_bytes*rows*planes);
+  if(!p) return 0;
+#pragma omp parallel for default(shared) schedule(static)
+  for(int y=0;y<rows;y++)
+    for(int k=0;k<planes;k++) memset(p + ((size_t)k*rows + y)*row_bytes, 0, row_bytes);
+  return p;
+}
+
+// bind the openmp threads to cpus, see above. call once at startup, before
+// any buffers are allocated. the threads of later parallel regions are the
+// same ones as long as their number doesn't grow.
+static inline void numa_bind_threads()
+{
+  if(sched_getaffinity(0, sizeof(cpu_set_t), &numa_process_cpus)) return;
+  const char *env = getenv("WTF_BIND");
+  if(getenv("OMP_PROC_BIND") || (env && !strcmp(env, "0"))) return;
+#ifdef _OPENMP
+  int cpu[CPU_SETSIZE], num = 0;
+  for(int c=0;c<CPU_SETSIZE;c++) if(CPU_ISSET(c, &numa_process_cpus)) cpu[num++] = c;
+  int err = 0;
+#pragma omp parallel default(shared) reduction(|:err)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu[(size_t)omp_get_thread_num()*num/omp_get_num_threads()], &set);
+    err |= sched_setaffinity(0, sizeof(cpu_set_t), &set) != 0; // the calling thread
+  }
+  if(err) fprintf(stderr, "[numa] can't bind the threads to cpus\n");
+  else numa_bound = 1;
+#endif
+}
+
+// background threads (reader, writer) start out on the one cpu of the thread
+// that created them. give them the whole mask back.
+static inline void numa_unbind_thread()
+{
+  if(numa_bound) sched_setaffinity(0, sizeof(cpu_set_t), &numa_process_cpus);
+}
@@ -0,0 +1,170 @@
+#pragma once
+// wavelet pyramid with any number of scales. it keeps the detail bands of all
+// scales but only two coarse buffers, which the levels take turns in: level s
+// overwrites level s-2, which nothing reads any more. synthesis overwrites the
+// coarsest level with the reconstruction in place, and only moves to the
+// other buffer where a decimated level changes the size. that's num_scales
+// detail bands plus two float frames, instead of a coarse and an output
+// buffer per level.
+#include "wtf.h"
+
+#define WAVELET_MAX_SCALES 8
+
+// options of one scale
+typedef struct wavelet_scale_t
+{
+  int fast;                  // separable approximation, see decompose_fast()
+  int decimated;             // coarse level at half the resolution of the one above, not for scale 0
+}
+wavelet_scale_t;
+
+typedef struct wavelet_pyramid_t
+{
+  int num_scales;
+  wavelet_scale_t opt[WAVELET_MAX_SCALES];
+  buffer_t *detail[WAVELET_MAX_SCALES]; // detail band of every scale
+  buffer_t *buf[2];          // full size float buffers the coarse levels live in
+  buffer_t coarse[WAVELET_MAX_SCALES]; // coarse level s in buf[s&1], at its size
+  buffer_t output;           // reconstruction so far, in buf[result]
+  int result;
+  buffer_t *even;            // subsampled input of the largest decimated level, or 0
+}
+wavelet_pyramid_t;
+
+// pyramid for a wd x ht input. range is the largest detail coefficient (see
+// buffer_create_detail()), crop (or 0) the part of every level to write out.
+static inline wavelet_pyramid_t *wavelet_pyramid_create(
+    const int wd,
+    const int ht,
+    const int num_scales,
+    const wavelet_scale_t *opt,
+    const buffer_type_t detail_type,
+    const float range,
+    const float noise_a,
+    const float noise_b,
+    const roi_t *crop)
+{
+  assert(num_scales > 0 && num_scales <= WAVELET_MAX_SCALES);
+  wavelet_pyramid_t *p = (wavelet_pyramid_t *)malloc(sizeof(wavelet_pyramid_t));
+  memset(p, 0, sizeof(wavelet_pyramid_t));
+  p->num_scales = num_scales;
+  for(int k=0;k<2;k++)
+  { // with one scale nothing takes turns
+    if(k && num_scales == 1) break;
+    p->buf[k] = buffer_create_float(wd, ht);
+    p->buf[k]->noise_a = noise_a;
+    p->buf[k]->noise_b = noise_b;
+  }
+  int cw = wd, ch = ht, levels = 0; // size of the coarse level above, times halved
+  for(int s=0;s<num_scales;s++)
+  {
+    p->opt[s] = opt[s];
+    if(s == 0) p->opt[s].decimated = 0; // scale 0 works on the cfa pattern
+    p->detail[s] = buffer_create_detail(cw, ch, detail_type, range);
+    if(crop) p->detail[s]->crop = roi_decimate(crop, levels);
+    if(p->opt[s].decimated)
+    {
+      cw = decimated_size(cw, 1);
+      ch = decimated_size(ch, 1);
+      levels++;
+      // the first decimated level is the largest, the others use a part of it:
+      if(!p->even) p->even = buffer_create_float(cw, ch);
+    }
+    p->coarse[s] = *p->buf[s&1];
+    p->coarse[s].width = cw;
+    p->coarse[s].height = ch;
+    if(crop) p->coarse[s].crop = roi_decimate(crop, levels);
+  }
+  return p;
+}
+
+static inline void wavelet_pyramid_destroy(
+    wavelet_pyramid_t *p)
+{
+  for(int s=0;s<p->num_scales;s++) buffer_destroy(p->detail[s]);
+  for(int k=0;k<2;k++) if(p->buf[k]) buffer_destroy(p->buf[k]);
+  if(p->even) buffer_destroy(p->even);
+  free(p);
+}
+
+// decompose scale s. needs coarse level s-1 (or the input for scale 0), and
+// overwrites level s-2. returns 1 if the coarse level has undefined pixels.
+static inline int wavelet_decompose_scale(
+    wavelet_pyramid_t *p,
+    const buffer_t *input,
+    const int s)
+{
+  const buffer_t *in = s ? p->coarse + s-1 : input;
+  buffer_t *co = p->coarse + s;
+  p->result = s&1;
+  if(p->opt[s].decimated)
+  {
+    buffer_t even = *p->even;
+    even.width = co->width;
+    even.height = co->height;
+    return decompose_decimated(in, co, p->detail[s], &even, s);
+  }
+  if(p->opt[s].fast) return decompose_fast(in, co, p->detail[s], s);
+  return decompose_fused(in, co, p->detail[s], s);
+}
+
+static inline int wavelet_decompose(
+    wavelet_pyramid_t *p,
+    const buffer_t *input)
+{
+  int incomplete = 0;
+  for(int s=0;s<p->num_scales;s++) incomplete |= wavelet_decompose_scale(p, input, s);
+  return incomplete;
+}
+
+// reconstruct scale s with shrinkage from scale s+1, or from the coarsest
+// level. runs from the last scale down to 0. the result goes to output for
+// scale 0 if that's given (a full size float buffer), otherwise it overwrites
+// the coarse levels. returns the reconstruction, valid until the next call.
+static inline buffer_t *wavelet_synthesize_scale(
+    wavelet_pyramid_t *p,
+    const int s,
+    buffer_t *output)
+{
+  const buffer_t *de = p->detail[s];
+  const buffer_t co = s == p->num_scales-1 ? p->coarse[s] : p->output;
+  if(output && s == 0)
+  {
+    assert(output->width == de->width && output->height == de->height);
+    for(int channel=0;channel<3;channel++) synthesize(output, &co, de, channel, s);
+    return output;
+  }
+  // same size is done in place, a decimated level grows into the other buffer:
+  if(co.width != de->width || co.height != de->height) p->result ^= 1;
+  p->output = *p->buf[p->result];
+  p->output.width = de->width;
+  p->output.height = de->height;
+  p->output.crop = de->crop;
+  for(int channel=0;channel<3;channel++) synthesize(&p->output, &co, de, channel, s);
+  return &p->output;
+}
+
+static inline buffer_t *wavelet_synthesize(
+    wavelet_pyramid_t *p,
+    buffer_t *output)
+{
+  buffer_t *out = 0;
+  for(int s=p->num_scales-1;s>=0;s--) out = wavelet_synthesize_scale(p, s, output);
+  return out;
+}
+
+// bytes scale s has to move at least: decompose reads the level above (or the
+// input) and writes coarse and detail, synthesize reads both back and writes
+// the reconstruction. over the time taken that's the effective bandwidth.
+static inline double wavelet_traffic(
+    const wavelet_pyramid_t *p,
+    const buffer_t *input,
+    const int s,
+    const int synthesis)
+{
+  const buffer_t *de = p->detail[s], *co = p->coarse + s;
+  const double px = (double)de->width*de->height, cpx = (double)co->width*co->height;
+  const double coarse = cpx*buffer_pixel_bytes(co), detail = px*buffer_pixel_bytes(de);
+  if(synthesis) return coarse + detail + px*buffer_pixel_bytes(co);
+  return px*buffer_pixel_bytes(s ? p->coarse + s-1 : input) + coarse + detail;
+}
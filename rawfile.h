@@ -0,0 +1,528 @@
+#pragma once
+// raw frames straight from the files cameras and sensors write, without a
+// conversion to 16-bit pgm with dcraw first:
+//
+// - binary pgm, 16-bit big endian (or 8-bit) samples, no metadata.
+// - uncompressed dng (and tiff with a cfa image): the cfa image in strips or
+//   tiles, 8-16 bit samples, packed msb first where the size isn't 8 or 16.
+//   black and white level, cfa pattern and the active area come from the
+//   tags, a linearisation table and black level deltas are applied to the
+//   samples. camera and iso (from Make, Model and the exif ISOSpeedRatings)
+//   name the noise profile. compressed dngs (lossless jpeg) aren't supported.
+// - headerless sensor dumps, with the layout given by rawfile_dump_t.
+//
+// the file is mapped, the readers in wtf.h unpack rows out of the mapping in
+// parallel and straight into their buffers (see unpack_row() in simd.h).
+#include "simd.h"
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// layout of a headerless dump, see rawfile_parse_dump()
+typedef struct rawfile_dump_t
+{
+  int width, height;
+  int bits, msb;             // sample size and bit order, see unpack_sample()
+  size_t offset;             // bytes before the first row
+  size_t stride;             // bytes per row, 0 for rows packed without padding
+}
+rawfile_dump_t;
+
+typedef struct rawfile_t
+{
+  int fd;                    // file descriptor of the mapping
+  void *map;                 // the mapped file
+  size_t size;               // size of the mapping in bytes
+  int width, height;         // of the frame (the active area of a dng)
+  int x0, y0;                // top left corner of the frame in the stored image
+  int bits, msb;             // sample packing, see unpack_row()
+  int tile_width, tile_height; // strips are tiles as wide as the image
+  int tiles_across;          // tiles per row of tiles
+  size_t tile_stride;        // bytes per row inside a tile
+  const uint8_t **tile;      // first byte of every tile, row by row
+  float black, white;        // levels from the metadata, white is 0 if there are none
+  char cfa[37];              // cfa pattern as cfa_parse() takes it, empty if unknown
+  uint16_t *curve;           // dng LinearizationTable, 0 if there is none
+  int curve_size;
+  float *black_dx, *black_dy; // dng BlackLevelDeltaH/V per column and row of the frame, or 0
+  char camera[64];           // maker and model without white space, empty if unknown
+  int iso;                   // 0 if unknown
+}
+rawfile_t;
+
+// "width,height,bits,msb|lsb[,offset[,stride]]". returns 0 on success.
+static inline int rawfile_parse_dump(
+    const char *spec,
+    rawfile_dump_t *dump)
+{
+  char order[4] = {0};
+  long long offset = 0, stride = 0;
+  rawfile_dump_t d = {0};
+  const int n = sscanf(spec, "%d,%d,%d,%3[a-z],%lld,%lld", &d.width, &d.height, &d.bits, order, &offset, &stride);
+  if(n < 4 || d.width <= 0 || d.height <= 0 || d.bits < 8 || d.bits > 16 || offset < 0 || stride < 0) return 1;
+  if(strcmp(order, "msb") && strcmp(order, "lsb")) return 1;
+  d.msb = !strcmp(order, "msb");
+  d.offset = offset;
+  d.stride = stride;
+  *dump = d;
+  return 0;
+}
+
+static inline void rawfile_close(
+    rawfile_t *r)
+{
+  if(r->map && r->map != MAP_FAILED) munmap(r->map, r->size);
+  if(r->fd >= 0) close(r->fd);
+  free(r->tile);
+  free(r->curve);
+  free(r->black_dx);
+  free(r->black_dy);
+  r->map = 0;
+  r->tile = 0;
+  r->curve = 0;
+  r->black_dx = r->black_dy = 0;
+  r->fd = -1;
+}
+
+// whole image as one tile of rows stride bytes apart, starting at offset.
+// returns 0 if it fits into the file.
+static inline int rawfile_single_tile(
+    rawfile_t *r,
+    const size_t offset,
+    const size_t stride)
+{
+  const size_t packed = ((size_t)r->width*r->bits + 7)/8;
+  if(stride < packed || offset > r->size || r->size - offset < packed || (r->size - offset - packed)/stride < (size_t)r->height - 1) return 1;
+  r->tile_width = r->width;
+  r->tile_height = r->height;
+  r->tiles_across = 1;
+  r->tile_stride = stride;
+  r->tile = (const uint8_t **)malloc(sizeof(uint8_t *));
+  r->tile[0] = (const uint8_t *)r->map + offset;
+  return 0;
+}
+
+// next integer in a pnm header, skipping white space and # comments.
+// returns 0 on success.
+static inline int rawfile_pnm_token(
+    const rawfile_t *r,
+    size_t *pos,
+    int *value)
+{
+  const uint8_t *m = (const uint8_t *)r->map;
+  while(*pos < r->size)
+  {
+    if(m[*pos] == '#') while(*pos < r->size && m[*pos] != '\n' && m[*pos] != '\r') (*pos)++;
+    else if(m[*pos] == ' ' || m[*pos] == '\t' || m[*pos] == '\n' || m[*pos] == '\r' || m[*pos] == '\v' || m[*pos] == '\f') (*pos)++;
+    else break;
+  }
+  if(*pos >= r->size || m[*pos] < '0' || m[*pos] > '9') return 1;
+  long v = 0;
+  while(*pos < r->size && m[*pos] >= '0' && m[*pos] <= '9' && v < 0x7fffffff)
+    v = 10*v + m[(*pos)++] - '0';
+  *value = v > 0x7fffffff ? 0x7fffffff : v;
+  return 0;
+}
+
+static inline int rawfile_open_pgm(
+    rawfile_t *r)
+{
+  int maxval;
+  size_t pos = 2;
+  if(rawfile_pnm_token(r, &pos, &r->width) || rawfile_pnm_token(r, &pos, &r->height) || rawfile_pnm_token(r, &pos, &maxval)) return 1;
+  pos++; // exactly one white space character before the samples
+  if(r->width <= 0 || r->height <= 0 || maxval <= 0 || maxval > 65535) return 1;
+  r->bits = maxval < 256 ? 8 : 16;
+  r->msb = 1;
+  return rawfile_single_tile(r, pos, (size_t)r->width*(r->bits/8));
+}
+
+// the tiff structures dng builds on
+typedef struct tiff_t
+{
+  const uint8_t *m;          // the file
+  size_t size;
+  int le;                    // byte order, II (1) or MM
+}
+tiff_t;
+
+static inline uint32_t tiff_get(
+    const tiff_t *t,
+    const size_t pos,
+    const int bytes)
+{
+  if(pos > t->size || t->size - pos < (size_t)bytes) return 0;
+  uint32_t v = 0;
+  for(int k=0;k<bytes;k++) v |= (uint32_t)t->m[pos + k] << 8*(t->le ? k : bytes-1-k);
+  return v;
+}
+
+// ifd entry: tag, type, count, and where the values are
+typedef struct tiff_entry_t
+{
+  int tag, type;
+  uint32_t count;
+  size_t pos;                // first value, inline or at the offset
+}
+tiff_entry_t;
+
+static inline int tiff_type_size(
+    const int type)
+{
+  switch(type)
+  {
+    case 1: case 2: case 6: case 7: return 1;   // byte, ascii, sbyte, undefined
+    case 3: case 8: return 2;                   // short, sshort
+    case 4: case 9: case 11: case 13: return 4; // long, slong, float, ifd
+    case 5: case 10: case 12: return 8;         // rational, srational, double
+    default: return 0;
+  }
+}
+
+static inline tiff_entry_t tiff_entry(
+    const tiff_t *t,
+    const size_t pos)
+{
+  tiff_entry_t e = { tiff_get(t, pos, 2), tiff_get(t, pos+2, 2), tiff_get(t, pos+4, 4), pos+8 };
+  const uint64_t bytes = (uint64_t)e.count*tiff_type_size(e.type);
+  if(bytes > 4) e.pos = tiff_get(t, pos+8, 4);
+  if(e.pos > t->size || t->size - e.pos < bytes) e.count = 0; // broken, ignore
+  return e;
+}
+
+// value i of an integer or rational entry
+static inline double tiff_value(
+    const tiff_t *t,
+    const tiff_entry_t *e,
+    const uint32_t i)
+{
+  if(i >= e->count) return 0.0;
+  const size_t size = tiff_type_size(e->type), pos = e->pos + i*size;
+  switch(e->type)
+  {
+    case 1: case 7: return tiff_get(t, pos, 1);
+    case 3: return tiff_get(t, pos, 2);
+    case 4: case 13: return tiff_get(t, pos, 4);
+    case 8: return (int16_t)tiff_get(t, pos, 2);
+    case 9: return (int32_t)tiff_get(t, pos, 4);
+    case 5:
+    {
+      const uint32_t d = tiff_get(t, pos+4, 4);
+      return d ? tiff_get(t, pos, 4)/(double)d : 0.0;
+    }
+    case 10:
+    {
+      const int32_t d = tiff_get(t, pos+4, 4);
+      return d ? (int32_t)tiff_get(t, pos, 4)/(double)d : 0.0;
+    }
+    default: return 0.0;
+  }
+}
+
+// the tags of one image file directory we care about
+typedef struct tiff_ifd_t
+{
+  int width, height, bits, compression, photometric, samples, planar;
+  int rows_per_strip, tile_width, tile_height;
+  tiff_entry_t offsets, counts; // of the strips or the tiles
+  tiff_entry_t cfa_dim, cfa, black, white, area;
+  tiff_entry_t curve, black_dh, black_dv;
+  tiff_entry_t make, model, iso;
+}
+tiff_ifd_t;
+
+// parse the ifd at pos, and append the sub ifds it lists to sub.
+static inline int tiff_read_ifd(
+    const tiff_t *t,
+    const size_t pos,
+    tiff_ifd_t *ifd,
+    uint32_t *sub,
+    int *num_sub,
+    const int max_sub,
+    int *dng)
+{
+  memset(ifd, 0, sizeof(*ifd));
+  ifd->compression = ifd->samples = ifd->planar = 1;
+  const int num = tiff_get(t, pos, 2);
+  if(!num || pos + 2 + 12*(size_t)num > t->size) return 1;
+  for(int i=0;i<num;i++)
+  {
+    const tiff_entry_t e = tiff_entry(t, pos + 2 + 12*i);
+    const int v = tiff_value(t, &e, 0);
+    switch(e.tag)
+    {
+      case 256: ifd->width = v; break;
+      case 257: ifd->height = v; break;
+      case 258: ifd->bits = v; break;
+      case 259: ifd->compression = v; break;
+      case 262: ifd->photometric = v; break;
+      case 271: ifd->make = e; break;
+      case 272: ifd->model = e; break;
+      case 273: case 324: ifd->offsets = e; break;
+      case 277: ifd->samples = v; break;
+      case 278: ifd->rows_per_strip = v; break;
+      case 279: case 325: ifd->counts = e; break;
+      case 284: ifd->planar = v; break;
+      case 322: ifd->tile_width = v; break;
+      case 323: ifd->tile_height = v; break;
+      case 330: case 34665: // sub ifds and the exif ifd
+        for(uint32_t k=0;k<e.count && *num_sub<max_sub;k++) sub[(*num_sub)++] = tiff_value(t, &e, k);
+        break;
+      case 34855: ifd->iso = e; break;
+      case 828: case 33421: ifd->cfa_dim = e; break;
+      case 829: case 33422: ifd->cfa = e; break;
+      case 50706: *dng = 1; break;
+      case 50712: ifd->curve = e; break;
+      case 50714: ifd->black = e; break;
+      case 50715: ifd->black_dh = e; break;
+      case 50716: ifd->black_dv = e; break;
+      case 50717: ifd->white = e; break;
+      case 50829: ifd->area = e; break;
+    }
+  }
+  return 0;
+}
+
+// ascii entry e as a string of at most size-1 characters, white space
+// replaced by _ and trailing white space dropped
+static inline void tiff_string(
+    const tiff_t *t,
+    const tiff_entry_t *e,
+    char *str,
+    const int size)
+{
+  int n = 0;
+  for(uint32_t i=0;e->type == 2 && i<e->count && n<size-1;i++)
+  {
+    const char c = tiff_get(t, e->pos + i, 1);
+    if(!c) break;
+    str[n++] = c <= ' ' ? '_' : c;
+  }
+  while(n > 0 && str[n-1] == '_') n--;
+  str[n] = 0;
+}
+
+static inline int rawfile_open_tiff(
+    rawfile_t *r,
+    const char *filename)
+{
+  const tiff_t t = { (const uint8_t *)r->map, r->size, ((const uint8_t *)r->map)[0] == 'I' };
+  // ifd 0 and its chain, and the sub ifds, where dngs keep the raw image:
+  uint32_t list[32];
+  int num = 0, dng = 0;
+  for(uint32_t pos=tiff_get(&t, 4, 4);pos && num<8;pos=tiff_get(&t, pos + 2 + 12*tiff_get(&t, pos, 2), 4))
+    list[num++] = pos;
+  // the camera is in ifd 0, the iso in the exif ifd (or ifd 0 in tiff/ep):
+  tiff_ifd_t ifd = {0}, cur;
+  tiff_entry_t make = {0}, model = {0}, iso = {0};
+  int found = 0;
+  for(int i=0;i<num;i++)
+  {
+    if(tiff_read_ifd(&t, list[i], &cur, list, &num, 32, &dng)) continue;
+    if(!found && cur.photometric == 32803 && cur.samples == 1)
+    {
+      ifd = cur;
+      found = 1;
+    }
+    if(!make.count) make = cur.make;
+    if(!model.count) model = cur.model;
+    if(!iso.count) iso = cur.iso;
+  }
+  // most models start with the maker already ("Canon EOS 5D Mark II"):
+  char maker[16], name[40];
+  tiff_string(&t, &make, maker, sizeof(maker));
+  tiff_string(&t, &model, name, sizeof(name));
+  for(int i=0;maker[i];i++) if(maker[i] == '_') maker[i] = 0;
+  if(maker[0] && strncasecmp(name, maker, strlen(maker))) snprintf(r->camera, sizeof(r->camera), "%s_%s", maker, name);
+  else snprintf(r->camera, sizeof(r->camera), "%s", name);
+  r->iso = tiff_value(&t, &iso, 0);
+  if(!found)
+  {
+    fprintf(stderr, "[rawfile] no cfa image in `%s'\n", filename);
+    return 1;
+  }
+  if(ifd.compression != 1 || ifd.bits < 8 || ifd.bits > 16)
+  {
+    fprintf(stderr, "[rawfile] only uncompressed 8-16 bit cfa images are supported, `%s' has compression %d, %d bits\n",
+        filename, ifd.compression, ifd.bits);
+    return 1;
+  }
+  if(ifd.width <= 0 || ifd.height <= 0) return 1;
+  // packed samples are msb first in dng whatever the byte order, 16 bits
+  // follow the byte order of the file:
+  r->bits = ifd.bits;
+  r->msb = ifd.bits != 16 || !t.le;
+  r->tile_width = ifd.tile_width > 0 ? ifd.tile_width : ifd.width;
+  r->tile_height = ifd.tile_width > 0 ? ifd.tile_height : (ifd.rows_per_strip > 0 ? MIN(ifd.rows_per_strip, ifd.height) : ifd.height);
+  if(r->tile_width <= 0 || r->tile_height <= 0) return 1;
+  r->tiles_across = (ifd.width + r->tile_width - 1)/r->tile_width;
+  const int tiles_down = (ifd.height + r->tile_height - 1)/r->tile_height;
+  if(ifd.offsets.count < (uint32_t)r->tiles_across*tiles_down) return 1;
+  r->tile_stride = ((size_t)r->tile_width*r->bits + 7)/8;
+  r->tile = (const uint8_t **)malloc(sizeof(uint8_t *)*r->tiles_across*tiles_down);
+  for(int i=0;i<r->tiles_across*tiles_down;i++)
+  {
+    const size_t offset = tiff_value(&t, &ifd.offsets, i);
+    const int rows = MIN(r->tile_height, ifd.height - i/r->tiles_across*r->tile_height);
+    if(offset > r->size || (r->size - offset)/r->tile_stride < (size_t)rows) return 1;
+    r->tile[i] = t.m + offset;
+  }
+  // active area top, left, bottom, right, the frame is cropped to it:
+  r->width = ifd.width;
+  r->height = ifd.height;
+  if(ifd.area.count == 4)
+  {
+    const int top = tiff_value(&t, &ifd.area, 0), left = tiff_value(&t, &ifd.area, 1);
+    const int bottom = tiff_value(&t, &ifd.area, 2), right = tiff_value(&t, &ifd.area, 3);
+    if(top >= 0 && left >= 0 && bottom <= ifd.height && right <= ifd.width && bottom > top && right > left)
+    {
+      r->x0 = left;
+      r->y0 = top;
+      r->width = right - left;
+      r->height = bottom - top;
+    }
+  }
+  // dng gives the pattern relative to the corner of the active area (so do
+  // dng_sdk and rawspeed), which is where the frame starts: no shift by top
+  // and left. bench.c checks it with an odd active area. 0 1 2 are r g b with
+  // the default CFAPlaneColor.
+  const int cr = tiff_value(&t, &ifd.cfa_dim, 0), cc = tiff_value(&t, &ifd.cfa_dim, 1);
+  if(cr == cc && (cr == 2 || cr == 6) && ifd.cfa.count >= (uint32_t)cr*cc)
+  {
+    for(int i=0;i<cr*cc;i++)
+    {
+      const int c = tiff_value(&t, &ifd.cfa, i);
+      r->cfa[i] = c == 0 ? 'r' : (c == 1 ? 'g' : 'b');
+      if(c > 2) r->cfa[0] = 0;
+    }
+    if(!r->cfa[0]) fprintf(stderr, "[rawfile] `%s' has a cfa with other colours than rgb\n", filename);
+  }
+  else if(ifd.cfa.count) fprintf(stderr, "[rawfile] `%s' has a %dx%d cfa pattern, only 2x2 and 6x6 are supported\n", filename, cr, cc);
+  // the black level can be given per position in the pattern, we use one for
+  // all. dng defaults are black 0 and white 2^bits-1:
+  if(dng)
+  {
+    r->black = 0.0f;
+    for(uint32_t i=0;i<ifd.black.count;i++) r->black += tiff_value(&t, &ifd.black, i)/ifd.black.count;
+    r->white = ifd.white.count ? tiff_value(&t, &ifd.white, 0) : (1 << r->bits) - 1;
+    // rawfile_row() maps the samples through the table, identity tables are
+    // dropped:
+    int identity = 1;
+    for(uint32_t i=0;i<ifd.curve.count && identity;i++) identity = tiff_value(&t, &ifd.curve, i) == i;
+    if(!identity)
+    {
+      if(ifd.curve.count > 65536)
+      {
+        fprintf(stderr, "[rawfile] `%s' has a linearisation table of %u entries, at most 65536 are supported\n", filename, ifd.curve.count);
+        return 1;
+      }
+      r->curve_size = ifd.curve.count;
+      r->curve = (uint16_t *)malloc(sizeof(uint16_t)*r->curve_size);
+      for(int i=0;i<r->curve_size;i++) r->curve[i] = CLAMP(tiff_value(&t, &ifd.curve, i), 0, 65535);
+    }
+    // and subtracts the deltas, which have one value per column and row of
+    // the active area, on top of the black level:
+    if((ifd.black_dh.count && ifd.black_dh.count != (uint32_t)r->width) ||
+       (ifd.black_dv.count && ifd.black_dv.count != (uint32_t)r->height))
+    {
+      fprintf(stderr, "[rawfile] `%s' has %u black level deltas across and %u down, the frame is %dx%d\n",
+          filename, ifd.black_dh.count, ifd.black_dv.count, r->width, r->height);
+      return 1;
+    }
+    for(uint32_t i=0;i<ifd.black_dh.count;i++)
+    {
+      const float d = tiff_value(&t, &ifd.black_dh, i);
+      if(d != 0.0f && !r->black_dx) r->black_dx = (float *)calloc(r->width, sizeof(float));
+      if(r->black_dx) r->black_dx[i] = d;
+    }
+    for(uint32_t i=0;i<ifd.black_dv.count;i++)
+    {
+      const float d = tiff_value(&t, &ifd.black_dv, i);
+      if(d != 0.0f && !r->black_dy) r->black_dy = (float *)calloc(r->height, sizeof(float));
+      if(r->black_dy) r->black_dy[i] = d;
+    }
+  }
+  return 0;
+}
+
+// map filename and parse it as a pgm or a dng, or as a headerless dump with
+// the given layout if dump isn't 0. returns 0 on success.
+static inline int rawfile_open(
+    const char *filename,
+    const rawfile_dump_t *dump,
+    rawfile_t *r)
+{
+  memset(r, 0, sizeof(*r));
+  r->fd = open(filename, O_RDONLY);
+  if(r->fd < 0)
+  {
+    fprintf(stderr, "[rawfile] can't open `%s'\n", filename);
+    return 1;
+  }
+  struct stat st;
+  if(fstat(r->fd, &st) || st.st_size < 8) goto error;
+  r->size = st.st_size;
+  r->map = mmap(0, r->size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+  if(r->map == MAP_FAILED) goto error;
+  const uint8_t *m = (const uint8_t *)r->map;
+  if(dump)
+  {
+    r->width = dump->width;
+    r->height = dump->height;
+    r->bits = dump->bits;
+    r->msb = dump->msb;
+    if(rawfile_single_tile(r, dump->offset, dump->stride ? dump->stride : ((size_t)r->width*r->bits + 7)/8)) goto error;
+  }
+  else if(m[0] == 'P' && m[1] == '5')
+  {
+    if(rawfile_open_pgm(r)) goto error;
+  }
+  else if((m[0] == 'I' && m[1] == 'I' && m[2] == 42 && m[3] == 0) || (m[0] == 'M' && m[1] == 'M' && m[2] == 0 && m[3] == 42))
+  {
+    if(rawfile_open_tiff(r, filename))
+    {
+      fprintf(stderr, "[rawfile] can't read the cfa image of `%s'\n", filename);
+      rawfile_close(r);
+      return 1;
+    }
+  }
+  else goto error;
+  return 0;
+error:
+  fprintf(stderr, "[rawfile] `%s' is not a pgm, an uncompressed dng or a dump of the given size\n", filename);
+  rawfile_close(r);
+  return 1;
+}
+
+// samples x..x+n-1 of row y of the frame
+static inline void rawfile_row(
+    const rawfile_t *r,
+    const int y,
+    const int x,
+    const int n,
+    uint16_t *out)
+{
+  const int sy = r->y0 + y, ty = sy/r->tile_height;
+  const size_t row = (size_t)(sy - ty*r->tile_height)*r->tile_stride;
+  for(int i=x;i<x+n;)
+  {
+    const int sx = r->x0 + i, tx = sx/r->tile_width, first = sx - tx*r->tile_width;
+    const int cnt = MIN(x + n - i, r->tile_width - first);
+    unpack_row(r->tile[ty*r->tiles_across + tx] + row, r->tile_stride, out + i - x, first, cnt, r->bits, r->msb);
+    i += cnt;
+  }
+  // linearise first, then the black level deltas, as the dng spec has it:
+  if(r->curve)
+    for(int i=0;i<n;i++) out[i] = r->curve[MIN(out[i], r->curve_size - 1)];
+  if(r->black_dx || r->black_dy)
+  {
+    const float dy = r->black_dy ? r->black_dy[y] : 0.0f;
+    for(int i=0;i<n;i++)
+    {
+      const float v = out[i] - dy - (r->black_dx ? r->black_dx[x + i] : 0.0f);
+      out[i] = CLAMP(v + 0.5f, 0.0f, 65535.0f);
+    }
+  }
+}
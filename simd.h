@@ -0,0 +1,893 @@
+#pragma once
+// explicitly vectorised kernels. the scalar versions in wtf.h stay the
+// reference, these only ever process the interior of a row where all taps
+// are inside the buffer, so they can load unaligned vectors straight away.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+// row kernel for the edge-aware a-trous step on planar float input. in[j][k]
+// is row y+mult*(j-2) of channel k, x0 is the first pixel to process and the
+// return value is one past the last pixel that was processed.
+typedef int (*decompose_row_t)(
+    const float *const in[5][3],
+    const int mult,
+    const int channel,
+    const int scale,
+    const int x0,
+    const int x1,
+    float *coarse,
+    float *detail,
+    int *incomplete);
+
+// exp(x) for x <= 0 with range reduction to [-ln2/2, ln2/2] and the cephes
+// polynomial (about 2ulp). inputs below log(FLT_MIN) return 0, which is what
+// expf() gives us with flush-to-zero enabled by -ffast-math.
+static inline __m128 fast_exp_sse2(__m128 x)
+{
+  const __m128 valid = _mm_cmpgt_ps(x, _mm_set1_ps(-87.33654f));
+  x = _mm_max_ps(x, _mm_set1_ps(-87.33654f));
+  // n = round(x / ln2), rounding mode is nearest by default
+  const __m128i n = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)));
+  const __m128 fn = _mm_cvtepi32_ps(n);
+  x = _mm_sub_ps(x, _mm_mul_ps(fn, _mm_set1_ps(0.693359375f)));
+  x = _mm_sub_ps(x, _mm_mul_ps(fn, _mm_set1_ps(-2.12194440e-4f)));
+  const __m128 z = _mm_mul_ps(x, x);
+  __m128 y = _mm_set1_ps(1.9875691500e-4f);
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507e-3f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073e-3f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894e-2f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459e-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201e-1f));
+  y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, z), x), _mm_set1_ps(1.0f));
+  // scale by 2^n
+  const __m128 p2n = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23));
+  return _mm_and_ps(valid, _mm_mul_ps(y, p2n));
+}
+
+static inline int decompose_row_sse2(
+    const float *const in[5][3],
+    const int mult,
+    const int channel,
+    const int scale,
+    const int x0,
+    const int x1,
+    float *coarse,
+    float *detail,
+    int *incomplete)
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  const float cw[3] = {1.0, 2.0, 1.0};
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  const __m128 nfloor = _mm_set1_ps(16.0f), half = _mm_set1_ps(-5e-1f);
+  int x = x0;
+  for(;x+4<=x1;x+=4)
+  {
+    __m128 pa[3], have_a[3];
+    for(int k=0;k<3;k++)
+    {
+      pa[k] = _mm_loadu_ps(in[2][k] + x);
+      have_a[k] = _mm_cmpge_ps(pa[k], zero);
+    }
+    __m128 sum = zero, wgt = zero;
+    for(int j=0;j<5;j++) for(int i=0;i<5;i++)
+    {
+      const int xx = x + mult*(i-2);
+      __m128 pb[3], d = zero, dims = zero;
+      for(int k=0;k<3;k++)
+      {
+        pb[k] = _mm_loadu_ps(in[j][k] + xx);
+        const __m128 valid = _mm_and_ps(have_a[k], _mm_cmpge_ps(pb[k], zero));
+        const __m128 diff = _mm_sub_ps(pa[k], pb[k]);
+        const __m128 dd = _mm_max_ps(zero, _mm_sub_ps(_mm_mul_ps(diff, diff), nfloor));
+        d = _mm_add_ps(d, _mm_and_ps(valid, _mm_mul_ps(_mm_set1_ps(cw[k]), dd)));
+        dims = _mm_add_ps(dims, _mm_and_ps(valid, one));
+      }
+      __m128 ww = fast_exp_sse2(_mm_mul_ps(_mm_div_ps(d, _mm_max_ps(dims, one)), half));
+      // destination unknown: weight 1, source unknown: weight 0
+      const __m128 has_pa = have_a[channel];
+      ww = _mm_or_ps(_mm_and_ps(has_pa, ww), _mm_andnot_ps(has_pa, one));
+      ww = _mm_and_ps(_mm_cmpge_ps(pb[channel], zero), ww);
+      if(scale == 0) ww = _mm_and_ps(_mm_cmpgt_ps(ww, zero), one);
+      const __m128 w = _mm_mul_ps(_mm_set1_ps(filter[i]*filter[j]), ww);
+      sum = _mm_add_ps(sum, _mm_mul_ps(w, pb[channel]));
+      wgt = _mm_add_ps(wgt, w);
+    }
+    const __m128 valid = _mm_cmpgt_ps(wgt, zero);
+    if(_mm_movemask_ps(valid) != 0xf) *incomplete = 1;
+    sum = _mm_div_ps(sum, _mm_or_ps(_mm_and_ps(valid, wgt), _mm_andnot_ps(valid, one)));
+    const __m128 de = _mm_and_ps(_mm_and_ps(valid, have_a[channel]), _mm_sub_ps(pa[channel], sum));
+    const __m128 co = _mm_or_ps(_mm_and_ps(valid, sum), _mm_andnot_ps(valid, _mm_set1_ps(-1.0f)));
+    _mm_storeu_ps(coarse + x, co);
+    _mm_storeu_ps(detail + x, de);
+  }
+  return x;
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 fast_exp_avx2(__m256 x)
+{
+  const __m256 valid = _mm256_cmp_ps(x, _mm256_set1_ps(-87.33654f), _CMP_GT_OQ);
+  x = _mm256_max_ps(x, _mm256_set1_ps(-87.33654f));
+  const __m256 fn = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  const __m256i n = _mm256_cvtps_epi32(fn);
+  x = _mm256_fnmadd_ps(fn, _mm256_set1_ps(0.693359375f), x);
+  x = _mm256_fnmadd_ps(fn, _mm256_set1_ps(-2.12194440e-4f), x);
+  const __m256 z = _mm256_mul_ps(x, x);
+  __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507e-3f));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073e-3f));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894e-2f));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459e-1f));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201e-1f));
+  y = _mm256_add_ps(_mm256_fmadd_ps(y, z, x), _mm256_set1_ps(1.0f));
+  const __m256 p2n = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23));
+  return _mm256_and_ps(valid, _mm256_mul_ps(y, p2n));
+}
+
+__attribute__((target("avx2,fma")))
+static inline int decompose_row_avx2(
+    const float *const in[5][3],
+    const int mult,
+    const int channel,
+    const int scale,
+    const int x0,
+    const int x1,
+    float *coarse,
+    float *detail,
+    int *incomplete)
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  const float cw[3] = {1.0, 2.0, 1.0};
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  const __m256 nfloor = _mm256_set1_ps(16.0f), half = _mm256_set1_ps(-5e-1f);
+  int x = x0;
+  for(;x+8<=x1;x+=8)
+  {
+    __m256 pa[3], have_a[3];
+    for(int k=0;k<3;k++)
+    {
+      pa[k] = _mm256_loadu_ps(in[2][k] + x);
+      have_a[k] = _mm256_cmp_ps(pa[k], zero, _CMP_GE_OQ);
+    }
+    __m256 sum = zero, wgt = zero;
+    for(int j=0;j<5;j++) for(int i=0;i<5;i++)
+    {
+      const int xx = x + mult*(i-2);
+      __m256 pb[3], d = zero, dims = zero;
+      for(int k=0;k<3;k++)
+      {
+        pb[k] = _mm256_loadu_ps(in[j][k] + xx);
+        const __m256 valid = _mm256_and_ps(have_a[k], _mm256_cmp_ps(pb[k], zero, _CMP_GE_OQ));
+        const __m256 diff = _mm256_sub_ps(pa[k], pb[k]);
+        const __m256 dd = _mm256_max_ps(zero, _mm256_fmsub_ps(diff, diff, nfloor));
+        d = _mm256_add_ps(d, _mm256_and_ps(valid, _mm256_mul_ps(_mm256_set1_ps(cw[k]), dd)));
+        dims = _mm256_add_ps(dims, _mm256_and_ps(valid, one));
+      }
+      __m256 ww = fast_exp_avx2(_mm256_mul_ps(_mm256_div_ps(d, _mm256_max_ps(dims, one)), half));
+      // destination unknown: weight 1, source unknown: weight 0
+      ww = _mm256_blendv_ps(one, ww, have_a[channel]);
+      ww = _mm256_and_ps(_mm256_cmp_ps(pb[channel], zero, _CMP_GE_OQ), ww);
+      if(scale == 0) ww = _mm256_and_ps(_mm256_cmp_ps(ww, zero, _CMP_GT_OQ), one);
+      const __m256 w = _mm256_mul_ps(_mm256_set1_ps(filter[i]*filter[j]), ww);
+      sum = _mm256_fmadd_ps(w, pb[channel], sum);
+      wgt = _mm256_add_ps(wgt, w);
+    }
+    const __m256 valid = _mm256_cmp_ps(wgt, zero, _CMP_GT_OQ);
+    if(_mm256_movemask_ps(valid) != 0xff) *incomplete = 1;
+    sum = _mm256_div_ps(sum, _mm256_blendv_ps(one, wgt, valid));
+    const __m256 de = _mm256_and_ps(_mm256_and_ps(valid, have_a[channel]), _mm256_sub_ps(pa[channel], sum));
+    const __m256 co = _mm256_blendv_ps(_mm256_set1_ps(-1.0f), sum, valid);
+    _mm256_storeu_ps(coarse + x, co);
+    _mm256_storeu_ps(detail + x, de);
+  }
+  return x;
+}
+
+// fused variant that filters all three channels at once, see decompose_fused().
+// the edge-stopping weight is shared, only the availability masks differ.
+// detail may be 0 if only the coarse rows are needed.
+typedef int (*decompose_fused_row_t)(
+    const float *const in[5][3],
+    const int mult,
+    const int scale,
+    const int x0,
+    const int x1,
+    float *const coarse[3],
+    float *const detail[3],
+    int *incomplete);
+
+static inline int decompose_fused_row_sse2(
+    const float *const in[5][3],
+    const int mult,
+    const int scale,
+    const int x0,
+    const int x1,
+    float *const coarse[3],
+    float *const detail[3],
+    int *incomplete)
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  const float cw[3] = {1.0, 2.0, 1.0};
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  const __m128 nfloor = _mm_set1_ps(16.0f), half = _mm_set1_ps(-5e-1f);
+  int x = x0;
+  for(;x+4<=x1;x+=4)
+  {
+    __m128 pa[3], have_a[3], sum[3], wgt[3];
+    for(int k=0;k<3;k++)
+    {
+      pa[k] = _mm_loadu_ps(in[2][k] + x);
+      have_a[k] = _mm_cmpge_ps(pa[k], zero);
+      sum[k] = wgt[k] = zero;
+    }
+    for(int j=0;j<5;j++) for(int i=0;i<5;i++)
+    {
+      const int xx = x + mult*(i-2);
+      __m128 pb[3], have_b[3], d = zero, dims = zero;
+      for(int k=0;k<3;k++)
+      {
+        pb[k] = _mm_loadu_ps(in[j][k] + xx);
+        have_b[k] = _mm_cmpge_ps(pb[k], zero);
+        const __m128 valid = _mm_and_ps(have_a[k], have_b[k]);
+        const __m128 diff = _mm_sub_ps(pa[k], pb[k]);
+        const __m128 dd = _mm_max_ps(zero, _mm_sub_ps(_mm_mul_ps(diff, diff), nfloor));
+        d = _mm_add_ps(d, _mm_and_ps(valid, _mm_mul_ps(_mm_set1_ps(cw[k]), dd)));
+        dims = _mm_add_ps(dims, _mm_and_ps(valid, one));
+      }
+      const __m128 ww = fast_exp_sse2(_mm_mul_ps(_mm_div_ps(d, _mm_max_ps(dims, one)), half));
+      const __m128 f = _mm_set1_ps(filter[i]*filter[j]);
+      for(int k=0;k<3;k++)
+      { // destination unknown: weight 1, source unknown: weight 0
+        __m128 wk = _mm_or_ps(_mm_and_ps(have_a[k], ww), _mm_andnot_ps(have_a[k], one));
+        wk = _mm_and_ps(have_b[k], wk);
+        if(scale == 0) wk = _mm_and_ps(_mm_cmpgt_ps(wk, zero), one);
+        const __m128 w = _mm_mul_ps(f, wk);
+        sum[k] = _mm_add_ps(sum[k], _mm_mul_ps(w, pb[k]));
+        wgt[k] = _mm_add_ps(wgt[k], w);
+      }
+    }
+    for(int k=0;k<3;k++)
+    {
+      const __m128 valid = _mm_cmpgt_ps(wgt[k], zero);
+      if(_mm_movemask_ps(valid) != 0xf) *incomplete = 1;
+      const __m128 s = _mm_div_ps(sum[k], _mm_or_ps(_mm_and_ps(valid, wgt[k]), _mm_andnot_ps(valid, one)));
+      const __m128 co = _mm_or_ps(_mm_and_ps(valid, s), _mm_andnot_ps(valid, _mm_set1_ps(-1.0f)));
+      _mm_storeu_ps(coarse[k] + x, co);
+      if(detail) _mm_storeu_ps(detail[k] + x, _mm_and_ps(_mm_and_ps(valid, have_a[k]), _mm_sub_ps(pa[k], s)));
+    }
+  }
+  return x;
+}
+
+__attribute__((target("avx2,fma")))
+static inline int decompose_fused_row_avx2(
+    const float *const in[5][3],
+    const int mult,
+    const int scale,
+    const int x0,
+    const int x1,
+    float *const coarse[3],
+    float *const detail[3],
+    int *incomplete)
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  const float cw[3] = {1.0, 2.0, 1.0};
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  const __m256 nfloor = _mm256_set1_ps(16.0f), half = _mm256_set1_ps(-5e-1f);
+  int x = x0;
+  for(;x+8<=x1;x+=8)
+  {
+    __m256 pa[3], have_a[3], sum[3], wgt[3];
+    for(int k=0;k<3;k++)
+    {
+      pa[k] = _mm256_loadu_ps(in[2][k] + x);
+      have_a[k] = _mm256_cmp_ps(pa[k], zero, _CMP_GE_OQ);
+      sum[k] = wgt[k] = zero;
+    }
+    for(int j=0;j<5;j++) for(int i=0;i<5;i++)
+    {
+      const int xx = x + mult*(i-2);
+      __m256 pb[3], have_b[3], d = zero, dims = zero;
+      for(int k=0;k<3;k++)
+      {
+        pb[k] = _mm256_loadu_ps(in[j][k] + xx);
+        have_b[k] = _mm256_cmp_ps(pb[k], zero, _CMP_GE_OQ);
+        const __m256 valid = _mm256_and_ps(have_a[k], have_b[k]);
+        const __m256 diff = _mm256_sub_ps(pa[k], pb[k]);
+        const __m256 dd = _mm256_max_ps(zero, _mm256_fmsub_ps(diff, diff, nfloor));
+        d = _mm256_add_ps(d, _mm256_and_ps(valid, _mm256_mul_ps(_mm256_set1_ps(cw[k]), dd)));
+        dims = _mm256_add_ps(dims, _mm256_and_ps(valid, one));
+      }
+      const __m256 ww = fast_exp_avx2(_mm256_mul_ps(_mm256_div_ps(d, _mm256_max_ps(dims, one)), half));
+      const __m256 f = _mm256_set1_ps(filter[i]*filter[j]);
+      for(int k=0;k<3;k++)
+      { // destination unknown: weight 1, source unknown: weight 0
+        __m256 wk = _mm256_blendv_ps(one, ww, have_a[k]);
+        wk = _mm256_and_ps(have_b[k], wk);
+        if(scale == 0) wk = _mm256_and_ps(_mm256_cmp_ps(wk, zero, _CMP_GT_OQ), one);
+        const __m256 w = _mm256_mul_ps(f, wk);
+        sum[k] = _mm256_fmadd_ps(w, pb[k], sum[k]);
+        wgt[k] = _mm256_add_ps(wgt[k], w);
+      }
+    }
+    for(int k=0;k<3;k++)
+    {
+      const __m256 valid = _mm256_cmp_ps(wgt[k], zero, _CMP_GT_OQ);
+      if(_mm256_movemask_ps(valid) != 0xff) *incomplete = 1;
+      const __m256 s = _mm256_div_ps(sum[k], _mm256_blendv_ps(one, wgt[k], valid));
+      const __m256 co = _mm256_blendv_ps(_mm256_set1_ps(-1.0f), s, valid);
+      _mm256_storeu_ps(coarse[k] + x, co);
+      if(detail) _mm256_storeu_ps(detail[k] + x, _mm256_and_ps(_mm256_and_ps(valid, have_a[k]), _mm256_sub_ps(pa[k], s)));
+    }
+  }
+  return x;
+}
+
+// one 5 tap pass of the separable approximation of decompose_fused(), along
+// rows or columns, depending on the taps: tap i of pixel x is
+// guide[i][k][x + off[i]] and src[i][k][x + off[i]]. the edge-stopping weight
+// compares guide taps to the guide centre, src taps of -1 are unset.
+typedef int (*decompose_separable_row_t)(
+    const float *const guide[5][3],
+    const float *const src[5][3],
+    const int off[5],
+    const int scale,
+    const int x0,
+    const int x1,
+    float *const out[3],
+    int *incomplete);
+
+static inline int decompose_separable_row_sse2(
+    const float *const guide[5][3],
+    const float *const src[5][3],
+    const int off[5],
+    const int scale,
+    const int x0,
+    const int x1,
+    float *const out[3],
+    int *incomplete)
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  const float cw[3] = {1.0, 2.0, 1.0};
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  const __m128 nfloor = _mm_set1_ps(16.0f), half = _mm_set1_ps(-5e-1f);
+  int x = x0;
+  for(;x+4<=x1;x+=4)
+  {
+    __m128 pa[3], have_a[3], sum[3], wgt[3];
+    for(int k=0;k<3;k++)
+    {
+      pa[k] = _mm_loadu_ps(guide[2][k] + x + off[2]);
+      have_a[k] = _mm_cmpge_ps(pa[k], zero);
+      sum[k] = wgt[k] = zero;
+    }
+    for(int i=0;i<5;i++)
+    {
+      const int xx = x + off[i];
+      __m128 d = zero, dims = zero;
+      for(int k=0;k<3;k++)
+      {
+        const __m128 pg = _mm_loadu_ps(guide[i][k] + xx);
+        const __m128 valid = _mm_and_ps(have_a[k], _mm_cmpge_ps(pg, zero));
+        const __m128 diff = _mm_sub_ps(pa[k], pg);
+        const __m128 dd = _mm_max_ps(zero, _mm_sub_ps(_mm_mul_ps(diff, diff), nfloor));
+        d = _mm_add_ps(d, _mm_and_ps(valid, _mm_mul_ps(_mm_set1_ps(cw[k]), dd)));
+        dims = _mm_add_ps(dims, _mm_and_ps(valid, one));
+      }
+      const __m128 ww = fast_exp_sse2(_mm_mul_ps(_mm_div_ps(d, _mm_max_ps(dims, one)), half));
+      const __m128 f = _mm_set1_ps(filter[i]);
+      for(int k=0;k<3;k++)
+      { // destination unknown: weight 1, source unknown: weight 0
+        const __m128 pb = _mm_loadu_ps(src[i][k] + xx);
+        __m128 wk = _mm_or_ps(_mm_and_ps(have_a[k], ww), _mm_andnot_ps(have_a[k], one));
+        wk = _mm_and_ps(_mm_cmpge_ps(pb, zero), wk);
+        if(scale == 0) wk = _mm_and_ps(_mm_cmpgt_ps(wk, zero), one);
+        const __m128 w = _mm_mul_ps(f, wk);
+        sum[k] = _mm_add_ps(sum[k], _mm_mul_ps(w, pb));
+        wgt[k] = _mm_add_ps(wgt[k], w);
+      }
+    }
+    for(int k=0;k<3;k++)
+    {
+      const __m128 valid = _mm_cmpgt_ps(wgt[k], zero);
+      if(_mm_movemask_ps(valid) != 0xf) *incomplete = 1;
+      const __m128 s = _mm_div_ps(sum[k], _mm_or_ps(_mm_and_ps(valid, wgt[k]), _mm_andnot_ps(valid, one)));
+      _mm_storeu_ps(out[k] + x, _mm_or_ps(_mm_and_ps(valid, s), _mm_andnot_ps(valid, _mm_set1_ps(-1.0f))));
+    }
+  }
+  return x;
+}
+
+__attribute__((target("avx2,fma")))
+static inline int decompose_separable_row_avx2(
+    const float *const guide[5][3],
+    const float *const src[5][3],
+    const int off[5],
+    const int scale,
+    const int x0,
+    const int x1,
+    float *const out[3],
+    int *incomplete)
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  const float cw[3] = {1.0, 2.0, 1.0};
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  const __m256 nfloor = _mm256_set1_ps(16.0f), half = _mm256_set1_ps(-5e-1f);
+  int x = x0;
+  for(;x+8<=x1;x+=8)
+  {
+    __m256 pa[3], have_a[3], sum[3], wgt[3];
+    for(int k=0;k<3;k++)
+    {
+      pa[k] = _mm256_loadu_ps(guide[2][k] + x + off[2]);
+      have_a[k] = _mm256_cmp_ps(pa[k], zero, _CMP_GE_OQ);
+      sum[k] = wgt[k] = zero;
+    }
+    for(int i=0;i<5;i++)
+    {
+      const int xx = x + off[i];
+      __m256 d = zero, dims = zero;
+      for(int k=0;k<3;k++)
+      {
+        const __m256 pg = _mm256_loadu_ps(guide[i][k] + xx);
+        const __m256 valid = _mm256_and_ps(have_a[k], _mm256_cmp_ps(pg, zero, _CMP_GE_OQ));
+        const __m256 diff = _mm256_sub_ps(pa[k], pg);
+        const __m256 dd = _mm256_max_ps(zero, _mm256_fmsub_ps(diff, diff, nfloor));
+        d = _mm256_add_ps(d, _mm256_and_ps(valid, _mm256_mul_ps(_mm256_set1_ps(cw[k]), dd)));
+        dims = _mm256_add_ps(dims, _mm256_and_ps(valid, one));
+      }
+      const __m256 ww = fast_exp_avx2(_mm256_mul_ps(_mm256_div_ps(d, _mm256_max_ps(dims, one)), half));
+      const __m256 f = _mm256_set1_ps(filter[i]);
+      for(int k=0;k<3;k++)
+      { // destination unknown: weight 1, source unknown: weight 0
+        const __m256 pb = _mm256_loadu_ps(src[i][k] + xx);
+        __m256 wk = _mm256_blendv_ps(one, ww, have_a[k]);
+        wk = _mm256_and_ps(_mm256_cmp_ps(pb, zero, _CMP_GE_OQ), wk);
+        if(scale == 0) wk = _mm256_and_ps(_mm256_cmp_ps(wk, zero, _CMP_GT_OQ), one);
+        const __m256 w = _mm256_mul_ps(f, wk);
+        sum[k] = _mm256_fmadd_ps(w, pb, sum[k]);
+        wgt[k] = _mm256_add_ps(wgt[k], w);
+      }
+    }
+    for(int k=0;k<3;k++)
+    {
+      const __m256 valid = _mm256_cmp_ps(wgt[k], zero, _CMP_GT_OQ);
+      if(_mm256_movemask_ps(valid) != 0xff) *incomplete = 1;
+      const __m256 s = _mm256_div_ps(sum[k], _mm256_blendv_ps(one, wgt[k], valid));
+      _mm256_storeu_ps(out[k] + x, _mm256_blendv_ps(_mm256_set1_ps(-1.0f), s, valid));
+    }
+  }
+  return x;
+}
+
+// horizontal pass of scale 0 of decompose_raw() on a row of raw uint16
+// samples with a 2x2 pattern, see decompose_raw16_row() in wtf.h. pixel x
+// carries the channel of phase x&1: that channel gets the taps x-2, x, x+2,
+// the other one x-1 and x+1. both are half the filter, so the coarse values
+// are the integer sums times 1/8, exact in float. out[p] is the coarse row of
+// the channel of phase p. x0 has to be even.
+typedef int (*decompose_raw16_row_t)(
+    const uint16_t *in,
+    const int x0,
+    const int x1,
+    float *const out[2]);
+
+static inline int decompose_raw16_row_sse2(
+    const uint16_t *in,
+    const int x0,
+    const int x1,
+    float *const out[2])
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 eighth = _mm_set1_ps(0.125f);
+  const __m128 even = _mm_castsi128_ps(_mm_set_epi32(0, -1, 0, -1));
+  int x = x0;
+  for(;x+4<=x1;x+=4)
+  {
+    __m128i t[5];
+    for(int i=0;i<5;i++) t[i] = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(in + x + i - 2)), zero);
+    const __m128i own = _mm_add_epi32(_mm_add_epi32(t[0], t[4]), _mm_add_epi32(_mm_slli_epi32(t[2], 2), _mm_slli_epi32(t[2], 1)));
+    const __m128i other = _mm_slli_epi32(_mm_add_epi32(t[1], t[3]), 2);
+    const __m128 a = _mm_mul_ps(_mm_cvtepi32_ps(own), eighth), b = _mm_mul_ps(_mm_cvtepi32_ps(other), eighth);
+    _mm_storeu_ps(out[0] + x, _mm_or_ps(_mm_and_ps(even, a), _mm_andnot_ps(even, b)));
+    _mm_storeu_ps(out[1] + x, _mm_or_ps(_mm_and_ps(even, b), _mm_andnot_ps(even, a)));
+  }
+  return x;
+}
+
+__attribute__((target("avx2")))
+static inline int decompose_raw16_row_avx2(
+    const uint16_t *in,
+    const int x0,
+    const int x1,
+    float *const out[2])
+{
+  const __m256 eighth = _mm256_set1_ps(0.125f);
+  int x = x0;
+  for(;x+8<=x1;x+=8)
+  {
+    __m256i t[5];
+    for(int i=0;i<5;i++) t[i] = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in + x + i - 2)));
+    const __m256i own = _mm256_add_epi32(_mm256_add_epi32(t[0], t[4]), _mm256_mullo_epi32(t[2], _mm256_set1_epi32(6)));
+    const __m256i other = _mm256_slli_epi32(_mm256_add_epi32(t[1], t[3]), 2);
+    const __m256 a = _mm256_mul_ps(_mm256_cvtepi32_ps(own), eighth), b = _mm256_mul_ps(_mm256_cvtepi32_ps(other), eighth);
+    // odd lanes are the other phase:
+    _mm256_storeu_ps(out[0] + x, _mm256_blend_ps(a, b, 0xaa));
+    _mm256_storeu_ps(out[1] + x, _mm256_blend_ps(b, a, 0xaa));
+  }
+  return x;
+}
+
+// instruction sets we have kernels for
+typedef enum simd_isa_t
+{
+  s_isa_none,
+  s_isa_sse2,
+  s_isa_avx2,
+}
+simd_isa_t;
+
+// pick the widest instruction set the cpu supports. WTF_SIMD=scalar|sse2|avx2
+// in the environment overrides this, to compare against the reference.
+static inline simd_isa_t simd_isa()
+{
+  static int isa = -1;
+  if(isa >= 0) return isa;
+  const char *env = getenv("WTF_SIMD");
+  if(env && !strcmp(env, "scalar")) isa = s_isa_none;
+  else if(env && !strcmp(env, "sse2")) isa = s_isa_sse2;
+  else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) isa = s_isa_avx2;
+  else isa = s_isa_sse2;
+  return isa;
+}
+
+// no vector code, the caller runs the scalar reference on the whole row.
+static inline int decompose_row_none(
+    const float *const in[5][3],
+    const int mult,
+    const int channel,
+    const int scale,
+    const int x0,
+    const int x1,
+    float *coarse,
+    float *detail,
+    int *incomplete)
+{
+  return x0;
+}
+
+static inline int decompose_fused_row_none(
+    const float *const in[5][3],
+    const int mult,
+    const int scale,
+    const int x0,
+    const int x1,
+    float *const coarse[3],
+    float *const detail[3],
+    int *incomplete)
+{
+  return x0;
+}
+
+static inline int decompose_separable_row_none(
+    const float *const guide[5][3],
+    const float *const src[5][3],
+    const int off[5],
+    const int scale,
+    const int x0,
+    const int x1,
+    float *const out[3],
+    int *incomplete)
+{
+  return x0;
+}
+
+static inline int decompose_raw16_row_none(
+    const uint16_t *in,
+    const int x0,
+    const int x1,
+    float *const out[2])
+{
+  return x0;
+}
+
+static inline decompose_row_t decompose_row_simd()
+{
+  switch(simd_isa())
+  {
+    case s_isa_avx2: return decompose_row_avx2;
+    case s_isa_sse2: return decompose_row_sse2;
+    default:         return decompose_row_none;
+  }
+}
+
+static inline decompose_fused_row_t decompose_fused_row_simd()
+{
+  switch(simd_isa())
+  {
+    case s_isa_avx2: return decompose_fused_row_avx2;
+    case s_isa_sse2: return decompose_fused_row_sse2;
+    default:         return decompose_fused_row_none;
+  }
+}
+
+static inline decompose_separable_row_t decompose_separable_row_simd()
+{
+  switch(simd_isa())
+  {
+    case s_isa_avx2: return decompose_separable_row_avx2;
+    case s_isa_sse2: return decompose_separable_row_sse2;
+    default:         return decompose_separable_row_none;
+  }
+}
+
+static inline decompose_raw16_row_t decompose_raw16_row_simd()
+{
+  switch(simd_isa())
+  {
+    case s_isa_avx2: return decompose_raw16_row_avx2;
+    case s_isa_sse2: return decompose_raw16_row_sse2;
+    default:         return decompose_raw16_row_none;
+  }
+}
+
+// ieee half floats for the reduced precision detail buffers. scalar versions
+// after fabian giesen's bit tricks, rounding to nearest even like f16c does.
+static inline uint16_t float_to_half(const float v)
+{
+  union { float f; uint32_t u; } f = { .f = v }, denorm = { .u = 126u<<23 };
+  const uint32_t sign = f.u & 0x80000000u;
+  uint16_t o;
+  f.u ^= sign;
+  if(f.u >= 0x47800000u) // out of range: inf, or nan stays nan
+    o = f.u > 0x7f800000u ? 0x7e00 : 0x7c00;
+  else if(f.u < (113u<<23)) // denormal half, let the fpu do the rounding
+  {
+    f.f += denorm.f;
+    o = f.u - denorm.u;
+  }
+  else
+  {
+    const uint32_t odd = (f.u >> 13) & 1;
+    f.u += ((uint32_t)(15-127)<<23) + 0xfff + odd;
+    o = f.u >> 13;
+  }
+  return o | (sign >> 16);
+}
+
+static inline float half_to_float(const uint16_t h)
+{
+  union { float f; uint32_t u; } o = { .u = (uint32_t)(h & 0x7fff) << 13 }, magic = { .u = 113u<<23 };
+  const uint32_t exp = o.u & (0x7c00u << 13);
+  o.u += (uint32_t)(127-15) << 23;
+  if(exp == 0x7c00u << 13) o.u += (uint32_t)(128-16) << 23; // inf/nan
+  else if(exp == 0) // denormal, renormalise
+  {
+    o.u += 1u << 23;
+    o.f -= magic.f;
+  }
+  o.u |= (uint32_t)(h & 0x8000) << 16;
+  return o.f;
+}
+
+__attribute__((target("avx,f16c")))
+static inline void float_to_half_row_f16c(const float *in, uint16_t *out, const int n)
+{
+  int x = 0;
+  for(;x<=n-8;x+=8)
+    _mm_storeu_si128((__m128i *)(out + x), _mm256_cvtps_ph(_mm256_loadu_ps(in + x), _MM_FROUND_TO_NEAREST_INT));
+  for(;x<n;x++) out[x] = float_to_half(in[x]);
+}
+
+__attribute__((target("avx,f16c")))
+static inline void half_to_float_row_f16c(const uint16_t *in, float *out, const int n)
+{
+  int x = 0;
+  for(;x<=n-8;x+=8)
+    _mm256_storeu_ps(out + x, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + x))));
+  for(;x<n;x++) out[x] = half_to_float(in[x]);
+}
+
+static inline int simd_f16c()
+{
+  static int f16c = -1;
+  if(f16c < 0) f16c = simd_isa() != s_isa_none && __builtin_cpu_supports("f16c");
+  return f16c;
+}
+
+static inline void float_to_half_row(const float *in, uint16_t *out, const int n)
+{
+  if(simd_f16c()) float_to_half_row_f16c(in, out, n);
+  else for(int x=0;x<n;x++) out[x] = float_to_half(in[x]);
+}
+
+static inline void half_to_float_row(const uint16_t *in, float *out, const int n)
+{
+  if(simd_f16c()) half_to_float_row_f16c(in, out, n);
+  else for(int x=0;x<n;x++) out[x] = half_to_float(in[x]);
+}
+
+// big endian 16-bit samples as found in pgm files to host order. in doesn't
+// have to be aligned.
+static inline void swap16_row_sse2(const uint8_t *in, uint16_t *out, const int n)
+{
+  int x = 0;
+  for(;x<=n-8;x+=8)
+  {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(in + 2*x));
+    _mm_storeu_si128((__m128i *)(out + x), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+  }
+  for(;x<n;x++) out[x] = (in[2*x] << 8) | in[2*x+1];
+}
+
+__attribute__((target("avx2")))
+static inline void swap16_row_avx2(const uint8_t *in, uint16_t *out, const int n)
+{
+  int x = 0;
+  for(;x<=n-16;x+=16)
+  {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)(in + 2*x));
+    _mm256_storeu_si256((__m256i *)(out + x), _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8)));
+  }
+  for(;x<n;x++) out[x] = (in[2*x] << 8) | in[2*x+1];
+}
+
+static inline void swap16_row(const uint8_t *in, uint16_t *out, const int n)
+{
+  switch(simd_isa())
+  {
+    case s_isa_avx2: swap16_row_avx2(in, out, n); return;
+    case s_isa_sse2: swap16_row_sse2(in, out, n); return;
+    default: for(int x=0;x<n;x++) out[x] = (in[2*x] << 8) | in[2*x+1];
+  }
+}
+
+// sample i of a stream of bits (8..16) bit samples without padding, most
+// significant bit first like dng and most sensor dumps, or least significant
+// bit first (msb = 0). a sample touches at most three bytes.
+static inline uint16_t unpack_sample(
+    const uint8_t *in,
+    const int bits,
+    const int msb,
+    const size_t i)
+{
+  const size_t bit = bits*i;
+  const uint8_t *p = in + (bit >> 3);
+  const int off = bit & 7, n = (off + bits + 7) >> 3;
+  uint32_t w = 0;
+  if(msb)
+  {
+    for(int k=0;k<n;k++) w = (w << 8) | p[k];
+    w >>= 8*n - off - bits;
+  }
+  else
+  {
+    for(int k=0;k<n;k++) w |= (uint32_t)p[k] << 8*k;
+    w >>= off;
+  }
+  return w & ((1u << bits) - 1);
+}
+
+// 8 samples are bits bytes. for even bits, the four samples of each 128-bit
+// lane start at byte 0 and bits/2 of the group, and one byte shuffle puts the
+// three bytes of every sample into a 32-bit word, which a variable shift and a
+// mask turn into the value. sse2 has no byte shuffle, that's scalar.
+// samples x0..x1-1, x0 a multiple of 8, of a stream of bytes bytes. returns
+// one past the last sample that was unpacked.
+__attribute__((target("avx2")))
+static inline int unpack_row_avx2(
+    const uint8_t *in,
+    const size_t bytes,
+    uint16_t *out,
+    const int x0,
+    const int x1,
+    const int bits,
+    const int msb)
+{
+  if(bits & 1) return x0;
+  int8_t idx[16];
+  int32_t shift[4];
+  for(int j=0;j<4;j++)
+  {
+    const int b = bits*j >> 3, off = bits*j & 7;
+    for(int k=0;k<3;k++) idx[4*j+k] = msb ? b+2-k : b+k;
+    idx[4*j+3] = -1; // zero
+    shift[j] = msb ? 24 - off - bits : off;
+  }
+  const __m256i sh = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)idx));
+  const __m256i count = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)shift));
+  const __m256i mask = _mm256_set1_epi32((1 << bits) - 1);
+  int x = x0;
+  // the upper lane loads 16 bytes from bits/2 into the group:
+  for(;x<=x1-8 && (size_t)x/8*bits + bits/2 + 16 <= bytes;x+=8)
+  {
+    const uint8_t *p = in + (size_t)x/8*bits;
+    const __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+          _mm_loadu_si128((const __m128i *)p)), _mm_loadu_si128((const __m128i *)(p + bits/2)), 1);
+    const __m256i w = _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(v, sh), count), mask);
+    const __m256i s = _mm256_permute4x64_epi64(_mm256_packus_epi32(w, w), 0x08);
+    _mm_storeu_si128((__m128i *)(out + x - x0), _mm256_castsi256_si128(s));
+  }
+  return x;
+}
+
+// samples first..first+n-1 of a packed stream of bytes bytes to out[0..n-1].
+static inline void unpack_row(
+    const uint8_t *in,
+    const size_t bytes,
+    uint16_t *out,
+    const int first,
+    const int n,
+    const int bits,
+    const int msb)
+{
+  if(bits == 16 && msb) { swap16_row(in + 2*(size_t)first, out, n); return; }
+  if(bits == 16) { memcpy(out, in + 2*(size_t)first, sizeof(uint16_t)*n); return; }
+  int x = first;
+  const int end = first + n;
+  for(;x<end && (x & 7);x++) out[x-first] = unpack_sample(in, bits, msb, x);
+  if(simd_isa() == s_isa_avx2) x = unpack_row_avx2(in, bytes, out + x-first, x, end, bits, msb);
+  for(;x<end;x++) out[x-first] = unpack_sample(in, bits, msb, x);
+}
+
+// the inverse variance stabilising transform with the normalisation to black
+// and white folded in, as a polynomial in v and 1/v (see backtransform_coeff()
+// in wtf.h): c[0]*v^2 + c[1] + c[2]/v + c[3]/v^2 + c[4]/v^3 for v >= 0.5,
+// c[5] below that.
+static inline float backtransform_eval(const float c[6], const float v)
+{
+  if(v < 0.5f) return c[5];
+  const float r = 1.0f/v;
+  return c[0]*v*v + c[1] + r*(c[2] + r*(c[3] + r*c[4]));
+}
+
+static inline void backtransform_row_sse2(const float c[6], const float *in, float *out, const int n)
+{
+  const __m128 half = _mm_set1_ps(0.5f), one = _mm_set1_ps(1.0f);
+  int x = 0;
+  for(;x<=n-4;x+=4)
+  {
+    const __m128 v = _mm_loadu_ps(in + x);
+    const __m128 r = _mm_div_ps(one, _mm_max_ps(v, half));
+    __m128 y = _mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(c[4])), _mm_set1_ps(c[3]));
+    y = _mm_add_ps(_mm_mul_ps(r, y), _mm_set1_ps(c[2]));
+    y = _mm_add_ps(_mm_mul_ps(r, y), _mm_set1_ps(c[1]));
+    y = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(v, v), _mm_set1_ps(c[0])), y);
+    const __m128 lo = _mm_cmplt_ps(v, half);
+    _mm_storeu_ps(out + x, _mm_or_ps(_mm_and_ps(lo, _mm_set1_ps(c[5])), _mm_andnot_ps(lo, y)));
+  }
+  for(;x<n;x++) out[x] = backtransform_eval(c, in[x]);
+}
+
+__attribute__((target("avx2,fma")))
+static inline void backtransform_row_avx2(const float c[6], const float *in, float *out, const int n)
+{
+  const __m256 half = _mm256_set1_ps(0.5f), one = _mm256_set1_ps(1.0f);
+  int x = 0;
+  for(;x<=n-8;x+=8)
+  {
+    const __m256 v = _mm256_loadu_ps(in + x);
+    const __m256 r = _mm256_div_ps(one, _mm256_max_ps(v, half));
+    __m256 y = _mm256_fmadd_ps(r, _mm256_set1_ps(c[4]), _mm256_set1_ps(c[3]));
+    y = _mm256_fmadd_ps(r, y, _mm256_set1_ps(c[2]));
+    y = _mm256_fmadd_ps(r, y, _mm256_set1_ps(c[1]));
+    y = _mm256_fmadd_ps(_mm256_mul_ps(v, v), _mm256_set1_ps(c[0]), y);
+    _mm256_storeu_ps(out + x, _mm256_blendv_ps(y, _mm256_set1_ps(c[5]), _mm256_cmp_ps(v, half, _CMP_LT_OQ)));
+  }
+  for(;x<n;x++) out[x] = backtransform_eval(c, in[x]);
+}
+
+static inline void backtransform_row(const float c[6], const float *in, float *out, const int n)
+{
+  switch(simd_isa())
+  {
+    case s_isa_avx2: backtransform_row_avx2(c, in, out, n); return;
+    case s_isa_sse2: backtransform_row_sse2(c, in, out, n); return;
+    default: for(int x=0;x<n;x++) out[x] = backtransform_eval(c, in[x]);
+  }
+}
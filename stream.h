@@ -0,0 +1,288 @@
+#pragma once
+// streaming pyramid: runs decompose_fused() over all scales and the
+// synthesis in horizontal bands. every level only keeps the rolling window of
+// rows the dilated support of the next level needs (mult*2 rows each way), and
+// output rows are emitted as soon as all levels have them. memory is about
+// width * (band + 2^scales) rows instead of eight full frames.
+#include "wtf.h"
+
+// rolling window of rows, row y lives in slot y % rows.
+typedef struct stream_ring_t
+{
+  float *data;               // rows * planes * width floats
+  int rows, planes, width;   // dimensions of the window
+  int done;                  // rows [0, done) have been produced so far
+}
+stream_ring_t;
+
+// called for every output row, in order from top to bottom. row[c] is the
+// synthesised (still variance stabilised) row of channel c.
+typedef void (*stream_emit_t)(
+    void *data,
+    const float *const row[3]);
+
+static inline void stream_ring_init(
+    stream_ring_t *r,
+    const int rows,
+    const int planes,
+    const int width)
+{
+  r->rows = rows;
+  r->planes = planes;
+  r->width = width;
+  r->done = 0;
+  r->data = (float *)malloc(sizeof(float)*rows*planes*width);
+}
+
+static inline float *stream_row(
+    const stream_ring_t *r,
+    const int plane,
+    const int y)
+{
+  return r->data + ((size_t)(y % r->rows)*r->planes + plane)*r->width;
+}
+
+// produce the next rows of the stabilised input window, as far as level 0
+// has consumed it. returns the number of rows produced.
+static inline int stream_stabilise_band(
+    const buffer_t *input,
+    stream_ring_t *in,
+    const stream_ring_t *coarse0,
+    const int band)
+{
+  const int needed = MAX(0, coarse0->done - 2); // first row level 0 still reads
+  const int y0 = in->done;
+  const int y1 = MIN(MIN(input->height, y0 + band), needed + in->rows);
+  if(y1 <= y0) return 0;
+  const float noise_a = input->noise_a;
+  const float sigma2 = (input->noise_b/input->noise_a)*(input->noise_b/input->noise_a);
+#pragma omp parallel for default(shared)
+  for(int y=y0;y<y1;y++)
+    stabilise_row(buffer_row_raw(input, y), stream_row(in, 0, y), input->width, noise_a, sigma2);
+  in->done = y1;
+  return y1 - y0;
+}
+
+// produce the next band of rows of one pyramid level. src is the window of
+// the level above, or 0 to read cfa rows straight from the input buffer.
+// capacity is the first row that would overwrite a row still in use.
+// stats, if given, accumulates the detail statistics of the three channels,
+// the same ones decompose() gathers for synthesize().
+static inline int stream_decompose_band(
+    const buffer_t *input,
+    const stream_ring_t *src,
+    stream_ring_t *coarse,
+    stream_ring_t *detail,
+    const int scale,
+    const int band,
+    const int capacity,
+    detail_stats_t *stats)
+{
+  const int mult = 1<<scale;
+  const int wd = input->width, ht = input->height;
+  const int src_done = src ? src->done : ht;
+  const int avail = src_done == ht ? ht : src_done - 2*mult;
+  const int y0 = coarse->done;
+  const int y1 = MIN(MIN(avail, y0 + band), capacity);
+  if(y1 <= y0) return 0;
+  const float noise_a = input->noise_a;
+  const float sigma2 = (input->noise_b/input->noise_a)*(input->noise_b/input->noise_a);
+  int incomplete = 0;
+#pragma omp parallel default(shared)
+  {
+    detail_stats_t part[3] = {{0}}; // per thread partials
+#pragma omp for
+    for(int y=y0;y<y1;y++)
+    {
+      int ty[5];
+      filter_taps(ty, y, mult, ht);
+      float *co[3], *de[3];
+      for(int k=0;k<3;k++)
+      {
+        co[k] = stream_row(coarse, k, y);
+        de[k] = stream_row(detail, k, y);
+      }
+      int inc = 0;
+      if(scale == 0)
+      {
+        const void *in[5];
+        const cfa_t *cfa = &input->cfa;
+        const int x6 = cfa->size == 6;
+        if(src || input->type == s_buf_cfa_float)
+        { // stabilised input window or float plane
+          for(int j=0;j<5;j++) in[j] = src ? (const void *)stream_row(src, 0, ty[j]) : (const void *)buffer_row(input, 0, ty[j]);
+          inc = x6 ? decompose_fused_cfa_row(in, ty, wd, mult, scale, s_buf_cfa_float, noise_a, sigma2, cfa, 6, co, de)
+                   : decompose_fused_cfa_row(in, ty, wd, mult, scale, s_buf_cfa_float, noise_a, sigma2, cfa, 2, co, de);
+        }
+        else
+        { // plain raw rows
+          for(int j=0;j<5;j++) in[j] = buffer_row_raw(input, ty[j]);
+          inc = x6 ? decompose_fused_cfa_row(in, ty, wd, mult, scale, s_buf_raw, noise_a, sigma2, cfa, 6, co, de)
+                   : decompose_fused_cfa_row(in, ty, wd, mult, scale, s_buf_raw, noise_a, sigma2, cfa, 2, co, de);
+        }
+      }
+      else
+      {
+        const float *in[5][3];
+        for(int j=0;j<5;j++) for(int k=0;k<3;k++) in[j][k] = stream_row(src, k, ty[j]);
+        inc = decompose_fused_float_row(in, wd, mult, scale, co, de);
+      }
+      if(inc) incomplete = 1; // data race, but stays one in either case.
+      if(stats) for(int k=0;k<3;k++) detail_stats_row(part + k, de[k], wd);
+    }
+#pragma omp critical
+    if(stats) for(int k=0;k<3;k++) detail_stats_merge(stats + k, part + k);
+  }
+  if(incomplete)
+    fprintf(stderr, "[stream] scale %d contains undefined pixels around rows %d--%d\n", scale, y0, y1);
+  coarse->done = detail->done = y1;
+  return y1 - y0;
+}
+
+// one pass over the image. with thrs == 0 only the detail statistics are
+// gathered into stats[3*scale + channel], otherwise rows are
+// synthesised and handed to emit().
+static inline int stream_pass(
+    const buffer_t *input,
+    const int num_scales,
+    const int band,
+    const float *thrs,
+    detail_stats_t *stats,
+    stream_emit_t emit,
+    void *data)
+{
+  const int wd = input->width, ht = input->height;
+  const int stab = input->type == s_buf_raw_stabilise;
+  stream_ring_t in = {0};
+  stream_ring_t *coarse = (stream_ring_t *)calloc(num_scales, sizeof(stream_ring_t));
+  stream_ring_t *detail = (stream_ring_t *)calloc(num_scales, sizeof(stream_ring_t));
+  // the window of each level has to hold a band plus the support of the next
+  // level. detail rows are kept until the last level catches up, i.e. for as
+  // many rows as all coarser windows together.
+  if(stab) stream_ring_init(&in, band + 4, 1, wd);
+  for(int s=0;s<num_scales;s++)
+    stream_ring_init(coarse+s, s < num_scales-1 ? band + 4*(2<<s) : band, 3, wd);
+  for(int s=0;s<num_scales;s++)
+  {
+    int rows = band;
+    for(int t=s;t<num_scales-1;t++) rows += coarse[t].rows;
+    stream_ring_init(detail+s, rows, 3, wd);
+  }
+  float *out = (float *)malloc(sizeof(float)*3*wd*band);
+
+  int emitted = 0;
+  while(emitted < ht)
+  {
+    int progress = 0;
+    if(stab) progress += stream_stabilise_band(input, &in, coarse, band);
+    for(int s=0;s<num_scales;s++)
+    {
+      const int capacity = MIN(emitted + detail[s].rows,
+          (s < num_scales-1 ? MAX(0, coarse[s+1].done - 2*(2<<s)) : emitted) + coarse[s].rows);
+      progress += stream_decompose_band(input, s ? coarse+s-1 : (stab ? &in : 0), coarse+s, detail+s,
+          s, band, capacity, thrs ? 0 : stats + 3*s);
+    }
+
+    const int y0 = emitted, y1 = coarse[num_scales-1].done;
+    if(thrs && y1 > y0)
+    { // synthesize, same order of operations as synthesize() from coarse to fine:
+#pragma omp parallel for default(shared)
+      for(int y=y0;y<y1;y++)
+      {
+        for(int k=0;k<3;k++)
+        {
+          float *o = out + (size_t)wd*(3*(y-y0) + k);
+          const float *co = stream_row(coarse+num_scales-1, k, y);
+          for(int x=0;x<wd;x++) o[x] = co[x];
+          for(int s=num_scales-1;s>=0;s--)
+          {
+            const float *de = stream_row(detail+s, k, y);
+            const float t = thrs[3*s+k];
+            for(int x=0;x<wd;x++) o[x] = o[x] + shrink(de[x], t, 1.0f);
+          }
+        }
+      }
+      for(int y=y0;y<y1;y++)
+      {
+        const float *row[3];
+        for(int k=0;k<3;k++) row[k] = out + (size_t)wd*(3*(y-y0) + k);
+        emit(data, row);
+      }
+    }
+    progress += y1 - y0;
+    emitted = y1;
+    if(!progress)
+    {
+      fprintf(stderr, "[stream] stalled at row %d, this is a bug\n", emitted);
+      break;
+    }
+  }
+
+  free(out);
+  if(stab) free(in.data);
+  for(int s=0;s<num_scales;s++)
+  {
+    free(coarse[s].data);
+    free(detail[s].data);
+  }
+  free(coarse);
+  free(detail);
+  return emitted < ht;
+}
+
+// denoise a cfa input buffer (s_buf_raw_stabilise keeps memory lowest, the
+// float plane from buffer_stabilise() works, too) with num_scales levels,
+// processing band rows at a time. thrs[3*scale+channel] are the shrinkage
+// thresholds. pass 0 to estimate them in a first streaming pass, which costs
+// a second decomposition, but keeps memory bounded. returns 0 on success.
+static inline int denoise_stream(
+    const buffer_t *input,
+    const int num_scales,
+    const int band,
+    const float *thrs,
+    stream_emit_t emit,
+    void *data)
+{
+  if(thrs) return stream_pass(input, num_scales, band, thrs, 0, emit, data);
+
+  detail_stats_t *stats = (detail_stats_t *)calloc(3*num_scales, sizeof(detail_stats_t));
+  float *est = (float *)malloc(sizeof(float)*3*num_scales);
+  int err = stream_pass(input, num_scales, band, 0, stats, 0, 0);
+  for(int s=0;s<num_scales;s++) for(int k=0;k<3;k++)
+  {
+    const float sigma_d2 = detail_stats_variance(stats + 3*s + k);
+    est[3*s+k] = shrink_threshold(s, sigma_d2);
+    fprintf(stderr, "\nscale %d channel %d sigma noise %g signal %g => thrs %g\n", s, k, shrink_sigma(s), sqrtf(sigma_d2), est[3*s+k]);
+  }
+  if(!err) err = stream_pass(input, num_scales, band, est, 0, emit, data);
+  free(stats);
+  free(est);
+  return err;
+}
+
+// emit() sink that backtransforms rows and writes them to a pfm file, with the
+// same normalisation as buffer_write_pfm() for s_buf_float_backtransform.
+typedef struct stream_pfm_t
+{
+  FILE *f;                   // output file, header already written
+  int width;                 // width of the rows
+  float noise_a, noise_b;    // noise model to undo the variance stabilisation
+  float black, white;        // output is normalised to these
+  float *row;                // interleaved output row, 3*width, and width scratch
+}
+stream_pfm_t;
+
+static inline void stream_emit_pfm(
+    void *data,
+    const float *const row[3])
+{
+  stream_pfm_t *p = (stream_pfm_t *)data;
+  float c[6], *scratch = p->row + 3*p->width;
+  backtransform_coeff(p->noise_a, (p->noise_b/p->noise_a)*(p->noise_b/p->noise_a), p->black, p->white, c);
+  for(int k=0;k<3;k++)
+  {
+    backtransform_row(c, row[k], scratch, p->width);
+    for(int x=0;x<p->width;x++) p->row[3*x+k] = scratch[x];
+  }
+  fwrite(p->row, sizeof(float), 3*p->width, p->f);
+}
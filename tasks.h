@@ -0,0 +1,242 @@
+#pragma once
+// task graph scheduler for the pyramid. instead of one parallel loop with a
+// barrier per scale, decompose runs as openmp tasks on bands of rows: band b
+// of scale s waits only for bands b-1..b+1 of scale s-1 (the band height
+// covers the dilated support of the coarsest scale), so the scales overlap
+// and threads don't idle at the end of every pass. the coarse levels share
+// two buffers (see pyramid.h), the depend clauses on the bands of each buffer
+// also keep a level from overwriting rows of level s-2 still being read.
+//
+// the shrinkage thresholds need the statistics of whole detail bands, so
+// that's the one barrier left. after it, all scales and channels are
+// synthesised in a single pass over the bands.
+#include "pyramid.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// what the last run cost, for comparison with the barrier per pass schedule
+typedef struct wavelet_tasks_stats_t
+{
+  double wall;               // seconds, decompose and synthesis
+  double decompose;          // seconds of those until the statistics barrier
+  double busy;               // seconds spent inside tasks, all threads
+  int threads;               // size of the team
+  int tasks;                 // number of tasks run
+}
+wavelet_tasks_stats_t;
+
+// per thread busy time, a cache line each
+typedef struct wavelet_tasks_busy_t
+{
+  double seconds;
+}
+__attribute__((aligned(64))) wavelet_tasks_busy_t;
+
+static inline double wavelet_tasks_now()
+{
+#ifdef _OPENMP
+  return omp_get_wtime();
+#else
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+#endif
+}
+
+static inline int wavelet_tasks_thread()
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+// the task graph does the full and the fast cfa kernel of scale 0 and the
+// full kernel on the other scales. decimated levels and the separable fast
+// mode run through wavelet_decompose() and wavelet_synthesize() instead.
+static inline int wavelet_tasks_supported(
+    const wavelet_pyramid_t *p,
+    const buffer_t *input)
+{
+  for(int s=0;s<p->num_scales;s++)
+  {
+    if(p->opt[s].decimated) return 0;
+    if(p->opt[s].fast && (s || input->type == s_buf_float)) return 0;
+  }
+  return 1;
+}
+
+// rows per band: at least the reach of the coarsest scale's taps, 2*2^(s),
+// so a band only depends on its two neighbours.
+static inline int wavelet_tasks_band(
+    const wavelet_pyramid_t *p)
+{
+  return MAX(32, 1<<p->num_scales);
+}
+
+// decompose and synthesize input with the task graph. the result goes to
+// output if that's given (a full size float buffer), otherwise it overwrites
+// the coarsest level like wavelet_synthesize() does. returns the
+// reconstruction. stats, if given, receives timings and utilisation.
+static inline buffer_t *wavelet_denoise_tasks(
+    wavelet_pyramid_t *p,
+    const buffer_t *input,
+    buffer_t *output,
+    wavelet_tasks_stats_t *stats)
+{
+  assert(wavelet_tasks_supported(p, input));
+  const int num_scales = p->num_scales;
+  const int wd = input->width, ht = input->height;
+  const int band = wavelet_tasks_band(p);
+  const int num_bands = (ht + band - 1)/band;
+  // detail statistics per scale and band, merged in order afterwards so the
+  // thresholds don't depend on which thread finished first:
+  detail_stats_t *part = (detail_stats_t *)calloc((size_t)3*num_scales*num_bands, sizeof(detail_stats_t));
+  // dependency objects, one per band of each of the two coarse buffers:
+  char *dep = (char *)calloc(2*num_bands, 1);
+  wavelet_tasks_busy_t *busy = (wavelet_tasks_busy_t *)calloc(numa_threads(), sizeof(wavelet_tasks_busy_t));
+  int incomplete = 0, threads = 1;
+#ifdef WTF_INSTRUMENT
+  // first start and last end of the bands of every scale, for the wall time
+  // of the overlapping scales:
+  double span[2*WAVELET_MAX_SCALES];
+  for(int s=0;s<num_scales;s++)
+  {
+    span[2*s] = INFINITY;
+    span[2*s+1] = 0.0;
+  }
+#endif
+  const double begin = wavelet_tasks_now();
+
+#pragma omp parallel default(shared)
+#pragma omp single
+  {
+#ifdef _OPENMP
+    threads = omp_get_num_threads();
+#endif
+    for(int s=0;s<num_scales;s++)
+    {
+      const buffer_t *in = s ? p->coarse + s-1 : input;
+      buffer_t *co = p->coarse + s, *de = p->detail[s];
+      const int fast = p->opt[s].fast;
+#ifdef _OPENMP
+      // bands of level s-1 (unused for s == 0) and of level s:
+      const int src = ((s+1)&1)*num_bands, dst = (s&1)*num_bands;
+#endif
+      for(int b=0;b<num_bands;b++)
+      {
+        detail_stats_t *st = part + 3*((size_t)s*num_bands + b);
+#pragma omp task default(shared) firstprivate(s, b, in, co, de, fast, st) \
+    depend(in: dep[src + MAX(0, b-1)], dep[src + b], dep[src + MIN(num_bands-1, b+1)]) depend(out: dep[dst + b])
+        {
+          INST_ROW_BEGIN();
+          const double t = wavelet_tasks_now();
+          const int y0 = b*band, y1 = MIN(ht, y0 + band);
+          if(decompose_fused_band(in, co, de, s, fast, y0, y1, st))
+          {
+#pragma omp atomic write
+            incomplete = 1;
+          }
+          const double t1 = wavelet_tasks_now();
+          busy[wavelet_tasks_thread()].seconds += t1 - t;
+          INST_ROW_END(fast ? s_inst_decompose_fast : s_inst_decompose_fused, s, INST_ALL, (uint64_t)(y1 - y0)*wd);
+#ifdef WTF_INSTRUMENT
+#pragma omp critical(wavelet_tasks_span)
+          {
+            span[2*s] = MIN(span[2*s], t);
+            span[2*s+1] = MAX(span[2*s+1], t1);
+          }
+#endif
+        }
+      }
+    }
+  }
+  for(int s=0;s<num_scales;s++)
+    INST_WALL(p->opt[s].fast ? s_inst_decompose_fast : s_inst_decompose_fused, s, INST_ALL, span[2*s+1] - span[2*s]);
+  const double decomposed = wavelet_tasks_now();
+  if(incomplete) fprintf(stderr, "[tasks] coarse levels contain undefined pixels\n");
+
+  float *thrs = (float *)malloc(sizeof(float)*3*num_scales);
+  for(int s=0;s<num_scales;s++)
+  {
+    buffer_t *de = p->detail[s];
+    memset(de->stats, 0, sizeof(de->stats));
+    for(int b=0;b<num_bands;b++) for(int k=0;k<3;k++)
+      detail_stats_merge(de->stats + k, part + 3*((size_t)s*num_bands + b) + k);
+    for(int k=0;k<3;k++)
+    {
+      const float sigma_d2 = detail_stats_variance(de->stats + k);
+      thrs[3*s+k] = shrink_threshold(s, sigma_d2);
+      fprintf(stderr, "scale %d channel %d sigma noise %g signal %g => thrs %g\n", s, k, shrink_sigma(s), sqrtf(sigma_d2), thrs[3*s+k]);
+    }
+  }
+
+  // synthesis, in place over the coarsest level unless output is given. same
+  // order of operations as synthesize() from coarse to fine:
+  const buffer_t *last = p->coarse + num_scales-1;
+  p->result = (num_scales-1)&1;
+  p->output = *p->buf[p->result];
+  p->output.crop = p->detail[0]->crop;
+  buffer_t *out = output ? output : &p->output;
+#ifdef WTF_INSTRUMENT
+  // all scales and channels at once, they are counted as scale 0:
+  const double synthesis = wavelet_tasks_now();
+#endif
+#pragma omp parallel default(shared)
+  {
+    float *scratch = (float *)malloc(sizeof(float)*wd);
+#pragma omp for schedule(dynamic)
+    for(int b=0;b<num_bands;b++)
+    {
+      INST_ROW_BEGIN();
+      const double t = wavelet_tasks_now();
+      for(int y=b*band;y<MIN(ht, (b+1)*band);y++) for(int k=0;k<3;k++)
+      {
+        const float *co = buffer_row(last, k, y);
+        float *o = buffer_row(out, k, y);
+        for(int x=0;x<wd;x++) o[x] = co[x];
+        for(int s=num_scales-1;s>=0;s--)
+        {
+          const float *d = buffer_row_in(p->detail[s], k, y, scratch);
+          const float t = thrs[3*s+k];
+          for(int x=0;x<wd;x++) o[x] = o[x] + shrink(d[x], t, 1.0f);
+        }
+      }
+      busy[wavelet_tasks_thread()].seconds += wavelet_tasks_now() - t;
+      INST_ROW_END(s_inst_synthesize, 0, INST_ALL, (uint64_t)(MIN(ht, (b+1)*band) - b*band)*wd);
+    }
+    free(scratch);
+  }
+  INST_WALL(s_inst_synthesize, 0, INST_ALL, wavelet_tasks_now() - synthesis);
+
+  if(stats)
+  {
+    stats->wall = wavelet_tasks_now() - begin;
+    stats->decompose = decomposed - begin;
+    stats->busy = 0.0;
+    for(int t=0;t<numa_threads();t++) stats->busy += busy[t].seconds;
+    stats->threads = threads;
+    stats->tasks = (num_scales + 1)*num_bands;
+  }
+  free(thrs);
+  free(busy);
+  free(dep);
+  free(part);
+  return out;
+}
+
+// fraction of the team's time spent working, 1 is perfect
+static inline double wavelet_tasks_utilisation(
+    const wavelet_tasks_stats_t *stats)
+{
+  return stats->wall > 0.0 ? stats->busy/(stats->wall*stats->threads) : 0.0;
+}
+
+static inline void wavelet_tasks_report(
+    const wavelet_tasks_stats_t *stats)
+{
+  fprintf(stderr, "[tasks] %d tasks on %d threads in %.1f ms, utilisation %.0f%%\n",
+      stats->tasks, stats->threads, 1e3*stats->wall, 100.0*wavelet_tasks_utilisation(stats));
+}
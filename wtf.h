@@ -6,21 +6,159 @@
 #include <math.h>
 #include <unistd.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <threads.h>
+
+#include "simd.h"
 
 #define CLAMP(A, L, H) ((A) > (L) ? ((A) < (H) ? (A) : (H)) : (L))
 #define MAX(A, B) (((A) > (B)) ? (A) : (B))
 #define MIN(A, B) (((A) < (B)) ? (A) : (B))
 
+#include "instrument.h"
+#include "numa.h"
+#include "rawfile.h"
+
 typedef enum buffer_type_t
 {
   s_buf_none,                // error type
   s_buf_raw,                 // 1x uint16_t per pixel, normalised to max = 0xffff
-  s_buf_float,               // 3x float per pixel in [0,1]
+  s_buf_float,               // 3x float per pixel in [0,1], stored as three planes
   s_buf_raw_stabilise,       // raw, but evaluation should take variance stabilisation into account
   s_buf_float_backtransform, // float, but evaluation should undo the variance transform.
+  s_buf_cfa_float,           // 1x float per pixel, cfa layout, already variance stabilised
+  s_buf_half,                // 3x half float per pixel, stored as three planes (detail bands)
+  s_buf_q16,                 // 3x int16_t per pixel times quant, three planes (detail bands)
 }
 buffer_type_t;
 
+// statistics of the positive coefficients of one detail band, gathered by
+// decompose() for the shrinkage in synthesize().
+typedef struct detail_stats_t
+{
+  double cnt, sum;           // count and sum of squares
+}
+detail_stats_t;
+
+// colour filter array: pixel (x, y) carries channel c[y % 6][x % 6]. 2x2
+// patterns are tiled to 6x6, so the lookup is the same for both. size is the
+// period of the pattern, the cfa kernels are instantiated per period.
+#define CFA_MAX 6
+typedef struct cfa_t
+{
+  int size;                  // 2 for bayer, 6 for x-trans
+  uint8_t c[CFA_MAX][CFA_MAX];
+}
+cfa_t;
+
+// equivalent to dcraw's FC() for a std 5dm2
+static const cfa_t cfa_rggb = { 2, {
+  {0, 1, 0, 1, 0, 1}, {1, 2, 1, 2, 1, 2},
+  {0, 1, 0, 1, 0, 1}, {1, 2, 1, 2, 1, 2},
+  {0, 1, 0, 1, 0, 1}, {1, 2, 1, 2, 1, 2} } };
+
+// pattern is given row by row as 4 (2x2) or 36 (6x6) letters r, g and b, or
+// "xtrans" for the fuji layout dcraw uses. returns 0 on success.
+static inline int cfa_parse(
+    const char *pattern,
+    cfa_t *cfa)
+{
+  if(!strcmp(pattern, "xtrans")) pattern = "ggrggbggbggrbrgrbgggbggrggrggbrbgbrg";
+  const size_t len = strlen(pattern);
+  const int size = len == 4 ? 2 : (len == 36 ? 6 : 0);
+  if(!size) return 1;
+  cfa_t p = { .size = size };
+  for(int j=0;j<CFA_MAX;j++) for(int i=0;i<CFA_MAX;i++)
+  {
+    switch(pattern[(j%size)*size + i%size])
+    {
+      case 'r': case 'R': p.c[j][i] = 0; break;
+      case 'g': case 'G': p.c[j][i] = 1; break;
+      case 'b': case 'B': p.c[j][i] = 2; break;
+      default: return 1;
+    }
+  }
+  *cfa = p;
+  return 0;
+}
+
+// number of pixels of each channel in one period of the pattern
+static inline void cfa_count(
+    const cfa_t *cfa,
+    int cnt[3])
+{
+  cnt[0] = cnt[1] = cnt[2] = 0;
+  for(int j=0;j<cfa->size;j++) for(int i=0;i<cfa->size;i++) cnt[cfa->c[j][i]]++;
+}
+
+// pattern of a crop of the frame that starts at pixel (x, y)
+static inline void cfa_shift(
+    const cfa_t *cfa,
+    const int x,
+    const int y,
+    cfa_t *out)
+{
+  cfa_t p = { .size = cfa->size };
+  for(int j=0;j<CFA_MAX;j++) for(int i=0;i<CFA_MAX;i++)
+    p.c[j][i] = cfa->c[(j + y) % CFA_MAX][(i + x) % CFA_MAX];
+  *out = p;
+}
+
+// region of interest, in pixels
+typedef struct roi_t
+{
+  int x, y, width, height;
+}
+roi_t;
+
+// pixels around a crop that a pyramid of num_scales levels reads: the five
+// taps of scale s reach 2*2^s pixels further out. the decimated pyramid also
+// interpolates between coarse pixels, 2^s apart for scale s.
+static inline int roi_halo(
+    const int num_scales,
+    const int decimated)
+{
+  return 2*((1<<num_scales) - 1) + (decimated ? (1<<num_scales) - 2 : 0);
+}
+
+// region to process for a crop of a wd x ht frame: the crop grown by halo
+// pixels on every side, as far as the frame goes, with the origin rounded
+// down to a multiple of align (a power of two). crop is clipped to the frame
+// and made relative to the region. returns 1 if nothing is left.
+static inline int roi_pad(
+    roi_t *crop,
+    roi_t *region,
+    const int halo,
+    const int align,
+    const int wd,
+    const int ht)
+{
+  const int x0 = CLAMP(crop->x, 0, wd), y0 = CLAMP(crop->y, 0, ht);
+  const int x1 = CLAMP(crop->x + crop->width, x0, wd), y1 = CLAMP(crop->y + crop->height, y0, ht);
+  region->x = MAX(0, x0 - halo) & ~(align - 1);
+  region->y = MAX(0, y0 - halo) & ~(align - 1);
+  region->width = MIN(wd, x1 + halo) - region->x;
+  region->height = MIN(ht, y1 + halo) - region->y;
+  crop->x = x0 - region->x;
+  crop->y = y0 - region->y;
+  crop->width = x1 - x0;
+  crop->height = y1 - y0;
+  return crop->width <= 0 || crop->height <= 0;
+}
+
+// the same crop on a grid subsampled levels times by two, covering at least
+// the original pixels.
+static inline roi_t roi_decimate(
+    const roi_t *crop,
+    const int levels)
+{
+  const int x1 = (crop->x + crop->width + (1<<levels) - 1) >> levels;
+  const int y1 = (crop->y + crop->height + (1<<levels) - 1) >> levels;
+  return (roi_t){crop->x >> levels, crop->y >> levels, x1 - (crop->x >> levels), y1 - (crop->y >> levels)};
+}
+
 typedef struct buffer_t
 {
   buffer_type_t type;        // type, see above
@@ -28,22 +166,139 @@ typedef struct buffer_t
   int width, height;         // dimensions of the buffer
   float noise_a, noise_b;    // noise variance model parameters
   float black, white;        // black and white levels of data
+  float quant;               // step size of s_buf_q16
+  detail_stats_t stats[3];   // detail bands: per channel statistics from decompose()
+  cfa_t cfa;                 // colour filter array of cfa and raw buffers
+  roi_t crop;                // part written by the pfm writers, all of it if empty
 }
 buffer_t;
 
+// channel of the cfa pixel at (x, y). the kernels look up whole rows of the
+// pattern instead.
 static inline int buffer_get_channel(
+    const buffer_t *b,
     const int x,
     const int y)
 {
-  // equivalent to dcraw's FC()
-  // hardcoded rggb for now. should work on x-trans style sensors, too.
-  // std 5dm2
-  const int ch[4] = {0, 1, 1, 2};
-  // 5dm2 when black borders aren't cropped:
-  // const int ch[4] = {1, 2, 0, 1};
-  // for samsung nx300
-  // const int ch[4] = {1, 2, 0, 1};
-  return ch[(x&1)+2*(y&1)];
+  return b->cfa.c[y % CFA_MAX][x % CFA_MAX];
+}
+
+// bytes per pixel of all channels together, for the bandwidth figures
+static inline int buffer_pixel_bytes(
+    const buffer_t *b)
+{
+  switch(b->type)
+  {
+    case s_buf_raw:
+    case s_buf_raw_stabilise:
+      return sizeof(uint16_t);
+    case s_buf_cfa_float:
+      return sizeof(float);
+    case s_buf_half:
+    case s_buf_q16:
+      return 3*sizeof(uint16_t);
+    default:
+      return 3*sizeof(float);
+  }
+}
+
+// row accessors, to be used by the kernels instead of per-sample buffer_get().
+// float buffers are stored planar, one full width*height plane per channel.
+static inline float *buffer_row(
+    const buffer_t *b,
+    const int channel,
+    const int y)
+{
+  return ((float *)b->data) + ((size_t)channel*b->height + y)*b->width;
+}
+
+static inline uint16_t *buffer_row_raw(
+    const buffer_t *b,
+    const int y)
+{
+  return ((uint16_t *)b->data) + (size_t)y*b->width;
+}
+
+// same for the planar 16-bit formats s_buf_half and s_buf_q16
+static inline uint16_t *buffer_row16(
+    const buffer_t *b,
+    const int channel,
+    const int y)
+{
+  return ((uint16_t *)b->data) + ((size_t)channel*b->height + y)*b->width;
+}
+
+// round to the nearest multiple of quant, saturating to int16_t
+static inline int16_t quantise(
+    const float v,
+    const float quant)
+{
+  return (int16_t)CLAMP(lrintf(v/quant), -32767, 32767);
+}
+
+// generalised anscombe transform, noise should have unit variance after this.
+static inline float stabilise(
+    const float v,
+    const float noise_a,
+    const float sigma2)
+{
+  return 2.0f*sqrtf(fmaxf(0.0f, v/noise_a + 3./8. + sigma2));
+}
+
+// closed-form approximation of the unbiased inverse of the above.
+static inline float backtransform(
+    float v,
+    const float noise_a,
+    const float sigma2)
+{
+  if(v < .5f) return 0.0f;
+  v = 1./4.*v*v + 1./4.*sqrtf(3./2.)/v - 11./8./(v*v) + 5./8.*sqrtf(3./2.)/(v*v*v) - 1./8. - sigma2;
+  return v * noise_a;
+}
+
+// coefficients of the above for backtransform_row(), already normalised so
+// black is 0 and white is 1. one division per pixel instead of four in double.
+static inline void backtransform_coeff(
+    const float noise_a,
+    const float sigma2,
+    const float black,
+    const float white,
+    float c[6])
+{
+  const double n = noise_a/(double)(white - black), s = sqrt(3./2.);
+  c[0] = n/4.;
+  c[1] = n*(-1./8. - sigma2) - black/(double)(white - black);
+  c[2] = n*s/4.;
+  c[3] = -n*11./8.;
+  c[4] = n*5./8.*s;
+  c[5] = -black/(double)(white - black);
+}
+
+// largest error of backtransform_row() against the closed form evaluated in
+// double precision, over all stabilised values of 16-bit input. in units of
+// white - black.
+static inline float backtransform_error(
+    const float noise_a,
+    const float sigma2,
+    const float black,
+    const float white)
+{
+  float c[6];
+  backtransform_coeff(noise_a, sigma2, black, white, c);
+  const int n = 1<<16;
+  const float vmax = stabilise(65535.0f, noise_a, sigma2);
+  float *v = (float *)malloc(sizeof(float)*2*n), *out = v + n;
+  for(int i=0;i<n;i++) v[i] = vmax*i/(n-1.0f);
+  backtransform_row(c, v, out, n);
+  double err = 0.0;
+  for(int i=0;i<n;i++)
+  {
+    const double u = v[i];
+    const double e = u < .5 ? 0.0 : noise_a*(1./4.*u*u + 1./4.*sqrt(3./2.)/u - 11./8./(u*u) + 5./8.*sqrt(3./2.)/(u*u*u) - 1./8. - sigma2);
+    err = fmax(err, fabs(out[i] - (e - black)/(white - black)));
+  }
+  free(v);
+  return err;
 }
 
 static inline float buffer_get(
@@ -61,24 +316,28 @@ static inline float buffer_get(
   switch(b->type)
   {
     case s_buf_raw:
-      if(channel != buffer_get_channel(x, y)) return -1.0f; // mark as not set
+      if(channel != buffer_get_channel(b, x, y)) return -1.0f; // mark as not set
       return ((uint16_t *)b->data)[x + b->width*y];//  /(float)0xffff;
     case s_buf_float:
-      return ((float *)b->data)[3*(x + b->width*y) + channel];
+      return buffer_row(b, channel, y)[x];
     case s_buf_raw_stabilise:
       { // apply variance stabilising transform (should be 1.0 after this)
-      if(channel != buffer_get_channel(x, y)) return -1.0f; // mark as not set
+      if(channel != buffer_get_channel(b, x, y)) return -1.0f; // mark as not set
       const float sigma2 = (b->noise_b/b->noise_a)*(b->noise_b/b->noise_a);
       const float v = ((uint16_t *)b->data)[x + b->width*y]; // /(float)0xffff;
-      return 2.0f*sqrtf(fmaxf(0.0f, v/b->noise_a + 3./8. + sigma2));
+      return stabilise(v, b->noise_a, sigma2);
       }
+    case s_buf_cfa_float:
+      if(channel != buffer_get_channel(b, x, y)) return -1.0f; // mark as not set
+      return buffer_row(b, 0, y)[x];
+    case s_buf_half:
+      return half_to_float(buffer_row16(b, channel, y)[x]);
+    case s_buf_q16:
+      return ((int16_t *)buffer_row16(b, channel, y))[x] * b->quant;
     case s_buf_float_backtransform:
       { // backtransform to normal domain
       const float sigma2 = (b->noise_b/b->noise_a)*(b->noise_b/b->noise_a);
-      float v = ((float *)b->data)[3*(x + b->width*y) + channel];
-      if(v < .5f) return 0.0f;
-      v = 1./4.*v*v + 1./4.*sqrtf(3./2.)/v - 11./8./(v*v) + 5./8.*sqrtf(3./2.)/(v*v*v) - 1./8. - sigma2;
-      return v * b->noise_a;
+      return backtransform(buffer_row(b, channel, y)[x], b->noise_a, sigma2);
       }
     default:
       return 0.0f;
@@ -96,12 +355,22 @@ static inline void buffer_set(
   {
     case s_buf_raw:
     case s_buf_raw_stabilise:
-      if(channel != buffer_get_channel(x, y)) return; // wrong color channel
+      if(channel != buffer_get_channel(b, x, y)) return; // wrong color channel
       ((uint16_t *)b->data)[x + b->width*y] = CLAMP(value * 0xffff, 0, 0xffff);
       return;
+    case s_buf_cfa_float:
+      if(channel != buffer_get_channel(b, x, y)) return; // wrong color channel
+      buffer_row(b, 0, y)[x] = value;
+      return;
     case s_buf_float:
     case s_buf_float_backtransform:
-      ((float *)b->data)[3*(x + b->width*y) + channel] = value;
+      buffer_row(b, channel, y)[x] = value;
+      return;
+    case s_buf_half:
+      buffer_row16(b, channel, y)[x] = float_to_half(value);
+      return;
+    case s_buf_q16:
+      ((int16_t *)buffer_row16(b, channel, y))[x] = quantise(value, b->quant);
       return;
     default:
       return;
@@ -115,332 +384,2265 @@ static inline void buffer_destroy(
   free(b);
 }
 
-static inline void buffer_write_pfm(
-    const buffer_t *b,
-    const char *filename)
+// clamp the five taps of the dilated filter around pos to [0, size) (sample
+// and hold), once per row or pixel instead of once per access.
+static inline void filter_taps(
+    int *tap,
+    const int pos,
+    const int mult,
+    const int size)
 {
-  FILE *f = fopen(filename, "wb");
-  if(f)
-  {
-    // write sse aligned pfm:
-    char header[1024];
-    snprintf(header, 1024, "PF\n%d %d\n-1.0", b->width, b->height);
-    size_t len = strlen(header);
-    fprintf(f, "PF\n%d %d\n-1.0", b->width, b->height);
-    ssize_t off = 0;
-    while((len + 1 + off) & 0xf) off++;
-    while(off-- > 0) fprintf(f, "0");
-    fprintf(f, "\n");
-    if(b->type == s_buf_float)
-      fwrite(b->data, b->width*b->height, 3*sizeof(float), f);
-    else if(b->type == s_buf_float_backtransform)
-    { // write one-by-one and backtransform
-      for(int j=0;j<b->height;j++) for(int i=0;i<b->width;i++) for(int k=0;k<3;k++)
-      {
-        float v = buffer_get(b, i, j, k);
-        // normalise to white == 1.0 and subtract black
-        v = (v-b->black)/(b->white-b->black);
-        fwrite(&v, sizeof(float), 1, f);
-      }
-    }
-    fclose(f);
-  }
+  for(int i=0;i<5;i++) tap[i] = CLAMP(pos + mult*(i-2), 0, size-1);
 }
 
-static inline buffer_t *buffer_read_pgm16(
-    const char *filename,
-    const int white)
+// fetch row y of the given channel as float, in the same encoding as
+// buffer_get() (-1 marks pixels where this channel is not set).
+static inline void buffer_load_row(
+    const buffer_t *b,
+    const int channel,
+    const int y,
+    float *out)
 {
-  FILE *f = fopen(filename, "rb");
-  if(f)
+  switch(b->type)
   {
-    int max = 0, wd = 0, ht = 0;
-    int res = fscanf(f, "P5\n%d %d\n%d", &wd, &ht, &max);
-    if(res != 3) goto error;
-    fgetc(f); // newline
-    if(max != 65535) goto error;
-    buffer_t *b = (buffer_t *)malloc(sizeof(buffer_t));
-    memset(b, 0, sizeof(buffer_t));
-    b->type = s_buf_raw;
-    b->width = wd;
-    b->height = ht;
-    b->white = 65535.0f;
-    b->black = 0.0;
-    b->data = malloc(sizeof(uint16_t)*wd*ht);
-    res = fread(b->data, sizeof(uint16_t), wd*ht, f);
-    if(res != wd*ht) goto error;
-    // swap byte order :(
-    // uint16_t maxval = white;
-    for(int k=0;k<wd*ht;k++)
-      ((uint16_t*)b->data)[k] = (((uint16_t*)b->data)[k]<<8) | (((uint16_t*)b->data)[k]>>8);
-    // fprintf(stderr, "[read_ppm16] scaling by %u\n", maxval);
-    // rescale to full range:
-    // for(int k=0;k<wd*ht;k++)
-      // ((uint16_t*)b->data)[k] = (uint16_t)CLAMP(((uint16_t*)b->data)[k]/(float)maxval*0xffff, 0, 0xffff);
-    fclose(f);
-    return b;
-error:
-    fprintf(stderr, "[read_ppm16] not a 16-bit pgm file: `%s'\n", filename);
-    fclose(f);
-    return 0;
+    case s_buf_raw:
+    {
+      const uint16_t *in = buffer_row_raw(b, y);
+      for(int x=0;x<b->width;x++) out[x] = -1.0f;
+      // only visit the phases of the pattern row that carry the channel:
+      for(int p=0;p<b->cfa.size;p++) if(b->cfa.c[y % CFA_MAX][p] == channel)
+        for(int x=p;x<b->width;x+=b->cfa.size) out[x] = in[x];
+      return;
+    }
+    case s_buf_raw_stabilise:
+    {
+      const uint16_t *in = buffer_row_raw(b, y);
+      const float sigma2 = (b->noise_b/b->noise_a)*(b->noise_b/b->noise_a);
+      for(int x=0;x<b->width;x++) out[x] = -1.0f;
+      for(int p=0;p<b->cfa.size;p++) if(b->cfa.c[y % CFA_MAX][p] == channel)
+        for(int x=p;x<b->width;x+=b->cfa.size) out[x] = stabilise(in[x], b->noise_a, sigma2);
+      return;
+    }
+    case s_buf_float:
+      memcpy(out, buffer_row(b, channel, y), sizeof(float)*b->width);
+      return;
+    case s_buf_cfa_float:
+    {
+      const float *in = buffer_row(b, 0, y);
+      for(int x=0;x<b->width;x++) out[x] = -1.0f;
+      for(int p=0;p<b->cfa.size;p++) if(b->cfa.c[y % CFA_MAX][p] == channel)
+        for(int x=p;x<b->width;x+=b->cfa.size) out[x] = in[x];
+      return;
+    }
+    case s_buf_float_backtransform:
+    {
+      const float *in = buffer_row(b, channel, y);
+      const float sigma2 = (b->noise_b/b->noise_a)*(b->noise_b/b->noise_a);
+      for(int x=0;x<b->width;x++)
+        out[x] = backtransform(in[x], b->noise_a, sigma2);
+      return;
+    }
+    case s_buf_half:
+      half_to_float_row(buffer_row16(b, channel, y), out, b->width);
+      return;
+    case s_buf_q16:
+    {
+      const int16_t *in = (const int16_t *)buffer_row16(b, channel, y);
+      for(int x=0;x<b->width;x++) out[x] = in[x] * b->quant;
+      return;
+    }
+    default:
+      memset(out, 0, sizeof(float)*b->width);
+      return;
   }
-  return 0;
 }
 
-static inline buffer_t *buffer_create_float(
-    const int wd,
-    const int ht)
+// float view of row y of channel c for reading: the row itself for float
+// buffers, otherwise it's converted into scratch (width floats).
+static inline const float *buffer_row_in(
+    const buffer_t *b,
+    const int channel,
+    const int y,
+    float *scratch)
 {
-  buffer_t *b = (buffer_t *)malloc(sizeof(buffer_t));
-  memset(b, 0, sizeof(buffer_t));
-  b->type = s_buf_float;
-  b->width = wd;
-  b->height = ht;
-  b->white = 1.0;
-  b->black = 0.0;
-  b->data = malloc(sizeof(float)*3*wd*ht);
-  memset(b->data, 0, wd*ht*3*sizeof(float));
-  return b;
+  if(b->type == s_buf_float) return buffer_row(b, channel, y);
+  buffer_load_row(b, channel, y, scratch);
+  return scratch;
 }
 
-static inline float weight(
-    const buffer_t *a,
-    const int ax,
-    const int ay,
-    const int ac,
+// float row to write channel c of row y to: the row itself for float buffers,
+// otherwise scratch, which buffer_store_row() converts to the storage format.
+static inline float *buffer_row_out(
     const buffer_t *b,
-    const int bx,
-    const int by)
+    const int channel,
+    const int y,
+    float *scratch)
 {
-  const float pbc = buffer_get(b, bx, by, ac); // source buffer is unknown, never use it
-  if(pbc < 0.0) return 0.0;
-  // destination buffer is unknown, weight all others with 1
-  const float pac = buffer_get(a, ax, ay, ac);
-  if(pac < 0.0) return 1.0f;
-
-  // XXX this fixes mazing artefacts. why doesn't the > 0 ? 1 : 0 part below do it?
-  // return 1.0;
+  if(b->type == s_buf_float) return buffer_row(b, channel, y);
+  return scratch;
+}
 
-  float d = 0.0f;
-  const float cw[3] = {1.0, 2.0, 1.0};
-  int dims = 0;
-  for(int k=0;k<3;k++)
+static inline void buffer_store_row(
+    buffer_t *b,
+    const int channel,
+    const int y,
+    const float *row)
+{
+  switch(b->type)
   {
-    const float pa = buffer_get(a, ax, ay, k);
-    const float pb = buffer_get(b, bx, by, k);
-    if(pa < 0.0 || pb < 0.0) continue;
-
-    // this threshold subtraction considers part of the signal as noise and subtracts that.
-    // noise sigma is normalised to 1.0, so 3sigma^2 = 9 is our noise floor (this is a
-    // two-noisy-estimator distance, so it's actually 1.5sigma for either side).
-    const float dd = fmaxf(0.0f, (pa - pb)*(pa - pb) - 16.0f);
-    d += cw[k]*dd;
-    dims++;
+    case s_buf_half:
+      float_to_half_row(row, buffer_row16(b, channel, y), b->width);
+      return;
+    case s_buf_q16:
+    {
+      int16_t *out = (int16_t *)buffer_row16(b, channel, y);
+      const float scale = 1.0f/b->quant;
+      for(int x=0;x<b->width;x++) out[x] = CLAMP(lrintf(row[x]*scale), -32767, 32767);
+      return;
+    }
+    default: // float rows are written in place
+      return;
   }
-  // XXX use superfast patented approximation from darktable code:
-  const float weight = expf(-d/dims*5e-1);
-   // fprintf(stderr, "weight %g of d=%g %g\n", weight, d, -d/dims);
-  return weight;
 }
 
-static inline int decompose_raw(
-    const buffer_t *input,
-    buffer_t *coarse,
-    buffer_t *detail,
-    int channel,
-    int scale)
+// undo the variance stabilisation of a float buffer in place, in parallel,
+// and normalise to black and white on the way. b is a plain float buffer with
+// white == 1 afterwards.
+static inline void buffer_backtransform(
+    buffer_t *b,
+    const float black,
+    const float white)
 {
-  const int mult = 1<<scale;
-  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
-  int cnt = 0;
-  int incomplete = 0; // signal whether or not the coarse buffer still contains undefined pixels 
+  assert(b->type == s_buf_float || b->type == s_buf_float_backtransform);
+  float c[6];
+  backtransform_coeff(b->noise_a, (b->noise_b/b->noise_a)*(b->noise_b/b->noise_a), black, white, c);
+  INST_BEGIN();
 #pragma omp parallel for default(shared)
-  for(int y=0;y<coarse->height;y++)
+  for(int y=0;y<b->height;y++)
   {
-    const int progress = __sync_fetch_and_add(&cnt, 1);
-    if((progress & 0xff) == 0xff || progress == coarse->height-1)
-      fprintf(stderr, "decompose scale %d channel %d %d/%d\r", scale, channel, progress, coarse->height);
-    for(int x=0;x<coarse->width;x++)
+    INST_ROW_BEGIN();
+    for(int k=0;k<3;k++)
     {
-      float sum = 0.0f, wgt = 0.0f;
-      for(int i=0;i<5;i++)
-      {
-        const int xx = x+mult*(i-2), yy = y;
-        const float px = buffer_get(input, xx, yy, channel);
-        const float w = (px != -1.0f) ? filter[i] : 0.0;
-        sum += w*px;
-        wgt += w;
-      }
-      if(wgt <= 0.0)
-      { // no neighbours with this color found. probably x-trans :(
-        buffer_set(coarse, x, y, channel, -1.0);
-      }
-      else buffer_set(coarse, x, y, channel, sum/wgt);
+      float *row = buffer_row(b, k, y);
+      backtransform_row(c, row, row, b->width);
     }
+    INST_ROW_END(s_inst_backtransform, 0, INST_ALL, b->width);
   }
+  INST_END(s_inst_backtransform, 0, INST_ALL);
+  b->type = s_buf_float;
+  b->black = 0.0f;
+  b->white = 1.0f;
+}
 
-  cnt = 0;
-#pragma omp parallel for default(shared)
-  for(int x=0;x<coarse->width;x++)
-  {
-    const int progress = __sync_fetch_and_add(&cnt, 1);
-    if((progress & 0xff) == 0xff || progress == coarse->width-1)
-      fprintf(stderr, "decompose scale %d channel %d %d/%d\r", scale, channel, progress, coarse->width);
-    for(int y=0;y<coarse->height;y++)
-    {
-      float wgt = 0.0f, sum = 0.0f;
-      for(int j=0;j<5;j++)
-      {
-        const int xx = x, yy = y+mult*(j-2);
-        const float px = buffer_get(coarse, xx, yy, channel);
-        const float w = (px != -1.0f) ? filter[j] : 0.0;
-        sum += w*px;
-        wgt += w;
-      }
+static inline void write_pfm_header(
+    FILE *f,
+    const int wd,
+    const int ht)
+{
+  // write sse aligned pfm:
+  char header[1024];
+  snprintf(header, 1024, "PF\n%d %d\n-1.0", wd, ht);
+  size_t len = strlen(header);
+  fprintf(f, "PF\n%d %d\n-1.0", wd, ht);
+  ssize_t off = 0;
+  while((len + 1 + off) & 0xf) off++;
+  while(off-- > 0) fprintf(f, "0");
+  fprintf(f, "\n");
+}
 
-      if(wgt <= 0.0)
-      { // no neighbours with this color found. probably x-trans :(
-        buffer_set(detail, x, y, channel, 0.0);
-        buffer_set(coarse, x, y, channel, -1.0);
-        incomplete = 1; // data race, but stays one in either case.
-      }
-      else
-      { // have some estimated coarse value, yay
-        sum /= wgt;
-        const float pixel = buffer_get(input, x, y, channel);
-        if(pixel >= 0.0) // do we also have a previous value? if yes, encode difference:
-          buffer_set(detail, x, y, channel, buffer_get(input, x, y, channel) - sum);
-        else // or else make it smooth
-          buffer_set(detail, x, y, channel, 0.0);
-        buffer_set(coarse, x, y, channel, sum);
-      }
-    }
+// the part of b that goes into pfm files: b->crop, or all of b if that's empty
+static inline roi_t buffer_crop(
+    const buffer_t *b)
+{
+  if(b->crop.width > 0 && b->crop.height > 0) return b->crop;
+  return (roi_t){0, 0, b->width, b->height};
+}
+
+// row y of b as interleaved rgb, the way pfm stores it, only the columns of
+// the crop. scratch holds width floats.
+static inline void pfm_row(
+    const buffer_t *b,
+    const int y,
+    float *row,
+    float *scratch)
+{
+  const roi_t crop = buffer_crop(b);
+  const float *in = scratch + crop.x;
+  float c[6]; // normalises to white == 1.0 and subtracts black on the way
+  if(b->type == s_buf_float_backtransform)
+    backtransform_coeff(b->noise_a, (b->noise_b/b->noise_a)*(b->noise_b/b->noise_a), b->black, b->white, c);
+  for(int k=0;k<3;k++)
+  {
+    if(b->type == s_buf_float_backtransform)
+      backtransform_row(c, buffer_row(b, k, y) + crop.x, scratch + crop.x, crop.width);
+    else
+      buffer_load_row(b, k, y, scratch);
+    for(int i=0;i<crop.width;i++) row[3*i+k] = in[i];
   }
-  fprintf(stderr, "scale %d done                                  \n", scale);
-  return incomplete;
 }
 
-// returns 0 if the buffer is completely filled, and 1 otherwise (contains
-// undefined pixels)
-static inline int decompose(
-    const buffer_t *input,
-    buffer_t *coarse,
-    buffer_t *detail,
-    int channel,
-    int scale)
+// convert blocks of rows into a staging buffer, in parallel if requested, and
+// write each block with one fwrite(). returns 0 on success.
+static inline int pfm_write(
+    const buffer_t *b,
+    const char *filename,
+    const int parallel)
 {
-  const int mult = 1<<scale;
-  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
-  int cnt = 0;
-  int incomplete = 0; // signal whether or not the coarse buffer still contains undefined pixels 
-  // int flycnt = 0;
-#pragma omp parallel for default(shared)
-  for(int y=0;y<coarse->height;y++)
+  FILE *f = fopen(filename, "wb");
+  if(!f) return 1;
+  const roi_t crop = buffer_crop(b);
+  const int wd = crop.width, ht = crop.height;
+  write_pfm_header(f, wd, ht);
+  if(b->type != s_buf_float && b->type != s_buf_float_backtransform &&
+     b->type != s_buf_half  && b->type != s_buf_q16)
+  {
+    fclose(f);
+    return 1;
+  }
+  const int block = MAX(1, (1<<20)/(3*wd)); // about 4MB per write
+  float *stage = (float *)malloc(sizeof(float)*3*wd*MIN(block, ht));
+  int err = 0;
+  INST_BEGIN();
+  for(int y0=0;y0<ht && !err;y0+=block)
   {
-    const int progress = __sync_fetch_and_add(&cnt, 1);
-    if((progress & 0xff) == 0xff || progress == coarse->height-1)
-      fprintf(stderr, "decompose scale %d channel %d %d/%d\r", scale, channel, progress, coarse->height);
-    for(int x=0;x<coarse->width;x++)
+    const int y1 = MIN(ht, y0 + block);
+#pragma omp parallel default(shared) if(parallel)
     {
-      float wgt = 0.0f, sum = 0.0f;
-#if 0
-      const float null_thrs = 0.3f;
-      int null_cnt = 0;
-      int restart = 0;
-restart:
-#endif
-      for(int j=0;j<5;j++) for(int i=0;i<5;i++)
+      float *scratch = (float *)malloc(sizeof(float)*b->width);
+#pragma omp for
+      for(int y=y0;y<y1;y++)
       {
-        const int xx = x+mult*(i-2), yy = y+mult*(j-2);
-        const float px = buffer_get(input, xx, yy, channel);
-        float ww = weight(input, x, y, channel, input, xx, yy);
-        if(scale == 0) ww = ww > 0.0 ? 1.0 : 0.0;
-        // if(restart) ww = ww > 0.0 ? 1.0 : 0.0;
-        // if(ww < null_thrs) null_cnt++;
-        const float w = filter[i]*filter[j]*ww;
-        sum += w*px;
-        wgt += w;
-      }
-      if(wgt <= 0.0)
-      { // no neighbours with this color found. probably x-trans :(
-        buffer_set(detail, x, y, channel, 0.0);
-        buffer_set(coarse, x, y, channel, -1.0);
-        incomplete = 1; // data race, but stays one in either case.
-      }
-#if 0
-      else if(!restart && null_cnt >= 20)// && scale == 0)
-      { // found something, but only really the center one has a weight.
-        // avoid fireflies and average this probably stuck pixel/extreme noise outlier:
-        // XXX this is only effective to a very limited extend! should rather get edges from a prepass
-        // XXX seems overly aggressive for color channels at level 0
-        __sync_fetch_and_add(&flycnt, 1);
-        restart = 1;
-        goto restart;
-      }
-#endif
-      else
-      { // have some estimated coarse value, yay
-        sum /= wgt;
-        const float pixel = buffer_get(input, x, y, channel);
-        if(pixel >= 0.0) // do we also have a previous value? if yes, encode difference:
-          buffer_set(detail, x, y, channel, pixel - sum);
-        else // or else make it smooth
-          buffer_set(detail, x, y, channel, 0.0);
-        buffer_set(coarse, x, y, channel, sum);
+        INST_ROW_BEGIN();
+        pfm_row(b, crop.y + y, stage + (size_t)3*wd*(y-y0), scratch);
+        INST_ROW_END(s_inst_write, 0, INST_ALL, wd);
       }
+      free(scratch);
     }
+    err = fwrite(stage, sizeof(float)*3*wd, y1-y0, f) != (size_t)(y1-y0);
   }
-  // fprintf(stderr, "scale %d detected %d flies                             \n", scale, flycnt);
-  return incomplete;
+  free(stage);
+  if(fclose(f)) err = 1;
+  INST_END(s_inst_write, 0, INST_ALL);
+  return err;
 }
 
-static inline void synthesize(
-    buffer_t *output,
-    const buffer_t *coarse,
-    const buffer_t *detail,
-    int channel,
-    int scale)
-{
+static inline void buffer_write_pfm(
+    const buffer_t *b,
+    const char *filename)
+{
+  if(pfm_write(b, filename, 1))
+    fprintf(stderr, "[write_pfm] failed to write `%s'\n", filename);
+}
+
+// background pfm writer, so writing overlaps with the remaining computation.
+typedef struct pfm_job_t
+{
+  buffer_t view;             // copy of the buffer struct, the pixels are shared
+  char *filename;            // output file name
+  thrd_t thread;             // the writing thread
+  int err;                   // set if the thread could not be started
+}
+pfm_job_t;
+
+static inline int pfm_job_run(
+    void *data)
+{
+  const pfm_job_t *job = (const pfm_job_t *)data;
+  // conversion stays on this one thread, the pool is busy computing:
+  return pfm_write(&job->view, job->filename, 0);
+}
+
+static inline int pfm_job_thread(
+    void *data)
+{
+  numa_unbind_thread();
+  return pfm_job_run(data);
+}
+
+// start writing b in the background. the view is copied, so b's type and
+// levels can change, but its pixels must stay untouched until
+// buffer_write_pfm_wait() returns.
+static inline pfm_job_t *buffer_write_pfm_async(
+    const buffer_t *b,
+    const char *filename)
+{
+  pfm_job_t *job = (pfm_job_t *)malloc(sizeof(pfm_job_t));
+  memcpy(&job->view, b, sizeof(buffer_t));
+  job->filename = (char *)malloc(strlen(filename)+1);
+  strcpy(job->filename, filename);
+  job->err = thrd_create(&job->thread, pfm_job_thread, job) != thrd_success;
+  if(job->err) buffer_write_pfm(b, filename); // no thread, write synchronously
+  return job;
+}
+
+// wait for a background write to finish and free the job. returns 0 on
+// success.
+static inline int buffer_write_pfm_wait(
+    pfm_job_t *job)
+{
+  int err = 0;
+  if(!job->err) thrd_join(job->thread, &err);
+  if(err) fprintf(stderr, "[write_pfm] failed to write `%s'\n", job->filename);
+  free(job->filename);
+  free(job);
+  return err;
+}
+
+// levels and cfa pattern of a buffer read from r, where the file has them
+static inline void buffer_rawfile_meta(
+    buffer_t *b,
+    const rawfile_t *r)
+{
+  b->black = 0.0f;
+  b->white = 65535.0f;
+  b->cfa = cfa_rggb;
+  if(r->white > 0.0f)
+  {
+    b->black = r->black;
+    b->white = r->white;
+  }
+  if(r->cfa[0] && cfa_parse(r->cfa, &b->cfa)) b->cfa = cfa_rggb;
+}
+
+// a pgm, an uncompressed dng or a headerless dump with the layout dump (see
+// rawfile.h) as s_buf_raw.
+static inline buffer_t *buffer_read_raw(
+    const char *filename,
+    const rawfile_dump_t *dump)
+{
+  rawfile_t r;
+  if(rawfile_open(filename, dump, &r)) return 0;
+  buffer_t *b = (buffer_t *)malloc(sizeof(buffer_t));
+  memset(b, 0, sizeof(buffer_t));
+  b->type = s_buf_raw;
+  b->width = r.width;
+  b->height = r.height;
+  buffer_rawfile_meta(b, &r);
+  b->data = numa_alloc(sizeof(uint16_t)*r.width*r.height);
+  // unpack straight out of the mapping, this is the first touch:
+  INST_BEGIN();
+#pragma omp parallel for default(shared)
+  for(int y=0;y<r.height;y++)
+  {
+    INST_ROW_BEGIN();
+    rawfile_row(&r, y, 0, r.width, buffer_row_raw(b, y));
+    INST_ROW_END(s_inst_read, 0, INST_ALL, r.width);
+  }
+  INST_END(s_inst_read, 0, INST_ALL);
+  rawfile_close(&r);
+  return b;
+}
+
+static inline buffer_t *buffer_create_float(
+    const int wd,
+    const int ht)
+{
+  buffer_t *b = (buffer_t *)malloc(sizeof(buffer_t));
+  memset(b, 0, sizeof(buffer_t));
+  b->type = s_buf_float;
+  b->width = wd;
+  b->height = ht;
+  b->white = 1.0;
+  b->black = 0.0;
+  b->cfa = cfa_rggb;
+  b->data = numa_calloc(sizeof(float)*wd, ht, 3);
+  return b;
+}
+
+// float cfa plane as buffer_stabilise() makes it, zeroed in parallel. to be
+// filled by buffer_read_raw_stabilise() from a thread outside the pool.
+static inline buffer_t *buffer_create_cfa(
+    const int wd,
+    const int ht)
+{
+  buffer_t *b = (buffer_t *)malloc(sizeof(buffer_t));
+  memset(b, 0, sizeof(buffer_t));
+  b->type = s_buf_cfa_float;
+  b->width = wd;
+  b->height = ht;
+  b->white = 65535.0f;
+  b->black = 0.0;
+  b->cfa = cfa_rggb;
+  b->data = numa_calloc(sizeof(float)*wd, ht, 1);
+  return b;
+}
+
+// detail band storage: s_buf_float, or the reduced precision s_buf_half or
+// s_buf_q16 (half the memory and bandwidth). range is the largest magnitude a
+// q16 buffer has to represent.
+static inline buffer_t *buffer_create_detail(
+    const int wd,
+    const int ht,
+    const buffer_type_t type,
+    const float range)
+{
+  if(type == s_buf_float) return buffer_create_float(wd, ht);
+  assert(type == s_buf_half || type == s_buf_q16);
+  buffer_t *b = (buffer_t *)malloc(sizeof(buffer_t));
+  memset(b, 0, sizeof(buffer_t));
+  b->type = type;
+  b->width = wd;
+  b->height = ht;
+  b->white = 1.0;
+  b->black = 0.0;
+  b->cfa = cfa_rggb;
+  b->quant = range/32767.0f;
+  b->data = numa_calloc(sizeof(uint16_t)*wd, ht, 3);
+  return b;
+}
+
+// psnr of a against the reference b in db, after undoing the variance
+// transform if the type says so and normalising to b's black and white.
+static inline double buffer_psnr(
+    const buffer_t *a,
+    const buffer_t *b)
+{
+  double mse = 0.0;
+  const float range = b->white - b->black;
+#pragma omp parallel default(shared)
+  {
+    float *ra = (float *)malloc(sizeof(float)*2*a->width), *rb = ra + a->width;
+#pragma omp for reduction(+:mse)
+    for(int y=0;y<a->height;y++)
+    {
+      for(int k=0;k<3;k++)
+      {
+        buffer_load_row(a, k, y, ra);
+        buffer_load_row(b, k, y, rb);
+        for(int x=0;x<a->width;x++)
+        {
+          const double d = (ra[x] - rb[x])/range;
+          mse += d*d;
+        }
+      }
+    }
+    free(ra);
+  }
+  mse /= 3.0*a->width*a->height;
+  return mse > 0.0 ? -10.0*log10(mse) : INFINITY;
+}
+
+// one row of raw samples through the variance stabilising transform
+static inline void stabilise_row(
+    const uint16_t *in,
+    float *out,
+    const int wd,
+    const float noise_a,
+    const float sigma2)
+{
+  for(int x=0;x<wd;x++)
+    out[x] = stabilise(in[x], noise_a, sigma2);
+}
+
+// apply the variance stabilising transform to the whole raw image once, in
+// parallel, instead of on every access through s_buf_raw_stabilise.
+static inline buffer_t *buffer_stabilise(
+    const buffer_t *raw)
+{
+  buffer_t *b = (buffer_t *)malloc(sizeof(buffer_t));
+  memcpy(b, raw, sizeof(buffer_t));
+  b->type = s_buf_cfa_float;
+  b->data = numa_alloc(sizeof(float)*raw->width*raw->height); // touched by the loop below
+  const float noise_a = raw->noise_a;
+  const float sigma2 = (raw->noise_b/raw->noise_a)*(raw->noise_b/raw->noise_a);
+#pragma omp parallel for default(shared)
+  for(int y=0;y<raw->height;y++)
+    stabilise_row(buffer_row_raw(raw, y), buffer_row(b, 0, y), raw->width, noise_a, sigma2);
+  return b;
+}
+
+// same as buffer_read_raw() followed by buffer_stabilise(), but the samples
+// are unpacked and stabilised row by row straight out of the mapped file, and
+// the uint16_t copy of the image is never written. if roi is given, only that
+// region of the frame is read (the cfa pattern is left to the caller, see
+// cfa_shift()). reuse is a buffer of a previous frame to fill again if the
+// size matches (or 0). it's freed if it can't be used, also on error.
+static inline buffer_t *buffer_read_raw_stabilise(
+    const char *filename,
+    const rawfile_dump_t *dump,
+    const float noise_a,
+    const float noise_b,
+    const roi_t *roi,
+    buffer_t *reuse,
+    const int parallel)
+{
+  rawfile_t p;
+  if(rawfile_open(filename, dump, &p))
+  {
+    if(reuse) buffer_destroy(reuse);
+    return 0;
+  }
+  const roi_t r = roi ? *roi : (roi_t){0, 0, p.width, p.height};
+  if(r.x < 0 || r.y < 0 || r.width <= 0 || r.height <= 0 || r.x + r.width > p.width || r.y + r.height > p.height)
+  {
+    fprintf(stderr, "[read_raw] region %dx%d+%d+%d is outside of `%s'\n", r.width, r.height, r.x, r.y, filename);
+    if(reuse) buffer_destroy(reuse);
+    rawfile_close(&p);
+    return 0;
+  }
+  buffer_t *b = reuse;
+  if(b && (b->type != s_buf_cfa_float || b->width != r.width || b->height != r.height))
+  {
+    buffer_destroy(b);
+    b = 0;
+  }
+  if(!b)
+  {
+    b = (buffer_t *)malloc(sizeof(buffer_t));
+    memset(b, 0, sizeof(buffer_t));
+    b->type = s_buf_cfa_float;
+    b->width = r.width;
+    b->height = r.height;
+    // the rows are first touched below, by one thread unless parallel. the
+    // background reader gets buffers from buffer_create_cfa() to reuse.
+    b->data = numa_alloc(sizeof(float)*r.width*r.height);
+  }
+  buffer_rawfile_meta(b, &p);
+  b->noise_a = noise_a;
+  b->noise_b = noise_b;
+  const float sigma2 = (noise_b/noise_a)*(noise_b/noise_a);
+  INST_BEGIN();
+#pragma omp parallel default(shared) if(parallel)
+  {
+    uint16_t *row = (uint16_t *)malloc(sizeof(uint16_t)*r.width);
+#pragma omp for
+    for(int y=0;y<r.height;y++)
+    {
+      INST_ROW_BEGIN();
+      rawfile_row(&p, r.y + y, r.x, r.width, row);
+      stabilise_row(row, buffer_row(b, 0, y), r.width, noise_a, sigma2);
+      INST_ROW_END(s_inst_read, 0, INST_ALL, r.width);
+    }
+    free(row);
+  }
+  INST_END(s_inst_read, 0, INST_ALL);
+  rawfile_close(&p);
+  return b;
+}
+
+// background reader, so the next frame of a batch is read while the current
+// one is being processed.
+typedef struct raw_job_t
+{
+  char *filename;            // input file name
+  rawfile_dump_t dump;       // layout of headerless dumps
+  int has_dump;              // set if the file is one
+  float noise_a, noise_b;    // noise model for the variance stabilisation
+  buffer_t *reuse;           // buffer to read into, see buffer_read_raw_stabilise()
+  buffer_t *result;          // the frame, or 0 on error
+  thrd_t thread;             // the reading thread
+  int err;                   // set if the thread could not be started
+}
+raw_job_t;
+
+static inline int raw_job_run(
+    void *data)
+{
+  raw_job_t *job = (raw_job_t *)data;
+  // single threaded, the pool is busy computing:
+  job->result = buffer_read_raw_stabilise(job->filename, job->has_dump ? &job->dump : 0,
+      job->noise_a, job->noise_b, 0, job->reuse, 0);
+  return 0;
+}
+
+static inline int raw_job_thread(
+    void *data)
+{
+  numa_unbind_thread();
+  return raw_job_run(data);
+}
+
+static inline raw_job_t *buffer_read_raw_stabilise_async(
+    const char *filename,
+    const rawfile_dump_t *dump,
+    const float noise_a,
+    const float noise_b,
+    buffer_t *reuse)
+{
+  raw_job_t *job = (raw_job_t *)malloc(sizeof(raw_job_t));
+  job->filename = (char *)malloc(strlen(filename)+1);
+  strcpy(job->filename, filename);
+  job->has_dump = dump != 0;
+  if(dump) job->dump = *dump;
+  job->noise_a = noise_a;
+  job->noise_b = noise_b;
+  job->reuse = reuse;
+  job->result = 0;
+  job->err = thrd_create(&job->thread, raw_job_thread, job) != thrd_success;
+  if(job->err) raw_job_run(job); // no thread, read synchronously
+  return job;
+}
+
+// wait for a background read and free the job. returns the frame or 0.
+static inline buffer_t *buffer_read_wait(
+    raw_job_t *job)
+{
+  if(!job->err) thrd_join(job->thread, 0);
+  buffer_t *b = job->result;
+  free(job->filename);
+  free(job);
+  return b;
+}
+
+// accumulate one row of detail coefficients into the statistics. == 0 is
+// probably coming from an unset pixel, so only positive ones count.
+static inline void detail_stats_row(
+    detail_stats_t *s,
+    const float *de,
+    const int wd)
+{
+  double sum = 0.0;
+  int cnt = 0;
+  for(int x=0;x<wd;x++)
+  {
+    const float d = de[x];
+    if(d > 0.0f)
+    {
+      sum += d*d;
+      cnt++;
+    }
+  }
+  s->cnt += cnt;
+  s->sum += sum;
+}
+
+// add per-thread partial statistics to the totals. call this once per thread
+// inside a critical section.
+static inline void detail_stats_merge(
+    detail_stats_t *dst,
+    const detail_stats_t *src)
+{
+  dst->cnt += src->cnt;
+  dst->sum += src->sum;
+}
+
+// unbiased empirical variance sigma_d^2 = 1/(N-1) sum detail(i)^2
+static inline float detail_stats_variance(
+    const detail_stats_t *s)
+{
+  return s->sum/(s->cnt-1.0);
+}
+
+// edge stopping weight between centre pixel pa and neighbour pb, both given
+// as all three channels, when filtering channel ac.
+static inline float weight(
+    const float *pa,
+    const float *pb,
+    const int ac)
+{
+  if(pb[ac] < 0.0) return 0.0; // source buffer is unknown, never use it
+  // destination buffer is unknown, weight all others with 1
+  if(pa[ac] < 0.0) return 1.0f;
+
+  // XXX this fixes mazing artefacts. why doesn't the > 0 ? 1 : 0 part below do it?
+  // return 1.0;
+
+  float d = 0.0f;
+  const float cw[3] = {1.0, 2.0, 1.0};
+  int dims = 0;
+  for(int k=0;k<3;k++)
+  {
+    if(pa[k] < 0.0 || pb[k] < 0.0) continue;
+
+    // this threshold subtraction considers part of the signal as noise and subtracts that.
+    // noise sigma is normalised to 1.0, so 3sigma^2 = 9 is our noise floor (this is a
+    // two-noisy-estimator distance, so it's actually 1.5sigma for either side).
+    const float dd = fmaxf(0.0f, (pa[k] - pb[k])*(pa[k] - pb[k]) - 16.0f);
+    d += cw[k]*dd;
+    dims++;
+  }
+  // XXX use superfast patented approximation from darktable code:
+  const float weight = expf(-d/dims*5e-1);
+  return weight;
+}
+
+// same for cfa input: both pixels only carry the filtered channel, so the
+// distance degenerates to that one channel.
+static inline float weight_cfa(
+    const float pa,
+    const float pb,
+    const int ac)
+{
+  const float cw[3] = {1.0, 2.0, 1.0};
+  return expf(-cw[ac]*fmaxf(0.0f, (pa - pb)*(pa - pb) - 16.0f)*5e-1);
+}
+
+// scale 0 only asks whether weight_cfa() > 0, i.e. whether expf() hasn't
+// underflowed yet. denormals are flushed with -ffast-math, so that is an
+// exponent above log(FLT_MIN) = -87.34. no expf() needed for the step, and
+// no fmaxf() either: it doesn't change the outcome, but is a libm call
+// without -ffinite-math-only.
+static inline float weight_cfa_step(
+    const float pa,
+    const float pb,
+    const int ac)
+{
+  const float cw[3] = {1.0, 2.0, 1.0};
+  return cw[ac]*((pa - pb)*(pa - pb) - 16.0f)*5e-1f < 87.34f ? 1.0f : 0.0f;
+}
+
+// vertical pass of decompose_raw() over the horizontally filtered rows in
+// coarse. it works in place and top to bottom, i.e. rows above have already
+// been filtered when they are read again. the noise profiles depend on this,
+// so go through strips of columns instead of parallel rows. returns 1 if the
+// channel still has undefined pixels.
+static inline int decompose_raw_columns(
+    buffer_t *coarse,
+    int channel,
+    int scale)
+{
+  const int mult = 1<<scale;
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  const int wd = coarse->width, ht = coarse->height;
+  int incomplete = 0;
+  const int strip = 64;
+  const int num_strips = (wd + strip - 1)/strip;
+#pragma omp parallel for default(shared)
+  for(int s=0;s<num_strips;s++)
+  {
+    INST_ROW_BEGIN();
+    const int x0 = s*strip, x1 = MIN(wd, x0 + strip);
+    for(int y=0;y<ht;y++)
+    {
+      int ty[5];
+      filter_taps(ty, y, mult, ht);
+      const float *in[5];
+      for(int j=0;j<5;j++) in[j] = buffer_row(coarse, channel, ty[j]);
+      float *co = buffer_row(coarse, channel, y);
+      for(int x=x0;x<x1;x++)
+      {
+        float wgt = 0.0f, sum = 0.0f;
+        for(int j=0;j<5;j++)
+        {
+          const float px = in[j][x];
+          const float w = (px != -1.0f) ? filter[j] : 0.0;
+          sum += w*px;
+          wgt += w;
+        }
+        if(wgt <= 0.0)
+        { // no neighbours with this color found. probably x-trans :(
+          co[x] = -1.0f;
+          incomplete = 1; // data race, but stays one in either case.
+        }
+        else co[x] = sum/wgt; // have some estimated coarse value, yay
+      }
+    }
+    INST_ROW_END(s_inst_decompose_raw, scale, channel, 0);
+  }
+  return incomplete;
+}
+
+// last pass of decompose_raw(): detail is the input minus coarse where the
+// input has the channel, and its statistics.
+static inline void decompose_raw_detail(
+    const buffer_t *input,
+    const buffer_t *coarse,
+    buffer_t *detail,
+    int channel,
+    int scale)
+{
+  const int wd = coarse->width, ht = coarse->height;
+  memset(detail->stats + channel, 0, sizeof(detail_stats_t));
+#pragma omp parallel default(shared)
+  {
+    float *row = (float *)malloc(sizeof(float)*wd);
+    detail_stats_t stats = {0};
+#pragma omp for
+    for(int y=0;y<ht;y++)
+    {
+      INST_ROW_BEGIN();
+      buffer_load_row(input, channel, y, row);
+      const float *co = buffer_row(coarse, channel, y);
+      float *de = buffer_row(detail, channel, y);
+      // do we also have a previous value? if yes, encode difference, or else make it smooth:
+      for(int x=0;x<wd;x++)
+        de[x] = (co[x] != -1.0f && row[x] >= 0.0) ? row[x] - co[x] : 0.0f;
+      detail_stats_row(&stats, de, wd);
+      // pixels are counted once per step, in this last pass:
+      INST_ROW_END(s_inst_decompose_raw, scale, channel, wd);
+    }
+    free(row);
+#pragma omp critical
+    detail_stats_merge(detail->stats + channel, &stats);
+  }
+}
+
+static inline int decompose_raw(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    int channel,
+    int scale)
+{
+  const int mult = 1<<scale;
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  const int wd = coarse->width, ht = coarse->height;
+  INST_BEGIN();
+#pragma omp parallel default(shared)
+  {
+    float *row = (float *)malloc(sizeof(float)*wd);
+#pragma omp for
+    for(int y=0;y<ht;y++)
+    {
+      INST_ROW_BEGIN();
+      buffer_load_row(input, channel, y, row);
+      float *co = buffer_row(coarse, channel, y);
+      for(int x=0;x<wd;x++)
+      {
+        int tx[5];
+        // clamp only where the taps reach over the border:
+        if(x < 2*mult || x >= wd - 2*mult) filter_taps(tx, x, mult, wd);
+        else for(int i=0;i<5;i++) tx[i] = x + mult*(i-2);
+        float sum = 0.0f, wgt = 0.0f;
+        for(int i=0;i<5;i++)
+        {
+          const float px = row[tx[i]];
+          const float w = (px != -1.0f) ? filter[i] : 0.0;
+          sum += w*px;
+          wgt += w;
+        }
+        // no neighbours with this color found. probably x-trans :(
+        co[x] = (wgt <= 0.0) ? -1.0f : sum/wgt;
+      }
+      INST_ROW_END(s_inst_decompose_raw, scale, channel, 0);
+    }
+    free(row);
+  }
+  // signal whether or not the coarse buffer still contains undefined pixels:
+  const int incomplete = decompose_raw_columns(coarse, channel, scale);
+  decompose_raw_detail(input, coarse, detail, channel, scale);
+  INST_END(s_inst_decompose_raw, scale, channel);
+  fprintf(stderr, "scale %d done\n", scale);
+  return incomplete;
+}
+
+// scalar reference for pixels x0..x1-1 of decompose_raw16_row(). chan[p] is
+// the channel at phase p of the row. the sums are integers in sixteenths.
+static inline void decompose_raw16_span(
+    const uint16_t *in,
+    const uint8_t chan[CFA_MAX],
+    const int period,
+    const int wd,
+    const int x0,
+    const int x1,
+    float *const co[3])
+{
+  const int filter[5] = {1, 4, 6, 4, 1};
+  for(int x=x0;x<x1;x++)
+  {
+    int tx[5];
+    filter_taps(tx, x, 1, wd);
+    int sum[3] = {0}, wgt[3] = {0};
+    for(int i=0;i<5;i++)
+    {
+      const int c = chan[tx[i] % period];
+      sum[c] += filter[i]*in[tx[i]];
+      wgt[c] += filter[i];
+    }
+    for(int k=0;k<3;k++) co[k][x] = wgt[k] ? sum[k]/(float)wgt[k] : -1.0f;
+  }
+}
+
+// horizontal pass of scale 0 of decompose_raw() for all three channels of raw
+// row y at once, in integers. the float pass only ever sums products of the
+// filter and uint16 samples, which stay below 2^24, so this is bit for bit
+// the same. on a 2x2 pattern the interior is done by the vector kernel.
+static inline void decompose_raw16_row(
+    const buffer_t *input,
+    const int y,
+    float *const co[3])
+{
+  const int wd = input->width, period = input->cfa.size;
+  const uint16_t *in = buffer_row_raw(input, y);
+  const uint8_t *chan = input->cfa.c[y % CFA_MAX];
+  int x = 0;
+  if(period == 2 && chan[0] != chan[1] && wd > 4)
+  {
+    decompose_raw16_span(in, chan, period, wd, 0, 2, co);
+    float *const out[2] = {co[chan[0]], co[chan[1]]};
+    x = decompose_raw16_row_simd()(in, 2, wd-2, out);
+    float *third = co[3 - chan[0] - chan[1]];
+    for(int i=2;i<x;i++) third[i] = -1.0f;
+#ifdef WTF_CHECK_SIMD
+    { // the vector kernel has to match the scalar reference bit for bit:
+      float *ref = (float *)malloc(sizeof(float)*3*wd);
+      float *const rco[3] = {ref, ref + wd, ref + 2*wd};
+      decompose_raw16_span(in, chan, period, wd, 2, x, rco);
+      for(int k=0;k<3;k++) for(int i=2;i<x;i++) if(rco[k][i] != co[k][i])
+      {
+        fprintf(stderr, "[decompose_raw16] simd mismatch at %d %d channel %d: %g vs %g\n", i, y, k, co[k][i], rco[k][i]);
+        assert(0);
+      }
+      free(ref);
+    }
+#endif
+  }
+  decompose_raw16_span(in, chan, period, wd, x, wd, co);
+}
+
+// scale 0 of decompose_raw() for all three channels of raw uint16 input, as
+// the noise profiling needs it: the horizontal pass reads every sample once
+// and filters it in integers, no float conversion per channel and tap. the
+// vertical pass is recursive in place and stays in float. bit for bit the
+// same coarse and detail as decompose_raw(). returns a mask of the channels
+// that still have undefined pixels.
+static inline int decompose_raw16(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail)
+{
+  assert(input->type == s_buf_raw);
+  const int ht = coarse->height;
+  {
+    INST_BEGIN();
+#pragma omp parallel for default(shared)
+    for(int y=0;y<ht;y++)
+    {
+      INST_ROW_BEGIN();
+      float *co[3];
+      for(int k=0;k<3;k++) co[k] = buffer_row(coarse, k, y);
+      decompose_raw16_row(input, y, co);
+      INST_ROW_END(s_inst_decompose_int, 0, INST_ALL, coarse->width);
+    }
+    INST_END(s_inst_decompose_int, 0, INST_ALL);
+  }
+  int incomplete = 0;
+  for(int channel=0;channel<3;channel++)
+  {
+    INST_BEGIN();
+    if(decompose_raw_columns(coarse, channel, 0)) incomplete |= 1<<channel;
+    decompose_raw_detail(input, coarse, detail, channel, 0);
+    INST_END(s_inst_decompose_raw, 0, channel);
+  }
+  return incomplete;
+}
+
+// scalar reference for one row of the edge-aware a-trous step on planar float
+// input, for pixels x0..x1-1. see decompose_row_t for the layout of in[][].
+static inline int decompose_row_float(
+    const float *const in[5][3],
+    const int width,
+    const int mult,
+    const int channel,
+    const int scale,
+    const int x0,
+    const int x1,
+    float *co,
+    float *de)
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  int incomplete = 0;
+  for(int x=x0;x<x1;x++)
+  {
+    int tx[5];
+    filter_taps(tx, x, mult, width);
+    const float pa[3] = {in[2][0][x], in[2][1][x], in[2][2][x]};
+    float wgt = 0.0f, sum = 0.0f;
+    for(int j=0;j<5;j++) for(int i=0;i<5;i++)
+    {
+      const float pb[3] = {in[j][0][tx[i]], in[j][1][tx[i]], in[j][2][tx[i]]};
+      float ww = weight(pa, pb, channel);
+      if(scale == 0) ww = ww > 0.0 ? 1.0 : 0.0;
+      const float w = filter[i]*filter[j]*ww;
+      sum += w*pb[channel];
+      wgt += w;
+    }
+    if(wgt <= 0.0)
+    { // no neighbours with this color found. probably x-trans :(
+      de[x] = 0.0f;
+      co[x] = -1.0f;
+      incomplete = 1;
+    }
+    else
+    { // have some estimated coarse value, yay
+      sum /= wgt;
+      // do we also have a previous value? if yes, encode difference, or else make it smooth:
+      de[x] = (pa[channel] >= 0.0) ? pa[channel] - sum : 0.0f;
+      co[x] = sum;
+    }
+  }
+  return incomplete;
+}
+
+// edge-aware a-trous step on planar float input (scales > 0). the interior of
+// each row goes through the vector kernels in simd.h, borders are scalar.
+static inline int decompose_float(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    int channel,
+    int scale)
+{
+  const int mult = 1<<scale;
+  const int wd = coarse->width, ht = coarse->height;
+  const decompose_row_t decompose_row_simd_fn = decompose_row_simd();
+  // all taps are inside the buffer for x_lo <= x < x_hi:
+  const int x_lo = MIN(wd, 2*mult), x_hi = MAX(x_lo, wd - 2*mult);
+  INST_BEGIN();
+  int incomplete = 0; // signal whether or not the coarse buffer still contains undefined pixels 
+  memset(detail->stats + channel, 0, sizeof(detail_stats_t));
+#pragma omp parallel default(shared)
+  {
+    // rows of reduced precision detail buffers are assembled here first:
+    float *scratch = (float *)malloc(sizeof(float)*wd);
+    detail_stats_t stats = {0}; // per thread partials
+#pragma omp for
+    for(int y=0;y<ht;y++)
+    {
+      INST_ROW_BEGIN();
+      int ty[5];
+      filter_taps(ty, y, mult, input->height);
+      const float *in[5][3];
+      for(int j=0;j<5;j++) for(int k=0;k<3;k++) in[j][k] = buffer_row(input, k, ty[j]);
+      float *co = buffer_row(coarse, channel, y);
+      float *de = buffer_row_out(detail, channel, y, scratch);
+      int inc = decompose_row_float(in, wd, mult, channel, scale, 0, x_lo, co, de);
+      const int x = decompose_row_simd_fn(in, mult, channel, scale, x_lo, x_hi, co, de, &inc);
+      inc |= decompose_row_float(in, wd, mult, channel, scale, x, wd, co, de);
+      if(inc) incomplete = 1; // data race, but stays one in either case.
+#ifdef WTF_CHECK_SIMD
+      { // compare the vector kernel against the scalar reference:
+        float *ref = (float *)malloc(sizeof(float)*2*wd);
+        decompose_row_float(in, wd, mult, channel, scale, x_lo, x, ref, ref + wd);
+        for(int i=x_lo;i<x;i++)
+        {
+          const float tol = 1e-4f, eps = 1.0f/32.0f; // 4 ulp of coarse values up to 65535
+          if(fabsf(ref[i] - co[i]) > tol*(1.0f + fabsf(ref[i])) || fabsf(ref[wd+i] - de[i]) > tol*fabsf(ref[wd+i]) + eps)
+          {
+            fprintf(stderr, "[decompose] simd mismatch at %d %d scale %d channel %d: coarse %g vs %g, detail %g vs %g\n",
+                i, y, scale, channel, co[i], ref[i], de[i], ref[wd+i]);
+            assert(0);
+          }
+        }
+        free(ref);
+      }
+#endif
+      detail_stats_row(&stats, de, wd);
+      buffer_store_row(detail, channel, y, de);
+      INST_ROW_END(s_inst_decompose, scale, channel, wd);
+    }
+    free(scratch);
+#pragma omp critical
+    detail_stats_merge(detail->stats + channel, &stats);
+  }
+  INST_END(s_inst_decompose, scale, channel);
+  return incomplete;
+}
+
+// read one sample of a cfa buffer of the given type. the type is a constant at
+// every call site, so the switch folds away.
+static inline __attribute__((always_inline)) float cfa_load(
+    const void *row,
+    const int x,
+    const buffer_type_t type,
+    const float noise_a,
+    const float sigma2)
+{
+  switch(type)
+  {
+    case s_buf_raw:
+      return ((const uint16_t *)row)[x];
+    case s_buf_raw_stabilise:
+      return stabilise(((const uint16_t *)row)[x], noise_a, sigma2);
+    default: // s_buf_cfa_float
+      return ((const float *)row)[x];
+  }
+}
+
+// pixels x0..x1-1 of one row of decompose_cfa(). match[j][p] is set if phase
+// p of tap row j carries the channel. with border == 0 all taps have to be
+// inside the row, then they are plain offsets without clamping.
+static inline __attribute__((always_inline)) int decompose_cfa_span(
+    const void *const in[5],
+    const int match[5][CFA_MAX],
+    const int wd,
+    const int mult,
+    const int channel,
+    const int scale,
+    const buffer_type_t type,
+    const int period,
+    const float noise_a,
+    const float sigma2,
+    const int x0,
+    const int x1,
+    const int border,
+    float *co,
+    float *de)
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  int incomplete = 0;
+  for(int x=x0;x<x1;x++)
+  {
+    int tx[5], px[5];
+    if(border) filter_taps(tx, x, mult, wd);
+    else for(int i=0;i<5;i++) tx[i] = x + mult*(i-2);
+    for(int i=0;i<5;i++) px[i] = (unsigned)tx[i] % period;
+    const int have = match[2][(unsigned)x % period];
+    const float pa = cfa_load(in[2], x, type, noise_a, sigma2);
+    float wgt = 0.0f, sum = 0.0f;
+    for(int j=0;j<5;j++) for(int i=0;i<5;i++)
+    {
+      if(!match[j][px[i]]) continue; // source pixel is unknown, never use it
+      const float pb = cfa_load(in[j], tx[i], type, noise_a, sigma2);
+      float ww = have ? weight_cfa(pa, pb, channel) : 1.0f;
+      if(scale == 0) ww = ww > 0.0 ? 1.0 : 0.0;
+      const float w = filter[i]*filter[j]*ww;
+      sum += w*pb;
+      wgt += w;
+    }
+    if(wgt <= 0.0)
+    { // no neighbours with this color found. probably x-trans :(
+      de[x] = 0.0f;
+      co[x] = -1.0f;
+      incomplete = 1;
+    }
+    else
+    { // have some estimated coarse value, yay
+      sum /= wgt;
+      de[x] = have ? pa - sum : 0.0f;
+      co[x] = sum;
+    }
+  }
+  return incomplete;
+}
+
+// edge-aware a-trous step on cfa input: uint16 raw, optionally variance
+// stabilised on the fly, or the float plane from buffer_stabilise(). type and
+// period (of the cfa pattern, 2 or 6) are constants at every call site, so
+// this is instantiated once per buffer type and pattern size, and the phase
+// of a tap folds to a mask for bayer patterns.
+static inline __attribute__((always_inline)) int decompose_cfa(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    int channel,
+    int scale,
+    const buffer_type_t type,
+    const int period)
+{
+  const int mult = 1<<scale;
+  const int wd = coarse->width, ht = coarse->height;
+  const float noise_a = input->noise_a;
+  const float sigma2 = (input->noise_b/input->noise_a)*(input->noise_b/input->noise_a);
+  // all taps are inside the buffer for x_lo <= x < x_hi:
+  const int x_lo = MIN(wd, 2*mult), x_hi = MAX(x_lo, wd - 2*mult);
+  INST_BEGIN();
+  int incomplete = 0; // signal whether or not the coarse buffer still contains undefined pixels 
+  memset(detail->stats + channel, 0, sizeof(detail_stats_t));
+#pragma omp parallel default(shared)
+  {
+    // rows of reduced precision detail buffers are assembled here first:
+    float *scratch = (float *)malloc(sizeof(float)*wd);
+    detail_stats_t stats = {0}; // per thread partials
+#pragma omp for
+    for(int y=0;y<ht;y++)
+    {
+      INST_ROW_BEGIN();
+      int ty[5];
+      filter_taps(ty, y, mult, input->height);
+      const void *in[5];
+      // which of the cfa phases carry the filtered channel, per tap row:
+      int match[5][CFA_MAX];
+      for(int j=0;j<5;j++)
+      {
+        in[j] = type == s_buf_cfa_float ? (const void *)buffer_row(input, 0, ty[j]) : (const void *)buffer_row_raw(input, ty[j]);
+        for(int i=0;i<period;i++) match[j][i] = input->cfa.c[ty[j] % CFA_MAX][i] == channel;
+      }
+      float *co = buffer_row(coarse, channel, y);
+      float *de = buffer_row_out(detail, channel, y, scratch);
+      int inc = decompose_cfa_span(in, match, wd, mult, channel, scale, type, period, noise_a, sigma2, 0, x_lo, 1, co, de);
+      inc |= decompose_cfa_span(in, match, wd, mult, channel, scale, type, period, noise_a, sigma2, x_lo, x_hi, 0, co, de);
+      inc |= decompose_cfa_span(in, match, wd, mult, channel, scale, type, period, noise_a, sigma2, x_hi, wd, 1, co, de);
+      if(inc) incomplete = 1; // data race, but stays one in either case.
+      detail_stats_row(&stats, de, wd);
+      buffer_store_row(detail, channel, y, de);
+      INST_ROW_END(s_inst_decompose, scale, channel, wd);
+    }
+    free(scratch);
+#pragma omp critical
+    detail_stats_merge(detail->stats + channel, &stats);
+  }
+  INST_END(s_inst_decompose, scale, channel);
+  return incomplete;
+}
+
+// returns 0 if the buffer is completely filled, and 1 otherwise (contains
+// undefined pixels)
+static inline int decompose(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    int channel,
+    int scale)
+{
+  assert(coarse->type == s_buf_float);
+  assert(detail->type == s_buf_float || detail->type == s_buf_half || detail->type == s_buf_q16);
+  // dispatch once per buffer type and cfa period, the kernels don't switch
+  // per sample:
+  const int x6 = input->cfa.size == 6;
+  switch(input->type)
+  {
+    case s_buf_raw:
+      return x6 ? decompose_cfa(input, coarse, detail, channel, scale, s_buf_raw, 6)
+                : decompose_cfa(input, coarse, detail, channel, scale, s_buf_raw, 2);
+    case s_buf_raw_stabilise:
+      return x6 ? decompose_cfa(input, coarse, detail, channel, scale, s_buf_raw_stabilise, 6)
+                : decompose_cfa(input, coarse, detail, channel, scale, s_buf_raw_stabilise, 2);
+    case s_buf_cfa_float:
+      return x6 ? decompose_cfa(input, coarse, detail, channel, scale, s_buf_cfa_float, 6)
+                : decompose_cfa(input, coarse, detail, channel, scale, s_buf_cfa_float, 2);
+    case s_buf_float:
+      return decompose_float(input, coarse, detail, channel, scale);
+    default:
+      fprintf(stderr, "[decompose] unsupported input buffer type %d\n", input->type);
+      return 1;
+  }
+}
+
+// scalar reference for one row of decompose_fused() on planar float input.
+// de may be 0, for the coarse rows only.
+static inline int decompose_fused_row_float(
+    const float *const in[5][3],
+    const int width,
+    const int mult,
+    const int scale,
+    const int x0,
+    const int x1,
+    float *const co[3],
+    float *const de[3])
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  const float cw[3] = {1.0, 2.0, 1.0};
+  int incomplete = 0;
+  for(int x=x0;x<x1;x++)
+  {
+    int tx[5];
+    filter_taps(tx, x, mult, width);
+    const float pa[3] = {in[2][0][x], in[2][1][x], in[2][2][x]};
+    float wgt[3] = {0.0f}, sum[3] = {0.0f};
+    for(int j=0;j<5;j++) for(int i=0;i<5;i++)
+    {
+      const float pb[3] = {in[j][0][tx[i]], in[j][1][tx[i]], in[j][2][tx[i]]};
+      // the distance is the same for all channels, see weight():
+      float d = 0.0f;
+      int dims = 0;
+      for(int k=0;k<3;k++)
+      {
+        if(pa[k] < 0.0 || pb[k] < 0.0) continue;
+        d += cw[k]*fmaxf(0.0f, (pa[k] - pb[k])*(pa[k] - pb[k]) - 16.0f);
+        dims++;
+      }
+      const float ww = dims ? expf(-d/dims*5e-1) : 0.0f;
+      for(int k=0;k<3;k++)
+      {
+        float wk = pb[k] < 0.0 ? 0.0f : (pa[k] < 0.0 ? 1.0f : ww);
+        if(scale == 0) wk = wk > 0.0 ? 1.0 : 0.0;
+        const float w = filter[i]*filter[j]*wk;
+        sum[k] += w*pb[k];
+        wgt[k] += w;
+      }
+    }
+    for(int k=0;k<3;k++)
+    {
+      if(wgt[k] <= 0.0)
+      { // no neighbours with this color found. probably x-trans :(
+        if(de) de[k][x] = 0.0f;
+        co[k][x] = -1.0f;
+        incomplete = 1;
+      }
+      else
+      { // have some estimated coarse value, yay
+        const float s = sum[k]/wgt[k];
+        if(de) de[k][x] = (pa[k] >= 0.0) ? pa[k] - s : 0.0f;
+        co[k][x] = s;
+      }
+    }
+  }
+  return incomplete;
+}
+
+// one row of decompose_fused() on planar float input: scalar reference on the
+// borders, vector kernels in the interior. de may be 0, for the coarse rows
+// only (see decompose_decimated()).
+static inline int decompose_fused_float_row(
+    const float *const in[5][3],
+    const int wd,
+    const int mult,
+    const int scale,
+    float *const co[3],
+    float *const de[3])
+{
+  // all taps are inside the buffer for x_lo <= x < x_hi:
+  const int x_lo = MIN(wd, 2*mult), x_hi = MAX(x_lo, wd - 2*mult);
+  int inc = decompose_fused_row_float(in, wd, mult, scale, 0, x_lo, co, de);
+  const int x = decompose_fused_row_simd()(in, mult, scale, x_lo, x_hi, co, de, &inc);
+  inc |= decompose_fused_row_float(in, wd, mult, scale, x, wd, co, de);
+#ifdef WTF_CHECK_SIMD
+  { // compare the vector kernel against the scalar reference:
+    float *ref = (float *)malloc(sizeof(float)*6*wd);
+    float *const rco[3] = {ref, ref + wd, ref + 2*wd};
+    float *const rde[3] = {ref + 3*wd, ref + 4*wd, ref + 5*wd};
+    decompose_fused_row_float(in, wd, mult, scale, x_lo, x, rco, de ? rde : 0);
+    for(int k=0;k<3;k++) for(int i=x_lo;i<x;i++)
+    {
+      const float tol = 1e-4f, eps = 1.0f/32.0f; // 4 ulp of coarse values up to 65535
+      if(fabsf(rco[k][i] - co[k][i]) > tol*(1.0f + fabsf(rco[k][i])) || (de && fabsf(rde[k][i] - de[k][i]) > tol*fabsf(rde[k][i]) + eps))
+      {
+        fprintf(stderr, "[decompose_fused] simd mismatch at %d scale %d channel %d: coarse %g vs %g, detail %g vs %g\n",
+            i, scale, k, co[k][i], rco[k][i], de ? de[k][i] : 0.0f, rde[k][i]);
+        assert(0);
+      }
+    }
+    free(ref);
+  }
+#endif
+  return inc;
+}
+
+static inline int decompose_fused_float(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    int scale)
+{
+  const int mult = 1<<scale;
+  const int wd = coarse->width, ht = coarse->height;
+  INST_BEGIN();
+  int incomplete = 0; // signal whether or not the coarse buffer still contains undefined pixels 
+  memset(detail->stats, 0, sizeof(detail->stats));
+#pragma omp parallel default(shared)
+  {
+    // rows of reduced precision detail buffers are assembled here first:
+    float *scratch = (float *)malloc(sizeof(float)*3*wd);
+    detail_stats_t stats[3] = {{0}}; // per thread partials
+#pragma omp for
+    for(int y=0;y<ht;y++)
+    {
+      INST_ROW_BEGIN();
+      int ty[5];
+      filter_taps(ty, y, mult, input->height);
+      const float *in[5][3];
+      for(int j=0;j<5;j++) for(int k=0;k<3;k++) in[j][k] = buffer_row(input, k, ty[j]);
+      float *co[3], *de[3];
+      for(int k=0;k<3;k++)
+      {
+        co[k] = buffer_row(coarse, k, y);
+        de[k] = buffer_row_out(detail, k, y, scratch + k*wd);
+      }
+      if(decompose_fused_float_row(in, wd, mult, scale, co, de))
+        incomplete = 1; // data race, but stays one in either case.
+      for(int k=0;k<3;k++)
+      {
+        detail_stats_row(stats + k, de[k], wd);
+        buffer_store_row(detail, k, y, de[k]);
+      }
+      INST_ROW_END(s_inst_decompose_fused, scale, INST_ALL, wd);
+    }
+    free(scratch);
+#pragma omp critical
+    for(int k=0;k<3;k++) detail_stats_merge(detail->stats + k, stats + k);
+  }
+  INST_END(s_inst_decompose_fused, scale, INST_ALL);
+  return incomplete;
+}
+
+// pixels x0..x1-1 of decompose_fused_cfa_row(), chan[j][p] is the channel of
+// phase p in tap row j. border == 0 means no tap needs clamping.
+static inline __attribute__((always_inline)) int decompose_fused_cfa_span(
+    const void *const in[5],
+    const int chan[5][CFA_MAX],
+    const int wd,
+    const int mult,
+    const int scale,
+    const buffer_type_t type,
+    const int period,
+    const float noise_a,
+    const float sigma2,
+    const int x0,
+    const int x1,
+    const int border,
+    float *const co[3],
+    float *const de[3])
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  int incomplete = 0;
+  for(int x=x0;x<x1;x++)
+  {
+    int tx[5], px[5];
+    if(border) filter_taps(tx, x, mult, wd);
+    else for(int i=0;i<5;i++) tx[i] = x + mult*(i-2);
+    for(int i=0;i<5;i++) px[i] = (unsigned)tx[i] % period;
+    const int cc = chan[2][(unsigned)x % period];
+    const float pa = cfa_load(in[2], x, type, noise_a, sigma2);
+    float wgt[3] = {0.0f}, sum[3] = {0.0f};
+    for(int j=0;j<5;j++) for(int i=0;i<5;i++)
+    {
+      const int cn = chan[j][px[i]];
+      const float pb = cfa_load(in[j], tx[i], type, noise_a, sigma2);
+      float ww = cn == cc ? weight_cfa(pa, pb, cc) : 1.0f;
+      if(scale == 0) ww = ww > 0.0 ? 1.0 : 0.0;
+      const float w = filter[i]*filter[j]*ww;
+      sum[cn] += w*pb;
+      wgt[cn] += w;
+    }
+    for(int k=0;k<3;k++)
+    {
+      if(wgt[k] <= 0.0)
+      { // no neighbours with this color found. probably x-trans :(
+        de[k][x] = 0.0f;
+        co[k][x] = -1.0f;
+        incomplete = 1;
+      }
+      else
+      { // have some estimated coarse value, yay
+        const float s = sum[k]/wgt[k];
+        de[k][x] = k == cc ? pa - s : 0.0f;
+        co[k][x] = s;
+      }
+    }
+  }
+  return incomplete;
+}
+
+// one row of decompose_fused() on cfa input. in[j] is row ty[j] of the
+// input. period is the size of the cfa pattern, a constant like type.
+static inline __attribute__((always_inline)) int decompose_fused_cfa_row(
+    const void *const in[5],
+    const int ty[5],
+    const int wd,
+    const int mult,
+    const int scale,
+    const buffer_type_t type,
+    const float noise_a,
+    const float sigma2,
+    const cfa_t *cfa,
+    const int period,
+    float *const co[3],
+    float *const de[3])
+{
+  // channel of the cfa phases in each tap row:
+  int chan[5][CFA_MAX];
+  for(int j=0;j<5;j++) for(int i=0;i<period;i++) chan[j][i] = cfa->c[ty[j] % CFA_MAX][i];
+  // all taps are inside the row for x_lo <= x < x_hi, the border spans clamp:
+  const int x_lo = MIN(wd, 2*mult), x_hi = MAX(x_lo, wd - 2*mult);
+  int inc = decompose_fused_cfa_span(in, chan, wd, mult, scale, type, period, noise_a, sigma2, 0, x_lo, 1, co, de);
+  inc |= decompose_fused_cfa_span(in, chan, wd, mult, scale, type, period, noise_a, sigma2, x_lo, x_hi, 0, co, de);
+  inc |= decompose_fused_cfa_span(in, chan, wd, mult, scale, type, period, noise_a, sigma2, x_hi, wd, 1, co, de);
+  return inc;
+}
+
+// all three channels of decompose_cfa() in one sweep: every tap only
+// contributes to its own cfa channel, so its weight is computed once.
+static inline __attribute__((always_inline)) int decompose_fused_cfa(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    int scale,
+    const buffer_type_t type,
+    const int period)
+{
+  const int mult = 1<<scale;
+  const int wd = coarse->width, ht = coarse->height;
+  const float noise_a = input->noise_a;
+  const float sigma2 = (input->noise_b/input->noise_a)*(input->noise_b/input->noise_a);
+  INST_BEGIN();
+  int incomplete = 0; // signal whether or not the coarse buffer still contains undefined pixels 
+  memset(detail->stats, 0, sizeof(detail->stats));
+#pragma omp parallel default(shared)
+  {
+    // rows of reduced precision detail buffers are assembled here first:
+    float *scratch = (float *)malloc(sizeof(float)*3*wd);
+    detail_stats_t stats[3] = {{0}}; // per thread partials
+#pragma omp for
+    for(int y=0;y<ht;y++)
+    {
+      INST_ROW_BEGIN();
+      int ty[5];
+      filter_taps(ty, y, mult, input->height);
+      const void *in[5];
+      for(int j=0;j<5;j++)
+        in[j] = type == s_buf_cfa_float ? (const void *)buffer_row(input, 0, ty[j]) : (const void *)buffer_row_raw(input, ty[j]);
+      float *co[3], *de[3];
+      for(int k=0;k<3;k++)
+      {
+        co[k] = buffer_row(coarse, k, y);
+        de[k] = buffer_row_out(detail, k, y, scratch + k*wd);
+      }
+      if(decompose_fused_cfa_row(in, ty, wd, mult, scale, type, noise_a, sigma2, &input->cfa, period, co, de))
+        incomplete = 1; // data race, but stays one in either case.
+      for(int k=0;k<3;k++)
+      {
+        detail_stats_row(stats + k, de[k], wd);
+        buffer_store_row(detail, k, y, de[k]);
+      }
+      INST_ROW_END(s_inst_decompose_fused, scale, INST_ALL, wd);
+    }
+    free(scratch);
+#pragma omp critical
+    for(int k=0;k<3;k++) detail_stats_merge(detail->stats + k, stats + k);
+  }
+  INST_END(s_inst_decompose_fused, scale, INST_ALL);
+  return incomplete;
+}
+
+// same as calling decompose() for all three channels, but sweeps the image
+// only once and shares the edge-stopping weights between the channels.
+static inline int decompose_fused(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    int scale)
+{
+  assert(coarse->type == s_buf_float);
+  assert(detail->type == s_buf_float || detail->type == s_buf_half || detail->type == s_buf_q16);
+  const int x6 = input->cfa.size == 6;
+  switch(input->type)
+  {
+    case s_buf_raw:
+      return x6 ? decompose_fused_cfa(input, coarse, detail, scale, s_buf_raw, 6)
+                : decompose_fused_cfa(input, coarse, detail, scale, s_buf_raw, 2);
+    case s_buf_raw_stabilise:
+      return x6 ? decompose_fused_cfa(input, coarse, detail, scale, s_buf_raw_stabilise, 6)
+                : decompose_fused_cfa(input, coarse, detail, scale, s_buf_raw_stabilise, 2);
+    case s_buf_cfa_float:
+      return x6 ? decompose_fused_cfa(input, coarse, detail, scale, s_buf_cfa_float, 6)
+                : decompose_fused_cfa(input, coarse, detail, scale, s_buf_cfa_float, 2);
+    case s_buf_float:
+      return decompose_fused_float(input, coarse, detail, scale);
+    default:
+      fprintf(stderr, "[decompose] unsupported input buffer type %d\n", input->type);
+      return 1;
+  }
+}
+
+// horizontal pass of the separable scale 0 of decompose_fast() for pixels
+// x0..x1-1 of one cfa row with channels chan[p]. the full kernel only weights
+// taps of the channel of its centre pixel, so keep the plain filtered sums and
+// weights per channel in ws[8x+0..2] and ws[8x+3..5], and the sum and weight
+// of the taps of the channel of x weighted by weight_cfa_step() in ws[8x+6]
+// and ws[8x+7].
+static inline __attribute__((always_inline)) void decompose_fast_cfa_hspan(
+    const float *in,
+    const int chan[CFA_MAX],
+    const int wd,
+    const int period,
+    const int x0,
+    const int x1,
+    const int border,
+    float *ws)
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  if(period == 2 && !border && chan[0] != chan[1])
+  { // bayer: taps 0, 2 and 4 have the channel of x, 1 and 3 the other one
+    for(int x=x0;x<x1;x++)
+    {
+      const int cc = chan[x&1], oc = chan[(x+1)&1], tc = 3 - cc - oc;
+      const float *p = in + x - 2;
+      const float w0 = filter[0]*weight_cfa_step(p[2], p[0], cc);
+      const float w4 = filter[4]*weight_cfa_step(p[2], p[4], cc);
+      float *w = ws + 8*x;
+      w[cc] = filter[0]*p[0] + filter[2]*p[2] + filter[4]*p[4];
+      w[3+cc] = filter[0] + filter[2] + filter[4];
+      w[oc] = filter[1]*p[1] + filter[3]*p[3];
+      w[3+oc] = filter[1] + filter[3];
+      w[tc] = w[3+tc] = 0.0f;
+      w[6] = w0*p[0] + filter[2]*p[2] + w4*p[4];
+      w[7] = w0 + filter[2] + w4;
+    }
+    return;
+  }
+  for(int x=x0;x<x1;x++)
+  {
+    int tx[5];
+    if(border) filter_taps(tx, x, 1, wd);
+    else for(int i=0;i<5;i++) tx[i] = x + i - 2;
+    const int cc = chan[(unsigned)x % period];
+    float wgt[3] = {0.0f}, sum[3] = {0.0f}, own_wgt = 0.0f, own_sum = 0.0f;
+    for(int i=0;i<5;i++)
+    {
+      const int cn = chan[(unsigned)tx[i] % period];
+      sum[cn] += filter[i]*in[tx[i]];
+      wgt[cn] += filter[i];
+      if(cn == cc)
+      {
+        const float w = filter[i]*weight_cfa_step(in[x], in[tx[i]], cc);
+        own_sum += w*in[tx[i]];
+        own_wgt += w;
+      }
+    }
+    for(int k=0;k<3;k++)
+    {
+      ws[8*x+k] = sum[k];
+      ws[8*x+3+k] = wgt[k];
+    }
+    ws[8*x+6] = own_sum;
+    ws[8*x+7] = own_wgt;
+  }
+}
+
+// vertical pass of the separable scale 0 of decompose_fast() for pixels
+// x0..x1-1: ws[j] is the horizontal pass of tap row j, in[j] the row itself.
+// rows with the channel of the centre pixel below it contribute their
+// weighted sum of that channel, weighted once more against the centre. in the
+// other rows the taps of the centre channel (diagonal greens on bayer) are
+// weighted one by one. everything else is plain filtering as in the full
+// kernel, so only the two rows at distance 2 are approximated.
+static inline __attribute__((always_inline)) int decompose_fast_cfa_vspan(
+    const float *const in[5],
+    const int chan[5][CFA_MAX],
+    const float *const ws[5],
+    const int wd,
+    const int period,
+    const int x0,
+    const int x1,
+    const int border,
+    float *const co[3],
+    float *const de[3])
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  int incomplete = 0;
+  for(int x=x0;x<x1;x++)
+  {
+    const int p = (unsigned)x % period;
+    const int cc = chan[2][p];
+    const float pa = in[2][x];
+    float wgt[3] = {0.0f}, sum[3] = {0.0f};
+    float dsum = 0.0f, dwgt = 0.0f; // changes to the centre channel
+    for(int j=0;j<5;j++)
+    {
+      const float *h = ws[j] + 8*x;
+      for(int k=0;k<3;k++)
+      {
+        sum[k] += filter[j]*h[k];
+        wgt[k] += filter[j]*h[3+k];
+      }
+      if(chan[j][p] == cc)
+      { // swap the plain sum of the centre channel for the weighted one:
+        const float w = filter[j]*weight_cfa_step(pa, in[j][x], cc);
+        dsum += w*h[6] - filter[j]*h[cc];
+        dwgt += w*h[7] - filter[j]*h[3+cc];
+      }
+      else if(period == 2 && !border)
+      { // bayer: the centre channel is at x-1 and x+1 if at all
+        if(chan[j][p^1] == cc) for(int i=1;i<5;i+=2)
+        {
+          const float pb = in[j][x+i-2];
+          const float w = filter[j]*filter[i]*(weight_cfa_step(pa, pb, cc) - 1.0f);
+          dsum += w*pb;
+          dwgt += w;
+        }
+      }
+      else
+      { // take the weight off the centre channel taps where it is zero:
+        int tx[5];
+        if(border) filter_taps(tx, x, 1, wd);
+        else for(int i=0;i<5;i++) tx[i] = x + i - 2;
+        for(int i=0;i<5;i++) if(chan[j][(unsigned)tx[i] % period] == cc)
+        {
+          const float pb = in[j][tx[i]];
+          const float w = filter[j]*filter[i]*(weight_cfa_step(pa, pb, cc) - 1.0f);
+          dsum += w*pb;
+          dwgt += w;
+        }
+      }
+    }
+    for(int k=0;k<3;k++)
+    {
+      sum[k] += k == cc ? dsum : 0.0f;
+      wgt[k] += k == cc ? dwgt : 0.0f;
+    }
+    for(int k=0;k<3;k++)
+    {
+      if(wgt[k] <= 0.0)
+      {
+        de[k][x] = 0.0f;
+        co[k][x] = -1.0f;
+        incomplete = 1;
+      }
+      else
+      {
+        const float s = sum[k]/wgt[k];
+        de[k][x] = k == cc ? pa - s : 0.0f;
+        co[k][x] = s;
+      }
+    }
+  }
+  return incomplete;
+}
+
+// rows y0..y1-1 of the separable scale 0 of decompose_fast() on cfa input.
+// window is a ring of 5 input rows as floats, each followed by its horizontal
+// pass (see decompose_fast_cfa_hspan()), so 9*wd floats per row. scratch
+// holds 3 rows.
+static inline __attribute__((always_inline)) int decompose_fast_cfa_rows(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    const buffer_type_t type,
+    const int period,
+    const int y0,
+    const int y1,
+    float *window,
+    float *scratch,
+    detail_stats_t stats[3])
+{
+  const int wd = coarse->width, ht = coarse->height;
+  const float noise_a = input->noise_a;
+  const float sigma2 = (input->noise_b/input->noise_a)*(input->noise_b/input->noise_a);
+  const int x_lo = MIN(wd, 2), x_hi = MAX(x_lo, wd - 2);
+  int incomplete = 0;
+  for(int y=y0, r=MAX(0, y0-2);y<y1;y++)
+  {
+    for(;r<MIN(ht, y+3);r++)
+    { // horizontal pass of the rows up to y+2 into the ring:
+      const void *row = type == s_buf_cfa_float ? (const void *)buffer_row(input, 0, r) : (const void *)buffer_row_raw(input, r);
+      float *in = window + (size_t)9*(r % 5)*wd;
+      for(int x=0;x<wd;x++) in[x] = cfa_load(row, x, type, noise_a, sigma2);
+      int chan[CFA_MAX];
+      for(int i=0;i<period;i++) chan[i] = input->cfa.c[r % CFA_MAX][i];
+      decompose_fast_cfa_hspan(in, chan, wd, period, 0, x_lo, 1, in + wd);
+      decompose_fast_cfa_hspan(in, chan, wd, period, x_lo, x_hi, 0, in + wd);
+      decompose_fast_cfa_hspan(in, chan, wd, period, x_hi, wd, 1, in + wd);
+    }
+    int ty[5];
+    filter_taps(ty, y, 1, ht);
+    const float *in[5], *ws[5];
+    int chan[5][CFA_MAX];
+    for(int j=0;j<5;j++)
+    {
+      in[j] = window + (size_t)9*(ty[j] % 5)*wd;
+      ws[j] = in[j] + wd;
+      for(int i=0;i<period;i++) chan[j][i] = input->cfa.c[ty[j] % CFA_MAX][i];
+    }
+    float *co[3], *de[3];
+    for(int k=0;k<3;k++)
+    {
+      co[k] = buffer_row(coarse, k, y);
+      de[k] = buffer_row_out(detail, k, y, scratch + k*wd);
+    }
+    incomplete |= decompose_fast_cfa_vspan(in, chan, ws, wd, period, 0, x_lo, 1, co, de);
+    incomplete |= decompose_fast_cfa_vspan(in, chan, ws, wd, period, x_lo, x_hi, 0, co, de);
+    incomplete |= decompose_fast_cfa_vspan(in, chan, ws, wd, period, x_hi, wd, 1, co, de);
+    for(int k=0;k<3;k++)
+    {
+      detail_stats_row(stats + k, de[k], wd);
+      buffer_store_row(detail, k, y, de[k]);
+    }
+  }
+  return incomplete;
+}
+
+// decompose_fast_cfa_rows() for the type and pattern size of the input.
+// window needs 5*9*wd floats, scratch 3*wd.
+static inline int decompose_fast_cfa_band(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    const int y0,
+    const int y1,
+    float *window,
+    float *scratch,
+    detail_stats_t stats[3])
+{
+  const int x6 = input->cfa.size == 6;
+  switch(input->type)
+  {
+    case s_buf_raw:
+      return x6 ? decompose_fast_cfa_rows(input, coarse, detail, s_buf_raw, 6, y0, y1, window, scratch, stats)
+                : decompose_fast_cfa_rows(input, coarse, detail, s_buf_raw, 2, y0, y1, window, scratch, stats);
+    case s_buf_raw_stabilise:
+      return x6 ? decompose_fast_cfa_rows(input, coarse, detail, s_buf_raw_stabilise, 6, y0, y1, window, scratch, stats)
+                : decompose_fast_cfa_rows(input, coarse, detail, s_buf_raw_stabilise, 2, y0, y1, window, scratch, stats);
+    default: // s_buf_cfa_float
+      assert(input->type == s_buf_cfa_float);
+      return x6 ? decompose_fast_cfa_rows(input, coarse, detail, s_buf_cfa_float, 6, y0, y1, window, scratch, stats)
+                : decompose_fast_cfa_rows(input, coarse, detail, s_buf_cfa_float, 2, y0, y1, window, scratch, stats);
+  }
+}
+
+// scale 0 of decompose_fast() on cfa input, every thread runs bands of rows
+// through decompose_fast_cfa_band() like decompose_separable().
+static inline int decompose_fast_cfa(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail)
+{
+  const int wd = coarse->width, ht = coarse->height;
+  const int band = 64;
+  const int num_bands = (ht + band - 1)/band;
+  INST_BEGIN();
+  int incomplete = 0; // signal whether or not the coarse buffer still contains undefined pixels
+  memset(detail->stats, 0, sizeof(detail->stats));
+#pragma omp parallel default(shared)
+  {
+    float *window = (float *)malloc(sizeof(float)*5*9*wd);
+    float *scratch = (float *)malloc(sizeof(float)*3*wd);
+    detail_stats_t stats[3] = {{0}}; // per thread partials
+#pragma omp for schedule(static)
+    for(int b=0;b<num_bands;b++)
+    {
+      INST_ROW_BEGIN();
+      const int y0 = b*band, y1 = MIN(ht, y0 + band);
+      if(decompose_fast_cfa_band(input, coarse, detail, y0, y1, window, scratch, stats))
+        incomplete = 1; // data race, but stays one in either case.
+      INST_ROW_END(s_inst_decompose_fast, 0, INST_ALL, (size_t)(y1 - y0)*wd);
+    }
+    free(window);
+    free(scratch);
+#pragma omp critical
+    for(int k=0;k<3;k++) detail_stats_merge(detail->stats + k, stats + k);
+  }
+  INST_END(s_inst_decompose_fast, 0, INST_ALL);
+  return incomplete;
+}
+
+// rows y0..y1-1 of decompose_fused(), or of decompose_fast() for cfa input at
+// scale 0 if fast is set, on the calling thread only. for schedulers that hand
+// out bands of rows as tasks (see tasks.h). stats[3] accumulates the detail
+// statistics of the band, detail->stats is left alone. returns 1 if there are
+// undefined pixels.
+static inline int decompose_fused_band(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    const int scale,
+    const int fast,
+    const int y0,
+    const int y1,
+    detail_stats_t stats[3])
+{
+  const int mult = 1<<scale;
+  const int wd = coarse->width;
+  const float noise_a = input->noise_a;
+  const float sigma2 = (input->noise_b/input->noise_a)*(input->noise_b/input->noise_a);
+  const int x6 = input->cfa.size == 6;
+  float *scratch = (float *)malloc(sizeof(float)*3*wd);
+  int incomplete = 0;
+  if(fast)
+  { // the separable fast mode has no band version for planar float input
+    assert(input->type != s_buf_float && scale == 0);
+    float *window = (float *)malloc(sizeof(float)*5*9*wd);
+    incomplete = decompose_fast_cfa_band(input, coarse, detail, y0, y1, window, scratch, stats);
+    free(window);
+    free(scratch);
+    return incomplete;
+  }
+  for(int y=y0;y<y1;y++)
+  {
+    int ty[5];
+    filter_taps(ty, y, mult, input->height);
+    float *co[3], *de[3];
+    for(int k=0;k<3;k++)
+    {
+      co[k] = buffer_row(coarse, k, y);
+      de[k] = buffer_row_out(detail, k, y, scratch + k*wd);
+    }
+    const void *in[5];
+    const float *fin[5][3];
+    int inc = 0;
+    switch(input->type)
+    {
+      case s_buf_raw:
+        for(int j=0;j<5;j++) in[j] = buffer_row_raw(input, ty[j]);
+        inc = x6 ? decompose_fused_cfa_row(in, ty, wd, mult, scale, s_buf_raw, noise_a, sigma2, &input->cfa, 6, co, de)
+                 : decompose_fused_cfa_row(in, ty, wd, mult, scale, s_buf_raw, noise_a, sigma2, &input->cfa, 2, co, de);
+        break;
+      case s_buf_raw_stabilise:
+        for(int j=0;j<5;j++) in[j] = buffer_row_raw(input, ty[j]);
+        inc = x6 ? decompose_fused_cfa_row(in, ty, wd, mult, scale, s_buf_raw_stabilise, noise_a, sigma2, &input->cfa, 6, co, de)
+                 : decompose_fused_cfa_row(in, ty, wd, mult, scale, s_buf_raw_stabilise, noise_a, sigma2, &input->cfa, 2, co, de);
+        break;
+      case s_buf_cfa_float:
+        for(int j=0;j<5;j++) in[j] = buffer_row(input, 0, ty[j]);
+        inc = x6 ? decompose_fused_cfa_row(in, ty, wd, mult, scale, s_buf_cfa_float, noise_a, sigma2, &input->cfa, 6, co, de)
+                 : decompose_fused_cfa_row(in, ty, wd, mult, scale, s_buf_cfa_float, noise_a, sigma2, &input->cfa, 2, co, de);
+        break;
+      default: // s_buf_float
+        for(int j=0;j<5;j++) for(int k=0;k<3;k++) fin[j][k] = buffer_row(input, k, ty[j]);
+        inc = decompose_fused_float_row(fin, wd, mult, scale, co, de);
+    }
+    incomplete |= inc;
+    for(int k=0;k<3;k++)
+    {
+      detail_stats_row(stats + k, de[k], wd);
+      buffer_store_row(detail, k, y, de[k]);
+    }
+  }
+  free(scratch);
+  return incomplete;
+}
+
+// scalar reference for one pass of decompose_separable(), for pixels
+// x0..x1-1. see decompose_separable_row_t for the layout of the taps.
+static inline int decompose_separable_row_float(
+    const float *const guide[5][3],
+    const float *const src[5][3],
+    const int off[5],
+    const int scale,
+    const int x0,
+    const int x1,
+    float *const out[3])
+{
+  const float filter[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+  const float cw[3] = {1.0, 2.0, 1.0};
+  int incomplete = 0;
+  for(int x=x0;x<x1;x++)
+  {
+    const float pa[3] = {guide[2][0][x + off[2]], guide[2][1][x + off[2]], guide[2][2][x + off[2]]};
+    float wgt[3] = {0.0f}, sum[3] = {0.0f};
+    for(int i=0;i<5;i++)
+    {
+      const int xx = x + off[i];
+      // same distance as decompose_fused_row_float(), between guide pixels:
+      float d = 0.0f;
+      int dims = 0;
+      for(int k=0;k<3;k++)
+      {
+        const float pg = guide[i][k][xx];
+        if(pa[k] < 0.0 || pg < 0.0) continue;
+        d += cw[k]*fmaxf(0.0f, (pa[k] - pg)*(pa[k] - pg) - 16.0f);
+        dims++;
+      }
+      const float ww = dims ? expf(-d/dims*5e-1) : 0.0f;
+      for(int k=0;k<3;k++)
+      {
+        const float pb = src[i][k][xx];
+        float wk = pb < 0.0 ? 0.0f : (pa[k] < 0.0 ? 1.0f : ww);
+        if(scale == 0) wk = wk > 0.0 ? 1.0 : 0.0;
+        sum[k] += filter[i]*wk*pb;
+        wgt[k] += filter[i]*wk;
+      }
+    }
+    for(int k=0;k<3;k++)
+    {
+      if(wgt[k] <= 0.0) incomplete = 1;
+      out[k][x] = wgt[k] > 0.0 ? sum[k]/wgt[k] : -1.0f;
+    }
+  }
+  return incomplete;
+}
+
+// separable approximation of decompose_fused_float(): a horizontal and a
+// vertical 5 tap cross-bilateral pass, both with the input as guide, so 10
+// instead of 25 weights per pixel. every thread runs bands of rows and keeps
+// the horizontal pass of its band plus the vertical support in a window.
+static inline int decompose_separable(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    int scale)
+{
+  const int mult = 1<<scale;
+  const int wd = coarse->width, ht = coarse->height;
+  const decompose_separable_row_t separable_row_simd = decompose_separable_row_simd();
+  // all horizontal taps are inside the buffer for x_lo <= x < x_hi:
+  const int x_lo = MIN(wd, 2*mult), x_hi = MAX(x_lo, wd - 2*mult);
+  const int band = 64, halo = 2*mult;
+  const int num_bands = (ht + band - 1)/band;
+  INST_BEGIN();
+  int incomplete = 0; // signal whether or not the coarse buffer still contains undefined pixels
+  memset(detail->stats, 0, sizeof(detail->stats));
+#pragma omp parallel default(shared)
+  {
+    float *window = (float *)malloc(sizeof(float)*3*wd*(band + 2*halo));
+    float *scratch = (float *)malloc(sizeof(float)*3*wd);
+    detail_stats_t stats[3] = {{0}}; // per thread partials
+#pragma omp for schedule(static)
+    for(int b=0;b<num_bands;b++)
+    {
+      INST_ROW_BEGIN();
+      const int y0 = b*band, y1 = MIN(ht, y0 + band);
+      const int r0 = MAX(0, y0 - halo), r1 = MIN(ht, y1 + halo);
+      for(int r=r0;r<r1;r++)
+      { // horizontal pass of row r into the window:
+        const float *in[5][3];
+        float *out[3];
+        for(int k=0;k<3;k++)
+        {
+          for(int i=0;i<5;i++) in[i][k] = buffer_row(input, k, r);
+          out[k] = window + ((size_t)3*(r - r0) + k)*wd;
+        }
+        int off[5];
+        for(int i=0;i<5;i++) off[i] = mult*(i-2);
+        int inc = 0; // only the vertical pass decides about unset pixels
+        const int x = separable_row_simd(in, in, off, scale, x_lo, x_hi, out, &inc);
+        decompose_separable_row_float(in, in, off, scale, x, x_hi, out);
+        // borders, one pixel at a time with clamped taps:
+        const int border[4] = {0, x_lo, x_hi, wd};
+        for(int e=0;e<4;e+=2) for(int x=border[e];x<border[e+1];x++)
+        {
+          int tx[5];
+          filter_taps(tx, x, mult, wd);
+          for(int i=0;i<5;i++) off[i] = tx[i] - x;
+          decompose_separable_row_float(in, in, off, scale, x, x+1, out);
+        }
+      }
+      for(int y=y0;y<y1;y++)
+      { // vertical pass, guided by the input rows:
+        int ty[5];
+        filter_taps(ty, y, mult, ht);
+        const float *in[5][3], *src[5][3];
+        float *co[3], *de[3];
+        for(int k=0;k<3;k++)
+        {
+          for(int j=0;j<5;j++)
+          {
+            in[j][k] = buffer_row(input, k, ty[j]);
+            src[j][k] = window + ((size_t)3*(ty[j] - r0) + k)*wd;
+          }
+          co[k] = buffer_row(coarse, k, y);
+          de[k] = buffer_row_out(detail, k, y, scratch + k*wd);
+        }
+        const int off[5] = {0};
+        int inc = 0;
+        const int x = separable_row_simd(in, src, off, scale, 0, wd, co, &inc);
+        inc |= decompose_separable_row_float(in, src, off, scale, x, wd, co);
+        if(inc) incomplete = 1; // data race, but stays one in either case.
+#ifdef WTF_CHECK_SIMD
+        { // compare the vector kernel against the scalar reference:
+          float *ref = (float *)malloc(sizeof(float)*3*wd);
+          float *const rco[3] = {ref, ref + wd, ref + 2*wd};
+          decompose_separable_row_float(in, src, off, scale, 0, x, rco);
+          for(int k=0;k<3;k++) for(int i=0;i<x;i++)
+          {
+            if(fabsf(rco[k][i] - co[k][i]) > 1e-4f*(1.0f + fabsf(rco[k][i])))
+            {
+              fprintf(stderr, "[decompose_separable] simd mismatch at %d %d scale %d channel %d: coarse %g vs %g\n",
+                  i, y, scale, k, co[k][i], rco[k][i]);
+              assert(0);
+            }
+          }
+          free(ref);
+        }
+#endif
+        for(int k=0;k<3;k++)
+        {
+          for(int x=0;x<wd;x++)
+            de[k][x] = (co[k][x] != -1.0f && in[2][k][x] >= 0.0f) ? in[2][k][x] - co[k][x] : 0.0f;
+          detail_stats_row(stats + k, de[k], wd);
+          buffer_store_row(detail, k, y, de[k]);
+        }
+      }
+      INST_ROW_END(s_inst_decompose_fast, scale, INST_ALL, (size_t)(y1 - y0)*wd);
+    }
+    free(window);
+    free(scratch);
+#pragma omp critical
+    for(int k=0;k<3;k++) detail_stats_merge(detail->stats + k, stats + k);
+  }
+  INST_END(s_inst_decompose_fast, scale, INST_ALL);
+  return incomplete;
+}
+
+// fast mode of decompose_fused(), for previews and large batches: planar
+// float input goes through decompose_separable(), cfa input (scale 0) through
+// decompose_fast_cfa(). both trade 25 weights per pixel for 10 of a
+// horizontal and a vertical pass, at some loss of edge preservation. see the
+// comparison in wtf-bench.
+static inline int decompose_fast(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    int scale)
+{
+  assert(coarse->type == s_buf_float);
+  assert(detail->type == s_buf_float || detail->type == s_buf_half || detail->type == s_buf_q16);
+  switch(input->type)
+  {
+    case s_buf_raw:
+    case s_buf_raw_stabilise:
+    case s_buf_cfa_float:
+      if(scale > 0) return decompose_fused(input, coarse, detail, scale); // no binarised weights
+      return decompose_fast_cfa(input, coarse, detail);
+    case s_buf_float:
+      return decompose_separable(input, coarse, detail, scale);
+    default:
+      fprintf(stderr, "[decompose] unsupported input buffer type %d\n", input->type);
+      return 1;
+  }
+}
+
+// width or height of coarse level scale of the decimated pyramid: scale 0
+// stays at full resolution, every level after that halves it.
+static inline int decimated_size(
+    const int size,
+    const int scale)
+{
+  int s = size;
+  for(int k=0;k<scale;k++) s = (s + 1)/2;
+  return s;
+}
+
+// row y of channel c of a decimated coarse level, bilinearly interpolated to
+// the wd pixels of the grid above it.
+static inline void upsample_row(
+    const buffer_t *coarse,
+    const int c,
+    const int y,
+    float *out,
+    const int wd)
+{
+  const float *r0 = buffer_row(coarse, c, MIN(coarse->height-1, y/2));
+  const float *r1 = buffer_row(coarse, c, MIN(coarse->height-1, (y+1)/2));
+  // pairs of pixels on and in between coarse ones, then the clamped end:
+  const int n = MIN(coarse->width-1, wd/2);
+  for(int i=0;i<n;i++)
+  {
+    const float a = r0[i] + r1[i], b = r0[i+1] + r1[i+1];
+    out[2*i] = 0.5f*a;
+    out[2*i+1] = 0.25f*(a + b);
+  }
+  for(int x=2*n;x<wd;x++)
+  {
+    const int x0 = MIN(coarse->width-1, x/2), x1 = MIN(coarse->width-1, (x+1)/2);
+    out[x] = 0.25f*(r0[x0] + r1[x0] + r0[x1] + r1[x1]);
+  }
+}
+
+// one level of the decimated pyramid (scales > 0, planar float input):
+// coarse is the edge-aware filter of decompose_fused() at the even pixels
+// only, so half the resolution of the input, and detail is the input minus
+// coarse upsampled again by upsample_row(). synthesize() upsamples the same
+// way, so the reconstruction stays exact. the taps of a dilation 2 filter
+// around an even pixel only hit even pixels, so this runs the filter with
+// dilation 1 on the subsampled input, at a quarter of the cost of the scale.
+// even is scratch for the subsampled input, a float buffer the size of coarse.
+static inline int decompose_decimated(
+    const buffer_t *input,
+    buffer_t *coarse,
+    buffer_t *detail,
+    buffer_t *even,
+    int scale)
+{
+  assert(input->type == s_buf_float && coarse->type == s_buf_float);
+  const int wd = input->width, ht = input->height;
+  const int cw = coarse->width, ch = coarse->height;
+  assert(cw == decimated_size(wd, 1) && ch == decimated_size(ht, 1));
+  assert(detail->width == wd && detail->height == ht);
+  assert(even->type == s_buf_float && even->width == cw && even->height == ch);
+  INST_BEGIN();
+  int incomplete = 0; // signal whether or not the coarse buffer still contains undefined pixels
+#pragma omp parallel for default(shared)
+  for(int y=0;y<ch;y++) for(int k=0;k<3;k++)
+  {
+    const float *in = buffer_row(input, k, 2*y);
+    float *out = buffer_row(even, k, y);
+    for(int x=0;x<cw;x++) out[x] = in[2*x];
+  }
+#pragma omp parallel for default(shared)
+  for(int y=0;y<ch;y++)
+  { // coarse rows only, the detail is taken against the upsampled coarse below
+    INST_ROW_BEGIN();
+    int ty[5];
+    filter_taps(ty, y, 1, ch);
+    const float *in[5][3];
+    for(int j=0;j<5;j++) for(int k=0;k<3;k++) in[j][k] = buffer_row(even, k, ty[j]);
+    float *co[3];
+    for(int k=0;k<3;k++) co[k] = buffer_row(coarse, k, y);
+    if(decompose_fused_float_row(in, cw, 1, scale, co, 0))
+      incomplete = 1; // data race, but stays one in either case.
+    INST_ROW_END(s_inst_decompose_decimated, scale, INST_ALL, cw);
+  }
+  memset(detail->stats, 0, sizeof(detail->stats));
+#pragma omp parallel default(shared)
+  {
+    float *up = (float *)malloc(sizeof(float)*2*wd), *scratch = up + wd;
+    detail_stats_t stats[3] = {{0}}; // per thread partials
+#pragma omp for
+    for(int y=0;y<ht;y++)
+    {
+      INST_ROW_BEGIN();
+      for(int k=0;k<3;k++)
+      {
+        const float *in = buffer_row(input, k, y);
+        upsample_row(coarse, k, y, up, wd);
+        float *de = buffer_row_out(detail, k, y, scratch);
+        for(int x=0;x<wd;x++) de[x] = in[x] - up[x];
+        detail_stats_row(stats + k, de, wd);
+        buffer_store_row(detail, k, y, de);
+      }
+      INST_ROW_END(s_inst_decompose_decimated, scale, INST_ALL, wd);
+    }
+    free(up);
+#pragma omp critical
+    for(int k=0;k<3;k++) detail_stats_merge(detail->stats + k, stats + k);
+  }
+  INST_END(s_inst_decompose_decimated, scale, INST_ALL);
+  return incomplete;
+}
+
+// noise sigma of the detail band at a given scale, sigma is 1.0 at level 0
+// after variance stabilisation.
+static inline float shrink_sigma(
+    const int scale)
+{
+  const float sigma = 1.0f;
+  const float varf = sqrtf(2.0f + 2.0f * 4.0f*4.0f + 6.0f*6.0f)/16.0f; // about 0.5
+  return powf(varf, scale) * sigma;
+}
+
+// bayes shrink threshold T = sigma_n^2 / sqrtf(sigma_d^2 - sigma_n^2) for a
+// detail band with empirical variance sigma_d2.
+static inline float shrink_threshold(
+    const int scale,
+    const float sigma_d2)
+{
+  const float sigma_n = shrink_sigma(scale);
+  return sigma_n*sigma_n / sqrtf(fmaxf(1e-30f, sigma_d2 - sigma_n*sigma_n));
+}
+
+// soft thresholding of one detail coefficient
+static inline float shrink(
+    const float px,
+    const float thrs,
+    const float boost)
+{
+  const float d = fmaxf(0.0f, fabsf(px) - thrs)*boost;
+  return px > 0.0f ? d : -d;
+}
+
+static inline void synthesize(
+    buffer_t *output,
+    const buffer_t *coarse,
+    const buffer_t *detail,
+    int channel,
+    int scale)
+{
   fprintf(stderr, "synthesizing scale %d channel %d                     \r", scale, channel);
 #if 0
   const float thrs = 0.0;
   const float boost = 1.0;
 #else
-  // noise variance level 0: 1.0
-  const float sigma = 1.0f;
-  const float varf = sqrtf(2.0f + 2.0f * 4.0f*4.0f + 6.0f*6.0f)/16.0f; // about 0.5
-  const float sigma_n = powf(varf, scale) * sigma;
-  // bayes shrink: T = sigma_n^2 / sqrtf(sigma_d^2 - sigma_n^2)
-  // sigma_d^2 = 1/N sum detail(i)^2
-  float sigma_d2 = 0.0f;
-  int k = 0;
-  for(int y=0;y<detail->height;y++) for(int x=0;x<detail->width;x++)
-  {
-    const float d = buffer_get(detail, x, y, channel);
-    if(d > 0.0) // == 0 is probably coming from an unset pixel.
-    {
-      sigma_d2 = sigma_d2 * k/(k+1.0) + d*d * 1.0/(k+1.0);
-      k++;
-    }
-  }
-  sigma_d2 *= k/(k-1.0f); // unbiased empirical variance
+  // statistics of the detail band have been gathered during decompose():
+  const float sigma_d2 = detail_stats_variance(detail->stats + channel);
 
   // wavelet shrinkage threshold.
-  const float thrs = sigma_n*sigma_n / sqrtf(fmaxf(1e-30f, sigma_d2 - sigma_n*sigma_n));
+  const float thrs = shrink_threshold(scale, sigma_d2);
   const float boost = 1.0f;
-  fprintf(stderr, "\nscale %d sigma noise %g signal %g => thrs %g boost %g\n", scale, sigma_n, sqrtf(sigma_d2), thrs, boost);
+  fprintf(stderr, "\nscale %d sigma noise %g signal %g => thrs %g boost %g\n", scale, shrink_sigma(scale), sqrtf(sigma_d2), thrs, boost);
 #endif
-#pragma omp parallel for default(shared)
-  for(int y=0;y<coarse->height;y++)
+  // a coarse level of the decimated pyramid is smaller, see decompose_decimated():
+  const int wd = detail->width, ht = detail->height;
+  const int decimated = coarse->width != wd || coarse->height != ht;
+  INST_BEGIN();
+#pragma omp parallel default(shared)
   {
-    for(int x=0;x<coarse->width;x++)
+    float *scratch = (float *)malloc(sizeof(float)*2*wd), *up = scratch + wd;
+#pragma omp for
+    for(int y=0;y<ht;y++)
     {
+      INST_ROW_BEGIN();
       // coarse should not have any unset pixels any more at this point.
-      const float px = buffer_get(detail, x, y, channel);
-      const float d = fmaxf(0.0f, fabsf(px) - thrs)*boost;
-      if(px > 0.0f) buffer_set(output, x, y, channel, buffer_get(coarse, x, y, channel) + d);
-      else          buffer_set(output, x, y, channel, buffer_get(coarse, x, y, channel) - d);
+      const float *co = up;
+      if(decimated) upsample_row(coarse, channel, y, up, wd);
+      else co = buffer_row(coarse, channel, y);
+      const float *de = buffer_row_in(detail, channel, y, scratch);
+      float *out = buffer_row(output, channel, y);
+      for(int x=0;x<wd;x++)
+        out[x] = co[x] + shrink(de[x], thrs, boost);
+      INST_ROW_END(s_inst_synthesize, scale, channel, wd);
     }
+    free(scratch);
   }
+  INST_END(s_inst_synthesize, scale, channel);
 }
-